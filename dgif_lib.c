@@ -29,9 +29,19 @@ SPDX-License-Identifier: MIT
 /* compose unsigned little endian value */
 #define UNSIGNED_LITTLE_ENDIAN(lo, hi) ((lo) | ((hi) << 8))
 
+/* The way an interlaced image should be read - offsets and jumps... */
+static const int InterlacedOffset[] = {0, 4, 2, 1};
+static const int InterlacedJumps[] = {8, 8, 4, 2};
+
+static int DGifPushRead(GifPushStateType *Push, GifByteType *Buf, int Len);
+
 /* avoid extra function call in case we use fread (TVT) */
 static int InternalRead(GifFileType *gif, GifByteType *buf, int len) {
 	// fprintf(stderr, "### Read: %d\n", len);
+	if (((GifFilePrivateType *)gif->Private)->Push != NULL) {
+		return DGifPushRead(((GifFilePrivateType *)gif->Private)->Push,
+		                    buf, len);
+	}
 	return (((GifFilePrivateType *)gif->Private)->Read
 	            ? ((GifFilePrivateType *)gif->Private)->Read(gif, buf, len)
 	            : fread(buf, 1, len,
@@ -44,9 +54,31 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
                               int LineLen);
 static int DGifGetPrefixChar(const GifPrefixType *Prefix, int Code,
                              int ClearCode);
+static int DGifRunLength(const GifFilePrivateType *Private, int Code,
+                         int *Pixel);
+static int DGifCodeLength(const GifFilePrivateType *Private, int Code);
+static int DGifFirstPixel(const GifFilePrivateType *Private, int Code);
+static void DGifExpandCode(const GifFilePrivateType *Private, int Code,
+                           int Length, GifPixelType *Line, int Fill,
+                           GifByteType *Stack);
 static int DGifDecompressInput(GifFileType *GifFile, int *Code);
 static int DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf,
                              GifByteType *NextByte);
+static bool DGifPushCodeReady(const GifFilePrivateType *Private);
+static int DGifAllocRaster(GifFileType *GifFile);
+static int DGifAllocRasterBits(SavedImage *sp, int *Error);
+static int DGifSlurpRecords(GifFileType *GifFile, bool KeepCompressed);
+static int DGifDecodeRaster(GifFileType *GifFile, SavedImage *sp);
+static int DGifSaveCompressed(GifFileType *GifFile);
+static int DGifReadExtension(GifFileType *GifFile);
+static void DGifAttachExtensions(GifFileType *GifFile);
+static void DGifPushNextPass(GifPushStateType *Push, int Height);
+static int DGifCheckCanvasLimit(GifFileType *GifFile);
+static int DGifCheckImageLimits(GifFileType *GifFile);
+static int DGifCheckLZWRatio(GifFileType *GifFile, int Pixels);
+static unsigned long DGifLZWRatioRoom(const GifFilePrivateType *Private);
+static int DGifChargeAllocation(GifFileType *GifFile, size_t Bytes);
+static size_t DGifMapSize(int BitsPerPixel);
 
 /******************************************************************************
  Open a new GIF file for read, given by its name.
@@ -117,6 +149,7 @@ GifFileType *DGifOpenFileHandle(int FileHandle, int *Error) {
 	Private->FileHandle = FileHandle;
 	Private->File = f;
 	Private->FileState = FILE_STATE_READ;
+	Private->PrefixHigh = LZ_MAX_CODE + 1; /* Prefix[] not cleared yet */
 	Private->Read = NULL;     /* don't use alternate input method (TVT) */
 	GifFile->UserData = NULL; /* TVT */
 	/*@=mustfreeonly@*/
@@ -197,6 +230,7 @@ GifFileType *DGifOpen(void *userData, InputFunc readFunc, int *Error) {
 	Private->FileHandle = 0;
 	Private->File = NULL;
 	Private->FileState = FILE_STATE_READ;
+	Private->PrefixHigh = LZ_MAX_CODE + 1; /* Prefix[] not cleared yet */
 
 	Private->Read = readFunc;     /* TVT */
 	GifFile->UserData = userData; /* TVT */
@@ -262,6 +296,9 @@ int DGifGetScreenDesc(GifFileType *GifFile) {
 	    DGifGetWord(GifFile, &GifFile->SHeight) == GIF_ERROR) {
 		return GIF_ERROR;
 	}
+	if (DGifCheckCanvasLimit(GifFile) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
 
 	if (InternalRead(GifFile, Buf, 3) != 3) {
 		GifFile->Error = D_GIF_ERR_READ_FAILED;
@@ -277,6 +314,10 @@ int DGifGetScreenDesc(GifFileType *GifFile) {
 	if (Buf[0] & 0x80) { /* Do we have global color map? */
 		int i;
 
+		if (DGifChargeAllocation(GifFile, DGifMapSize(BitsPerPixel)) ==
+		    GIF_ERROR) {
+			return GIF_ERROR;
+		}
 		GifFile->SColorMap = GifMakeMapObject(1 << BitsPerPixel, NULL);
 		if (GifFile->SColorMap == NULL) {
 			GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
@@ -375,6 +416,9 @@ int DGifGetImageHeader(GifFileType *GifFile) {
 	    DGifGetWord(GifFile, &GifFile->Image.Height) == GIF_ERROR) {
 		return GIF_ERROR;
 	}
+	if (DGifCheckImageLimits(GifFile) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
 	if (InternalRead(GifFile, Buf, 1) != 1) {
 		GifFile->Error = D_GIF_ERR_READ_FAILED;
 		GifFreeMapObject(GifFile->Image.ColorMap);
@@ -440,6 +484,9 @@ int DGifGetImageDesc(GifFileType *GifFile) {
 		return GIF_ERROR;
 	}
 
+	if (DGifChargeAllocation(GifFile, sizeof(SavedImage)) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
 	if (GifFile->SavedImages) {
 		SavedImage *new_saved_images = (SavedImage *)reallocarray(
 		    GifFile->SavedImages, (GifFile->ImageCount + 1),
@@ -460,6 +507,12 @@ int DGifGetImageDesc(GifFileType *GifFile) {
 	sp = &GifFile->SavedImages[GifFile->ImageCount];
 	memcpy(&sp->ImageDesc, &GifFile->Image, sizeof(GifImageDesc));
 	if (GifFile->Image.ColorMap != NULL) {
+		if (DGifChargeAllocation(
+		        GifFile,
+		        DGifMapSize(GifFile->Image.ColorMap->BitsPerPixel)) ==
+		    GIF_ERROR) {
+			return GIF_ERROR;
+		}
 		sp->ImageDesc.ColorMap =
 		    GifMakeMapObject(GifFile->Image.ColorMap->ColorCount,
 		                     GifFile->Image.ColorMap->Colors);
@@ -704,6 +757,21 @@ int DGifCloseFile(GifFileType *GifFile, int *ErrorCode) {
 
 	Private = (GifFilePrivateType *)GifFile->Private;
 
+	if (Private->Compressed != NULL) {
+		int i;
+		for (i = 0; i < Private->CompressedCount; i++) {
+			free(Private->Compressed[i].Data);
+		}
+		free(Private->Compressed);
+		Private->Compressed = NULL;
+	}
+
+	if (Private->Push != NULL) {
+		free(Private->Push->Data);
+		free(Private->Push);
+		Private->Push = NULL;
+	}
+
 	if (!IS_READABLE(Private)) {
 		/* This file was NOT open for reading: */
 		if (ErrorCode != NULL) {
@@ -839,11 +907,16 @@ static int DGifSetupDecompress(GifFileType *GifFile) {
 	Private->LastCode = NO_SUCH_CODE;
 	Private->CrntShiftState = 0; /* No information in CrntShiftDWord. */
 	Private->CrntShiftDWord = 0;
+	Private->LZWBytes = 1; /* The code size */
+	Private->DecodedPixels = 0;
 
+	/* Only the codes the last image defined need clearing, which keeps
+	 * a run of tiny frames from paying for the whole table each */
 	Prefix = Private->Prefix;
-	for (i = 0; i <= LZ_MAX_CODE; i++) {
+	for (i = 0; i < Private->PrefixHigh; i++) {
 		Prefix[i] = NO_SUCH_CODE;
 	}
+	Private->PrefixHigh = 0;
 
 	return GIF_OK;
 }
@@ -858,6 +931,8 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
                               int LineLen) {
 	int i = 0;
 	int j, CrntCode, EOFCode, ClearCode, CrntPrefix, LastCode, StackPtr;
+	int NewCode, RunCount, RunPixel, Length, Fill;
+	unsigned long RatioRoom;
 	GifByteType *Stack, *Suffix;
 	GifPrefixType *Prefix;
 	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
@@ -869,6 +944,7 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 	EOFCode = Private->EOFCode;
 	ClearCode = Private->ClearCode;
 	LastCode = Private->LastCode;
+	RatioRoom = DGifLZWRatioRoom(Private);
 
 	if (StackPtr > LZ_MAX_CODE) {
 		return GIF_ERROR;
@@ -883,6 +959,24 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 	}
 
 	while (i < LineLen) { /* Decode LineLen items. */
+		if (Private->Push != NULL && !DGifPushCodeReady(Private)) {
+			/* Out of pushed input; keep our place for next time. */
+			Private->LastCode = LastCode;
+			Private->StackPtr = StackPtr;
+			Private->Push->Decoded = i;
+			if (DGifCheckLZWRatio(GifFile, i) == GIF_ERROR) {
+				return GIF_ERROR;
+			}
+			return GIF_NEED_MORE_DATA;
+		}
+		/* Stop a decompression bomb as it goes off, not after: */
+		if (Private->DecodedPixels + i >= RatioRoom) {
+			RatioRoom = DGifLZWRatioRoom(Private);
+			if (Private->DecodedPixels + i >= RatioRoom) {
+				GifFile->Error = D_GIF_ERR_LZW_RATIO;
+				return GIF_ERROR;
+			}
+		}
 		if (DGifDecompressInput(GifFile, &CrntCode) == GIF_ERROR) {
 			return GIF_ERROR;
 		}
@@ -895,10 +989,15 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 			GifFile->Error = D_GIF_ERR_EOF_TOO_SOON;
 			return GIF_ERROR;
 		} else if (CrntCode == ClearCode) {
-			/* We need to start over again: */
-			for (j = 0; j <= LZ_MAX_CODE; j++) {
+			/* We need to start over again.  Only the codes
+			 * defined since the last clear need forgetting, so a
+			 * stream of frequent clear codes costs no more than
+			 * the codes themselves: */
+			for (j = Private->EOFCode + 1; j < Private->PrefixHigh;
+			     j++) {
 				Prefix[j] = NO_SUCH_CODE;
 			}
+			Private->PrefixHigh = 0;
 			Private->RunningCode = Private->EOFCode + 1;
 			Private->RunningBits = Private->BitsPerPixel + 1;
 			Private->MaxCode1 = 1 << Private->RunningBits;
@@ -907,11 +1006,62 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 			/* Its regular code - if in pixel range simply add it to
 			 * output stream, otherwise trace to codes linked list
 			 * until the prefix is in pixel range: */
+			RunCount = Length = 0;
 			if (CrntCode < ClearCode) {
 				/* This is simple - its pixel scalar, so add it
 				 * to output: */
 				Line[i++] = CrntCode;
-			} else {
+			} else if (Prefix[CrntCode] != NO_SUCH_CODE) {
+				RunCount = DGifRunLength(Private, CrntCode,
+				                         &RunPixel);
+				Length = DGifCodeLength(Private, CrntCode);
+			} else if (CrntCode == Private->RunningCode - 2 &&
+			           LastCode != NO_SUCH_CODE) {
+				/* The code being defined; with LastCode a run,
+				 * it is that run one pixel longer */
+				RunCount = DGifRunLength(Private, LastCode,
+				                         &RunPixel);
+				RunCount += RunCount > 0;
+				Length = DGifCodeLength(Private, LastCode);
+				Length += Length > 0;
+			}
+			if (RunCount > 0) {
+				/* One pixel repeated: fill rather than
+				 * trace the codes, and stack what overflows
+				 * the line */
+				Fill = LineLen - i < RunCount ? LineLen - i
+				                              : RunCount;
+
+				memset(Line + i, RunPixel, Fill);
+				i += Fill;
+				StackPtr = RunCount - Fill;
+				memset(Stack, RunPixel, StackPtr);
+			} else if (Length > 0) {
+				/* A code of known length: write each pixel
+				 * once, straight to its place in the line or
+				 * on the stack, in one walk down the chain */
+				Fill = LineLen - i < Length ? LineLen - i
+				                            : Length;
+				StackPtr = Length - Fill;
+				if (Prefix[CrntCode] != NO_SUCH_CODE) {
+					DGifExpandCode(Private, CrntCode,
+					               Length, Line + i, Fill,
+					               Stack);
+				} else {
+					/* LastCode and its own first pixel */
+					RunPixel =
+					    DGifFirstPixel(Private, LastCode);
+					if (Length - 1 < Fill) {
+						Line[i + Length - 1] = RunPixel;
+					} else {
+						Stack[0] = RunPixel;
+					}
+					DGifExpandCode(Private, LastCode,
+					               Length - 1, Line + i,
+					               Fill, Stack + 1);
+				}
+				i += Fill;
+			} else if (CrntCode >= ClearCode) {
 				/* Its a code to needed to be traced: trace the
 				 * linked list until the prefix is a pixel,
 				 * while pushing the suffix pixels on our stack.
@@ -971,7 +1121,18 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 			if (LastCode != NO_SUCH_CODE &&
 			    Private->RunningCode - 2 < (LZ_MAX_CODE + 1) &&
 			    Prefix[Private->RunningCode - 2] == NO_SUCH_CODE) {
-				Prefix[Private->RunningCode - 2] = LastCode;
+				NewCode = Private->RunningCode - 2;
+
+				/* Known only if LastCode's length is, which
+				 * is asked first as it may be NewCode */
+				Length = DGifCodeLength(Private, LastCode);
+				Prefix[NewCode] = LastCode;
+				Private->CodeLength[NewCode] =
+				    Length > 0 ? Length + 1 : 0;
+				if (Length > 0) {
+					Private->FirstPixel[NewCode] =
+					    DGifFirstPixel(Private, LastCode);
+				}
 
 				if (CrntCode == Private->RunningCode - 2) {
 					/* Only allowed if CrntCode is exactly
@@ -981,12 +1142,23 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 					 * suffix char is exactly the prefix of
 					 * last code! */
 					Suffix[Private->RunningCode - 2] =
-					    DGifGetPrefixChar(Prefix, LastCode,
-					                      ClearCode);
+					    DGifFirstPixel(Private, LastCode);
 				} else {
 					Suffix[Private->RunningCode - 2] =
-					    DGifGetPrefixChar(Prefix, CrntCode,
-					                      ClearCode);
+					    DGifFirstPixel(Private, CrntCode);
+				}
+				if (Private->PrefixHigh <= NewCode) {
+					Private->PrefixHigh = NewCode + 1;
+				}
+
+				/* A run followed by its own pixel is a run */
+				Private->RunLength[NewCode] = 0;
+				RunCount = DGifRunLength(Private, LastCode,
+				                         &RunPixel);
+				if (RunCount > 0 &&
+				    Suffix[NewCode] == RunPixel) {
+					Private->RunLength[NewCode] =
+					    RunCount + 1;
 				}
 			}
 			LastCode = CrntCode;
@@ -996,7 +1168,74 @@ static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 	Private->LastCode = LastCode;
 	Private->StackPtr = StackPtr;
 
-	return GIF_OK;
+	return DGifCheckLZWRatio(GifFile, LineLen);
+}
+
+/******************************************************************************
+ If Code stands for a single pixel value repeated, as a solid fill encodes
+ to, return how many times and set Pixel to the value; otherwise return 0.
+******************************************************************************/
+static int DGifRunLength(const GifFilePrivateType *Private, int Code,
+                         int *Pixel) {
+	if (Code < Private->ClearCode) {
+		*Pixel = Code;
+		return 1;
+	}
+	if (Code > LZ_MAX_CODE || Private->Prefix[Code] == NO_SUCH_CODE) {
+		return 0;
+	}
+	*Pixel = Private->Suffix[Code];
+	return Private->RunLength[Code];
+}
+
+/******************************************************************************
+ Return how many pixels Code stands for, or 0 if its chain runs through a
+ code that was undefined when it was made, as only a defective image does.
+ A known length is good until the next clear code, since the codes along
+ the chain cannot change before then.
+******************************************************************************/
+static int DGifCodeLength(const GifFilePrivateType *Private, int Code) {
+	if (Code < Private->ClearCode) {
+		return 1;
+	}
+	if (Code > LZ_MAX_CODE || Private->Prefix[Code] == NO_SUCH_CODE) {
+		return 0;
+	}
+	return Private->CodeLength[Code];
+}
+
+/******************************************************************************
+ The first pixel of what Code stands for, the pixel value its chain ends in.
+ Remembered for codes of known length; others are traced.
+******************************************************************************/
+static int DGifFirstPixel(const GifFilePrivateType *Private, int Code) {
+	if (Code < Private->ClearCode) {
+		return Code;
+	}
+	if (DGifCodeLength(Private, Code) > 0) {
+		return Private->FirstPixel[Code];
+	}
+	return DGifGetPrefixChar(Private->Prefix, Code, Private->ClearCode);
+}
+
+/******************************************************************************
+ Expand Code, of known Length, the first Fill pixels into Line and the rest
+ onto Stack, last on the bottom, to be popped onto the next line.
+******************************************************************************/
+static void DGifExpandCode(const GifFilePrivateType *Private, int Code,
+                           int Length, GifPixelType *Line, int Fill,
+                           GifByteType *Stack) {
+	int i;
+
+	for (i = Length - 1; i >= Fill; i--) {
+		Stack[Length - 1 - i] = Private->Suffix[Code];
+		Code = Private->Prefix[Code];
+	}
+	for (; i > 0; i--) {
+		Line[i] = Private->Suffix[Code];
+		Code = Private->Prefix[Code];
+	}
+	Line[0] = Code;
 }
 
 /******************************************************************************
@@ -1133,6 +1372,7 @@ static int DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf,
 			GifFile->Error = D_GIF_ERR_READ_FAILED;
 			return GIF_ERROR;
 		}
+		((GifFilePrivateType *)GifFile->Private)->LZWBytes += Buf[0] + 1;
 		*NextByte = Buf[1];
 		Buf[1] = 2; /* We use now the second place as last char read! */
 		Buf[0]--;
@@ -1170,11 +1410,21 @@ void DGifDecreaseImageCounter(GifFileType *GifFile) {
  first to initialize I/O.  Its inverse is EGifSpew().
 *******************************************************************************/
 int DGifSlurp(GifFileType *GifFile) {
-	size_t ImageSize;
+	return DGifSlurpRecords(GifFile, false);
+}
+
+/******************************************************************************
+ Like DGifSlurp(), but keep each image's LZW data as it is instead of
+ decoding it; RasterBits stays NULL until DGifDecodeSavedImage() or
+ DGifDecodeSavedImages() fills it in.  As the LZW streams of different
+ images are independent, they can then be decoded in any order, or at once.
+******************************************************************************/
+int DGifSlurpCompressed(GifFileType *GifFile) {
+	return DGifSlurpRecords(GifFile, true);
+}
+
+static int DGifSlurpRecords(GifFileType *GifFile, bool KeepCompressed) {
 	GifRecordType RecordType;
-	SavedImage *sp;
-	GifByteType *ExtData;
-	int ExtFunction;
 
 	GifFile->ExtensionBlocks = NULL;
 	GifFile->ExtensionBlockCount = 0;
@@ -1189,107 +1439,30 @@ int DGifSlurp(GifFileType *GifFile) {
 			if (DGifGetImageDesc(GifFile) == GIF_ERROR) {
 				return (GIF_ERROR);
 			}
-
-			sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
-			/* Allocate memory for the image */
-			if (sp->ImageDesc.Width <= 0 ||
-			    sp->ImageDesc.Height <= 0 ||
-			    sp->ImageDesc.Width >
-			        (INT_MAX / sp->ImageDesc.Height)) {
-				DGifDecreaseImageCounter(GifFile);
-				return GIF_ERROR;
-			}
-			ImageSize = sp->ImageDesc.Width * sp->ImageDesc.Height;
-
-			if (ImageSize > (SIZE_MAX / sizeof(GifPixelType))) {
-				DGifDecreaseImageCounter(GifFile);
-				return GIF_ERROR;
-			}
-			sp->RasterBits = (unsigned char *)reallocarray(
-			    NULL, ImageSize, sizeof(GifPixelType));
-
-			if (sp->RasterBits == NULL) {
-				DGifDecreaseImageCounter(GifFile);
-				return GIF_ERROR;
-			}
-
-			if (sp->ImageDesc.Interlace) {
-				int i, j;
-				/*
-				 * The way an interlaced image should be read -
-				 * offsets and jumps...
-				 */
-				static const int InterlacedOffset[] = {0, 4, 2,
-				                                       1};
-				static const int InterlacedJumps[] = {8, 8, 4,
-				                                      2};
-				/* Need to perform 4 passes on the image */
-				for (i = 0; i < 4; i++) {
-					for (j = InterlacedOffset[i];
-					     j < sp->ImageDesc.Height;
-					     j += InterlacedJumps[i]) {
-						if (DGifGetLine(
-						        GifFile,
-						        sp->RasterBits +
-						            j * sp->ImageDesc
-						                    .Width,
-						        sp->ImageDesc.Width) ==
-						    GIF_ERROR) {
-							DGifDecreaseImageCounter(
-							    GifFile);
-							return GIF_ERROR;
-						}
-					}
+			if (KeepCompressed) {
+				if (DGifSaveCompressed(GifFile) == GIF_ERROR) {
+					return GIF_ERROR;
 				}
 			} else {
-				if (DGifGetLine(GifFile, sp->RasterBits,
-				                ImageSize) == GIF_ERROR) {
+				if (DGifAllocRaster(GifFile) == GIF_ERROR) {
+					return GIF_ERROR;
+				}
+				if (DGifDecodeRaster(
+				        GifFile,
+				        &GifFile->SavedImages[GifFile->ImageCount -
+				                              1]) == GIF_ERROR) {
 					DGifDecreaseImageCounter(GifFile);
 					return GIF_ERROR;
 				}
 			}
 
-			if (GifFile->ExtensionBlocks) {
-				sp->ExtensionBlocks = GifFile->ExtensionBlocks;
-				sp->ExtensionBlockCount =
-				    GifFile->ExtensionBlockCount;
-
-				GifFile->ExtensionBlocks = NULL;
-				GifFile->ExtensionBlockCount = 0;
-			}
+			DGifAttachExtensions(GifFile);
 			break;
 
 		case EXTENSION_RECORD_TYPE:
-			if (DGifGetExtension(GifFile, &ExtFunction, &ExtData) ==
-			    GIF_ERROR) {
+			if (DGifReadExtension(GifFile) == GIF_ERROR) {
 				return (GIF_ERROR);
 			}
-			/* Create an extension block with our data */
-			if (ExtData != NULL) {
-				if (GifAddExtensionBlock(
-				        &GifFile->ExtensionBlockCount,
-				        &GifFile->ExtensionBlocks, ExtFunction,
-				        ExtData[0], &ExtData[1]) == GIF_ERROR) {
-					return (GIF_ERROR);
-				}
-			}
-			for (;;) {
-				if (DGifGetExtensionNext(GifFile, &ExtData) ==
-				    GIF_ERROR) {
-					return (GIF_ERROR);
-				}
-				if (ExtData == NULL) {
-					break;
-				}
-				/* Continue the extension block */
-				if (GifAddExtensionBlock(
-				        &GifFile->ExtensionBlockCount,
-				        &GifFile->ExtensionBlocks,
-				        CONTINUE_EXT_FUNC_CODE, ExtData[0],
-				        &ExtData[1]) == GIF_ERROR) {
-					return (GIF_ERROR);
-				}
-			}
 			break;
 
 		case TERMINATE_RECORD_TYPE:
@@ -1309,4 +1482,1084 @@ int DGifSlurp(GifFileType *GifFile) {
 	return (GIF_OK);
 }
 
+/******************************************************************************
+ Decode the LZW data of the current image into sp->RasterBits.
+******************************************************************************/
+static int DGifDecodeRaster(GifFileType *GifFile, SavedImage *sp) {
+	if (sp->ImageDesc.Interlace) {
+		int i, j;
+		/* Need to perform 4 passes on the image */
+		for (i = 0; i < 4; i++) {
+			for (j = InterlacedOffset[i]; j < sp->ImageDesc.Height;
+			     j += InterlacedJumps[i]) {
+				if (DGifGetLine(GifFile,
+				                sp->RasterBits +
+				                    j * sp->ImageDesc.Width,
+				                sp->ImageDesc.Width) == GIF_ERROR) {
+					return GIF_ERROR;
+				}
+			}
+		}
+		return GIF_OK;
+	} else {
+		return DGifGetLine(GifFile, sp->RasterBits,
+		                   sp->ImageDesc.Width * sp->ImageDesc.Height);
+	}
+}
+
+/******************************************************************************
+ Copy the LZW data of the image just described, from its code size byte to
+ its block terminator, into Private->Compressed.
+******************************************************************************/
+static int DGifSaveCompressed(GifFileType *GifFile) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifCompressedImageType *Compressed;
+	GifByteType *CodeBlock, *NewData;
+	SavedImage *sp;
+	size_t Size = 256, Len;
+
+	Compressed = (GifCompressedImageType *)reallocarray(
+	    Private->Compressed, GifFile->ImageCount,
+	    sizeof(GifCompressedImageType));
+	if (Compressed == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		DGifDecreaseImageCounter(GifFile);
+		return GIF_ERROR;
+	}
+	Private->Compressed = Compressed;
+	Compressed = &Compressed[GifFile->ImageCount - 1];
+
+	/* Reserve the raster now; decoding may happen on another thread */
+	sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+	if (DGifChargeAllocation(GifFile, (size_t)sp->ImageDesc.Width *
+	                                          (size_t)sp->ImageDesc.Height +
+	                                      Size) == GIF_ERROR) {
+		DGifDecreaseImageCounter(GifFile);
+		return GIF_ERROR;
+	}
+	if ((Compressed->Data = (GifByteType *)malloc(Size)) == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		DGifDecreaseImageCounter(GifFile);
+		return GIF_ERROR;
+	}
+	/* DGifSetupDecompress() has already read the code size */
+	Compressed->Data[0] = (GifByteType)Private->BitsPerPixel;
+	Compressed->Len = 1;
+
+	do {
+		if (DGifGetCodeNext(GifFile, &CodeBlock) == GIF_ERROR) {
+			goto fail;
+		}
+		Len = (CodeBlock != NULL) ? CodeBlock[0] + 1 : 1;
+		if (Compressed->Len + Len > Size) {
+			size_t NewSize = Size;
+
+			while (Compressed->Len + Len > NewSize) {
+				NewSize *= 2;
+			}
+			if (DGifChargeAllocation(GifFile, NewSize - Size) ==
+			    GIF_ERROR) {
+				goto fail;
+			}
+			Size = NewSize;
+			NewData = (GifByteType *)realloc(Compressed->Data, Size);
+			if (NewData == NULL) {
+				GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+				goto fail;
+			}
+			Compressed->Data = NewData;
+		}
+		if (CodeBlock != NULL) {
+			memcpy(Compressed->Data + Compressed->Len, CodeBlock,
+			       Len);
+		} else {
+			Compressed->Data[Compressed->Len] = 0;
+		}
+		Compressed->Len += Len;
+	} while (CodeBlock != NULL);
+
+	/* The whole LZW stream is known, so check its ratio up front */
+	Private->LZWBytes = Compressed->Len;
+	if (DGifCheckLZWRatio(GifFile, sp->ImageDesc.Width *
+	                                   sp->ImageDesc.Height) == GIF_ERROR) {
+		goto fail;
+	}
+
+	Private->CompressedCount = GifFile->ImageCount;
+	return GIF_OK;
+
+fail:
+	free(Compressed->Data);
+	Compressed->Data = NULL;
+	DGifDecreaseImageCounter(GifFile);
+	return GIF_ERROR;
+}
+
+/* Input hook handing out an image's saved LZW data */
+typedef struct GifMemoryInput {
+	const GifByteType *Data;
+	size_t Pos, Len;
+} GifMemoryInput;
+
+static int DGifMemoryRead(GifFileType *GifFile, GifByteType *Buf, int Len) {
+	GifMemoryInput *Input = (GifMemoryInput *)GifFile->UserData;
+
+	if ((size_t)Len > Input->Len - Input->Pos) {
+		Len = (int)(Input->Len - Input->Pos);
+	}
+	memcpy(Buf, Input->Data + Input->Pos, Len);
+	Input->Pos += Len;
+	return Len;
+}
+
+/******************************************************************************
+ Decode one image saved by DGifSlurpCompressed() into its RasterBits,
+ allocating that if need be.  The decoder state lives on this call's own
+ heap storage and only SavedImages[ImageIndex] is written, so different
+ images may be decoded from different threads at the same time.  For the
+ same reason GifFile->Error is left alone; *ErrorCode (if non-NULL) gets the
+ error code instead.  On failure RasterBits is kept, partially decoded.
+******************************************************************************/
+int DGifDecodeSavedImage(GifFileType *GifFile, int ImageIndex,
+                         int *ErrorCode) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifFileType Decoder;
+	GifMemoryInput Input;
+	SavedImage *sp;
+	int Status;
+
+	memset(&Decoder, '\0', sizeof(GifFileType));
+	if (ImageIndex < 0 || ImageIndex >= GifFile->ImageCount ||
+	    ImageIndex >= Private->CompressedCount ||
+	    Private->Compressed[ImageIndex].Data == NULL) {
+		Decoder.Error = D_GIF_ERR_NO_IMAG_DSCR;
+		goto done;
+	}
+	sp = &GifFile->SavedImages[ImageIndex];
+	if (sp->RasterBits == NULL &&
+	    DGifAllocRasterBits(sp, &Decoder.Error) == GIF_ERROR) {
+		goto done;
+	}
+
+	Decoder.Private = calloc(1, sizeof(GifFilePrivateType));
+	if (Decoder.Private == NULL) {
+		Decoder.Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		goto done;
+	}
+	Input.Data = Private->Compressed[ImageIndex].Data;
+	Input.Pos = 0;
+	Input.Len = Private->Compressed[ImageIndex].Len;
+	Decoder.UserData = &Input;
+	((GifFilePrivateType *)Decoder.Private)->FileState = FILE_STATE_READ;
+	((GifFilePrivateType *)Decoder.Private)->Read = DGifMemoryRead;
+	((GifFilePrivateType *)Decoder.Private)->PrefixHigh = LZ_MAX_CODE + 1;
+	((GifFilePrivateType *)Decoder.Private)->PixelCount =
+	    (long)sp->ImageDesc.Width * (long)sp->ImageDesc.Height;
+
+	Status = DGifSetupDecompress(&Decoder);
+	if (Status == GIF_OK) {
+		Status = DGifDecodeRaster(&Decoder, sp);
+	}
+	if (Status == GIF_ERROR && Decoder.Error == D_GIF_SUCCEEDED) {
+		Decoder.Error = D_GIF_ERR_IMAGE_DEFECT;
+	}
+	free(Decoder.Private);
+
+done:
+	if (ErrorCode != NULL) {
+		*ErrorCode = Decoder.Error;
+	}
+	return (Decoder.Error == D_GIF_SUCCEEDED) ? GIF_OK : GIF_ERROR;
+}
+
+typedef struct GifDecodeJob {
+	GifFileType *GifFile;
+	int *Errors; /* Per image */
+} GifDecodeJob;
+
+static int DGifDecodeJob(void *Arg, int Index) {
+	GifDecodeJob *Job = (GifDecodeJob *)Arg;
+
+	return DGifDecodeSavedImage(Job->GifFile, Index, &Job->Errors[Index]);
+}
+
+/******************************************************************************
+ Decode every image saved by DGifSlurpCompressed(), spreading the work over
+ up to Threads threads (0 means one per online processor).  Threads are only
+ used if the library was built with HAVE_PTHREADS; otherwise the images are
+ decoded one after the other.  On failure, GifFile->Error is set from the
+ first image that could not be decoded.
+******************************************************************************/
+int DGifDecodeSavedImages(GifFileType *GifFile, int Threads) {
+	GifDecodeJob Job;
+	int i;
+
+	if (GifFile->ImageCount == 0) {
+		return GIF_OK;
+	}
+	Job.GifFile = GifFile;
+	Job.Errors = (int *)calloc(GifFile->ImageCount, sizeof(int));
+	if (Job.Errors == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	if (GifParallelFor(GifFile->ImageCount, Threads, DGifDecodeJob, &Job) ==
+	    GIF_ERROR) {
+		for (i = 0; Job.Errors[i] == D_GIF_SUCCEEDED; i++) {
+			continue;
+		}
+		GifFile->Error = Job.Errors[i];
+		free(Job.Errors);
+		return GIF_ERROR;
+	}
+
+	free(Job.Errors);
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Point *Code at the LZW data DGifSlurpCompressed() kept for image ImageIndex:
+ the code size byte, the data sub-blocks and the block terminator, *Len bytes
+ in all.  The data stays owned by GifFile; hand it to EGifPutImageCode() or
+ EGifSetSavedImageCode() to copy the image without decoding it.
+******************************************************************************/
+int DGifGetSavedImageCode(GifFileType *GifFile, int ImageIndex,
+                          const GifByteType **Code, size_t *Len) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+	if (ImageIndex < 0 || ImageIndex >= GifFile->ImageCount ||
+	    ImageIndex >= Private->CompressedCount ||
+	    Private->Compressed[ImageIndex].Data == NULL) {
+		GifFile->Error = D_GIF_ERR_NO_IMAG_DSCR;
+		return GIF_ERROR;
+	}
+	*Code = Private->Compressed[ImageIndex].Data;
+	*Len = Private->Compressed[ImageIndex].Len;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Return true if the canvas after image ImageIndex does not depend on any
+ earlier image: it is the first image, or it covers the whole screen and
+ has no transparent color.  Compositing of an animation can restart at such
+ a keyframe, so runs of frames between keyframes can be composited
+ independently.
+******************************************************************************/
+bool DGifSavedImageIsKeyframe(GifFileType *GifFile, int ImageIndex) {
+	GraphicsControlBlock GCB;
+	const GifImageDesc *Desc;
+
+	if (ImageIndex < 0 || ImageIndex >= GifFile->ImageCount) {
+		return false;
+	}
+	if (ImageIndex == 0) {
+		return true;
+	}
+
+	Desc = &GifFile->SavedImages[ImageIndex].ImageDesc;
+	if (Desc->Left != 0 || Desc->Top != 0 ||
+	    Desc->Width < GifFile->SWidth || Desc->Height < GifFile->SHeight) {
+		return false;
+	}
+	/* Without a GCB this leaves TransparentColor at NO_TRANSPARENT_COLOR */
+	(void)DGifSavedExtensionToGCB(GifFile, ImageIndex, &GCB);
+	return GCB.TransparentColor == NO_TRANSPARENT_COLOR;
+}
+
+/******************************************************************************
+ Allocate the raster of the image DGifGetImageDesc() has just added to
+ SavedImages.  On failure the image is dropped again.
+******************************************************************************/
+static int DGifAllocRaster(GifFileType *GifFile) {
+	SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+
+	if (DGifChargeAllocation(GifFile, (size_t)sp->ImageDesc.Width *
+	                                      (size_t)sp->ImageDesc.Height) ==
+	        GIF_ERROR ||
+	    DGifAllocRasterBits(sp, &GifFile->Error) == GIF_ERROR) {
+		DGifDecreaseImageCounter(GifFile);
+		return GIF_ERROR;
+	}
+	return GIF_OK;
+}
+
+static int DGifAllocRasterBits(SavedImage *sp, int *Error) {
+	size_t ImageSize;
+
+	if (sp->ImageDesc.Width <= 0 || sp->ImageDesc.Height <= 0 ||
+	    sp->ImageDesc.Width > (INT_MAX / sp->ImageDesc.Height)) {
+		*Error = D_GIF_ERR_IMAGE_DEFECT;
+		return GIF_ERROR;
+	}
+	ImageSize = sp->ImageDesc.Width * sp->ImageDesc.Height;
+
+	if (ImageSize > (SIZE_MAX / sizeof(GifPixelType))) {
+		*Error = D_GIF_ERR_DATA_TOO_BIG;
+		return GIF_ERROR;
+	}
+	sp->RasterBits =
+	    (unsigned char *)reallocarray(NULL, ImageSize, sizeof(GifPixelType));
+
+	if (sp->RasterBits == NULL) {
+		*Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Read an extension record (the introducer already consumed) and queue its
+ blocks on GifFile->ExtensionBlocks until the next image claims them.
+******************************************************************************/
+static int DGifReadExtension(GifFileType *GifFile) {
+	GifByteType *ExtData;
+	int ExtFunction;
+
+	if (DGifGetExtension(GifFile, &ExtFunction, &ExtData) == GIF_ERROR) {
+		return (GIF_ERROR);
+	}
+	/* Create an extension block with our data */
+	if (ExtData != NULL) {
+		if (DGifChargeAllocation(GifFile, sizeof(ExtensionBlock) +
+		                                      ExtData[0]) == GIF_ERROR) {
+			return (GIF_ERROR);
+		}
+		if (GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+		                         &GifFile->ExtensionBlocks, ExtFunction,
+		                         ExtData[0], &ExtData[1]) == GIF_ERROR) {
+			return (GIF_ERROR);
+		}
+	}
+	for (;;) {
+		if (DGifGetExtensionNext(GifFile, &ExtData) == GIF_ERROR) {
+			return (GIF_ERROR);
+		}
+		if (ExtData == NULL) {
+			break;
+		}
+		if (DGifChargeAllocation(GifFile, sizeof(ExtensionBlock) +
+		                                      ExtData[0]) == GIF_ERROR) {
+			return (GIF_ERROR);
+		}
+		/* Continue the extension block */
+		if (GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+		                         &GifFile->ExtensionBlocks,
+		                         CONTINUE_EXT_FUNC_CODE, ExtData[0],
+		                         &ExtData[1]) == GIF_ERROR) {
+			return (GIF_ERROR);
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Hand the extension blocks queued since the last image to the image just
+ read.
+******************************************************************************/
+static void DGifAttachExtensions(GifFileType *GifFile) {
+	SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+
+	if (GifFile->ExtensionBlocks) {
+		sp->ExtensionBlocks = GifFile->ExtensionBlocks;
+		sp->ExtensionBlockCount = GifFile->ExtensionBlockCount;
+
+		GifFile->ExtensionBlocks = NULL;
+		GifFile->ExtensionBlockCount = 0;
+	}
+}
+
+/******************************************************************************
+ Put limits on what decoding this GIF may cost, for untrusted input.  Each
+ limit is checked as soon as the data that could break it has been read:
+ screen size at the screen descriptor (at once if that has been read
+ already), image count and sizes at each image descriptor before anything
+ is allocated for the image, memory before each allocation (and at once,
+ for what is held already), and the LZW expansion ratio at each code as
+ decoding proceeds (or before decoding, when the whole stream is at hand).
+ The memory counted is what this handle holds for color maps, the image
+ list, rasters, saved LZW data, extension blocks and push-mode input.  A
+ zero field means no limit.
+******************************************************************************/
+int DGifSetLimits(GifFileType *GifFile, const GifDecodeLimits *Limits) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+	if (!IS_READABLE(Private)) {
+		/* This file was NOT open for reading: */
+		GifFile->Error = D_GIF_ERR_NOT_READABLE;
+		return GIF_ERROR;
+	}
+
+	Private->Limits = *Limits;
+	/* Memory already held, such as the global color map, counts too */
+	if (DGifChargeAllocation(GifFile, 0) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	/* Only push-mode handles may not have seen the screen yet */
+	if (Private->Push == NULL ||
+	    Private->Push->State != PUSH_STATE_HEADER) {
+		return DGifCheckCanvasLimit(GifFile);
+	}
+	return GIF_OK;
+}
+
+static int DGifCheckCanvasLimit(GifFileType *GifFile) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	unsigned long Max = Private->Limits.MaxCanvasPixels;
+
+	if (Max > 0 &&
+	    (unsigned long)GifFile->SWidth * GifFile->SHeight > Max) {
+		GifFile->Error = D_GIF_ERR_CANVAS_TOO_BIG;
+		return GIF_ERROR;
+	}
+	return GIF_OK;
+}
+
+/* Called with the size of a new image known, but nothing else read */
+static int DGifCheckImageLimits(GifFileType *GifFile) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	const GifDecodeLimits *Limits = &Private->Limits;
+	unsigned long Pixels =
+	    (unsigned long)GifFile->Image.Width * GifFile->Image.Height;
+
+	if (Limits->MaxImageCount > 0 &&
+	    Private->ImagesSeen >= Limits->MaxImageCount) {
+		GifFile->Error = D_GIF_ERR_TOO_MANY_IMAGES;
+		return GIF_ERROR;
+	}
+	if (Limits->MaxImagePixels > 0 && Pixels > Limits->MaxImagePixels) {
+		GifFile->Error = D_GIF_ERR_IMAGE_TOO_BIG;
+		return GIF_ERROR;
+	}
+	if (Limits->MaxTotalPixels > 0 &&
+	    Pixels > Limits->MaxTotalPixels - Private->TotalPixels) {
+		GifFile->Error = D_GIF_ERR_TOO_MANY_PIXELS;
+		return GIF_ERROR;
+	}
+	Private->ImagesSeen++;
+	Private->TotalPixels += Pixels;
+	return GIF_OK;
+}
+
+/* Account for Pixels more pixels decoded from the LZWBytes read so far */
+static int DGifCheckLZWRatio(GifFileType *GifFile, int Pixels) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+	Private->DecodedPixels += Pixels;
+	if (Private->Limits.MaxLZWRatio > 0 &&
+	    Private->DecodedPixels / Private->LZWBytes >
+	        Private->Limits.MaxLZWRatio) {
+		GifFile->Error = D_GIF_ERR_LZW_RATIO;
+		return GIF_ERROR;
+	}
+	return GIF_OK;
+}
+
+/*
+ * The decoded pixels of this image that would break the LZW ratio limit
+ * with only the LZW data read so far; the data still to come raises it.
+ */
+static unsigned long DGifLZWRatioRoom(const GifFilePrivateType *Private) {
+	if (Private->Limits.MaxLZWRatio == 0) {
+		return ULONG_MAX;
+	}
+	return (Private->Limits.MaxLZWRatio + 1UL) * Private->LZWBytes;
+}
+
+static int DGifChargeAllocation(GifFileType *GifFile, size_t Bytes) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	size_t Max = Private->Limits.MaxAllocation;
+
+	if (Max > 0 && (Bytes > Max || Private->Allocated > Max - Bytes)) {
+		GifFile->Error = D_GIF_ERR_ALLOC_LIMIT;
+		return GIF_ERROR;
+	}
+	Private->Allocated += Bytes;
+	return GIF_OK;
+}
+
+/* What GifMakeMapObject() allocates for a map of this many bits */
+static size_t DGifMapSize(int BitsPerPixel) {
+	return sizeof(ColorMapObject) +
+	       ((size_t)1 << BitsPerPixel) * sizeof(GifColorType);
+}
+
+/******************************************************************************
+ Skip Len bytes of input, seeking if the source is a seekable stdio stream.
+******************************************************************************/
+static int DGifSkipBytes(GifFileType *GifFile, size_t Len) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifByteType Buf[256];
+	int Chunk;
+
+	if (Private->File != NULL && Len <= LONG_MAX &&
+	    fseek(Private->File, (long)Len, SEEK_CUR) == 0) {
+		return GIF_OK;
+	}
+	while (Len > 0) {
+		Chunk = (Len < sizeof(Buf)) ? (int)Len : (int)sizeof(Buf);
+		/* coverity[check_return] */
+		if (InternalRead(GifFile, Buf, Chunk) != Chunk) {
+			GifFile->Error = D_GIF_ERR_READ_FAILED;
+			return GIF_ERROR;
+		}
+		Len -= Chunk;
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Scan the rest of a GIF opened by DGifOpenFileName() and friends, filling
+ in Info with the screen size, number of images, loop count, total delay
+ and whether any image has transparency.  Image data is skipped by hopping
+ over sub-blocks without decoding, extension blocks are read into a stack
+ buffer, and nothing is allocated; so this is cheap enough to run on every
+ file of an upload queue.  Afterwards the handle is at the end of the GIF
+ and is only good for DGifCloseFile().
+******************************************************************************/
+int DGifProbe(GifFileType *GifFile, GifProbeInfo *Info) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifRecordType RecordType;
+	GraphicsControlBlock GCB;
+	GifByteType Buf[256], Len;
+	bool LoopExtension;
+	int n, ExtCode;
+
+	if (!IS_READABLE(Private)) {
+		/* This file was NOT open for reading: */
+		GifFile->Error = D_GIF_ERR_NOT_READABLE;
+		return GIF_ERROR;
+	}
+
+	Info->SWidth = GifFile->SWidth;
+	Info->SHeight = GifFile->SHeight;
+	Info->ImageCount = 0;
+	Info->LoopCount = -1;
+	Info->TotalDelay = 0;
+	Info->HasTransparency = false;
+
+	do {
+		if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+
+		switch (RecordType) {
+		case IMAGE_DESC_RECORD_TYPE:
+			/* Left, Top, Width, Height and flags */
+			if (InternalRead(GifFile, Buf, 9) != 9) {
+				GifFile->Error = D_GIF_ERR_READ_FAILED;
+				return GIF_ERROR;
+			}
+			/* Any local color map, then the LZW code size */
+			n = 1;
+			if (Buf[8] & 0x80) {
+				n += 3 * (1 << ((Buf[8] & 0x07) + 1));
+			}
+			if (DGifSkipBytes(GifFile, n) == GIF_ERROR) {
+				return GIF_ERROR;
+			}
+			/* Hop over the LZW data sub-blocks */
+			do {
+				if (InternalRead(GifFile, &Len, 1) != 1) {
+					GifFile->Error = D_GIF_ERR_READ_FAILED;
+					return GIF_ERROR;
+				}
+				if (Len > 0 &&
+				    DGifSkipBytes(GifFile, Len) == GIF_ERROR) {
+					return GIF_ERROR;
+				}
+			} while (Len != 0);
+			Info->ImageCount++;
+			break;
+
+		case EXTENSION_RECORD_TYPE:
+			if (InternalRead(GifFile, Buf, 1) != 1) {
+				GifFile->Error = D_GIF_ERR_READ_FAILED;
+				return GIF_ERROR;
+			}
+			ExtCode = Buf[0];
+			LoopExtension = false;
+			for (n = 0;; n++) {
+				if (InternalRead(GifFile, &Len, 1) != 1) {
+					GifFile->Error = D_GIF_ERR_READ_FAILED;
+					return GIF_ERROR;
+				}
+				if (Len == 0) {
+					break;
+				}
+				/* Only look at sub-blocks that can matter */
+				if (!(ExtCode == GRAPHICS_EXT_FUNC_CODE &&
+				      n == 0) &&
+				    !(ExtCode == APPLICATION_EXT_FUNC_CODE &&
+				      n <= 1)) {
+					if (DGifSkipBytes(GifFile, Len) ==
+					    GIF_ERROR) {
+						return GIF_ERROR;
+					}
+					continue;
+				}
+				if (InternalRead(GifFile, Buf, Len) != Len) {
+					GifFile->Error = D_GIF_ERR_READ_FAILED;
+					return GIF_ERROR;
+				}
+				if (ExtCode == GRAPHICS_EXT_FUNC_CODE) {
+					if (DGifExtensionToGCB(Len, Buf,
+					                       &GCB) == GIF_OK) {
+						Info->TotalDelay +=
+						    GCB.DelayTime;
+						if (GCB.TransparentColor !=
+						    NO_TRANSPARENT_COLOR) {
+							Info->HasTransparency =
+							    true;
+						}
+					}
+				} else if (n == 0) {
+					LoopExtension =
+					    Len == 11 &&
+					    (memcmp(Buf, "NETSCAPE2.0", 11) ==
+					         0 ||
+					     memcmp(Buf, "ANIMEXTS1.0", 11) ==
+					         0);
+				} else if (LoopExtension && Len >= 3 &&
+				           Buf[0] == 1) {
+					Info->LoopCount =
+					    UNSIGNED_LITTLE_ENDIAN(Buf[1],
+					                           Buf[2]);
+				}
+			}
+			break;
+
+		case TERMINATE_RECORD_TYPE:
+			break;
+
+		default: /* Should be trapped by DGifGetRecordType */
+			break;
+		}
+	} while (RecordType != TERMINATE_RECORD_TYPE);
+
+	/* Sanity check for corrupted file */
+	if (Info->ImageCount == 0) {
+		GifFile->Error = D_GIF_ERR_NO_IMAG_DSCR;
+		return GIF_ERROR;
+	}
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Open a GIF for push-mode (incremental) decoding.  Nothing is read here;
+ the caller feeds bytes as they arrive with DGifPushData() and pulls decode
+ events with DGifPushDecode().  Decoded images accumulate in SavedImages
+ just as with DGifSlurp(), and the handle is released with DGifCloseFile().
+******************************************************************************/
+GifFileType *DGifOpenPush(void *userData, int *Error) {
+	GifFileType *GifFile;
+	GifFilePrivateType *Private;
+
+	GifFile = (GifFileType *)calloc(1, sizeof(GifFileType));
+	if (GifFile == NULL) {
+		if (Error != NULL) {
+			*Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		}
+		return NULL;
+	}
+
+	Private = (GifFilePrivateType *)calloc(1, sizeof(GifFilePrivateType));
+	if (Private == NULL) {
+		if (Error != NULL) {
+			*Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		}
+		free((char *)GifFile);
+		return NULL;
+	}
+
+	Private->Push = (GifPushStateType *)calloc(1, sizeof(GifPushStateType));
+	if (Private->Push == NULL) {
+		if (Error != NULL) {
+			*Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		}
+		free((char *)Private);
+		free((char *)GifFile);
+		return NULL;
+	}
+	Private->Push->State = PUSH_STATE_HEADER;
+
+	GifFile->Private = (void *)Private;
+	Private->FileHandle = -1;
+	Private->File = NULL;
+	Private->FileState = FILE_STATE_READ;
+	Private->PrefixHigh = LZ_MAX_CODE + 1; /* Prefix[] not cleared yet */
+	GifFile->UserData = userData; /* TVT */
+
+	GifFile->Error = 0;
+	return GifFile;
+}
+
+/******************************************************************************
+ Append Len bytes of GIF stream to the push-mode input.  The data is copied,
+ so the caller's buffer may be reused as soon as this returns.
+******************************************************************************/
+int DGifPushData(GifFileType *GifFile, const GifByteType *Data, size_t Len) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+
+	if (!IS_READABLE(Private) || Push == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_READABLE;
+		return GIF_ERROR;
+	}
+	if (Len == 0) {
+		return GIF_OK;
+	}
+
+	/* Drop what has already been consumed before growing the buffer */
+	if (Push->Start > 0) {
+		memmove(Push->Data, Push->Data + Push->Start,
+		        Push->End - Push->Start);
+		Push->End -= Push->Start;
+		Push->Start = 0;
+	}
+	if (Len > Push->Size - Push->End) {
+		size_t NewSize = Push->Size ? Push->Size : 4096;
+		GifByteType *NewData;
+
+		while (NewSize - Push->End < Len) {
+			if (NewSize > SIZE_MAX / 2) {
+				GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+				return GIF_ERROR;
+			}
+			NewSize *= 2;
+		}
+		if (DGifChargeAllocation(GifFile, NewSize - Push->Size) ==
+		    GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		NewData = (GifByteType *)realloc(Push->Data, NewSize);
+		if (NewData == NULL) {
+			GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		Push->Data = NewData;
+		Push->Size = NewSize;
+	}
+	memcpy(Push->Data + Push->End, Data, Len);
+	Push->End += Len;
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Ask for a row-replicated preview of interlaced images: after each pass the
+ rows not decoded yet are filled from the nearest decoded row above, and a
+ GIF_PUSH_IMAGE_PASS event is returned, so the whole raster is paintable
+ (8-row bands first, then 4, 2 and finally exact) long before the image is
+ complete.  Rows decoded by later passes overwrite the fill, so the final
+ raster is unaffected.
+******************************************************************************/
+int DGifPushSetPreview(GifFileType *GifFile, bool Preview) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+	if (!IS_READABLE(Private) || Private->Push == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_READABLE;
+		return GIF_ERROR;
+	}
+	Private->Push->Preview = Preview;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Push-mode counterpart of the stdio/callback readers: hand out what has been
+ pushed so far.  The state machine below only asks for bytes it has already
+ checked are there, so a short count means a defective stream.
+******************************************************************************/
+static int DGifPushRead(GifPushStateType *Push, GifByteType *Buf, int Len) {
+	size_t Avail = Push->End - Push->Start;
+
+	if ((size_t)Len > Avail) {
+		Len = (int)Avail;
+	}
+	memcpy(Buf, Push->Data + Push->Start, Len);
+	Push->Start += Len;
+	return Len;
+}
+
+/******************************************************************************
+ Return true if enough LZW input is buffered to decode the next code, or if
+ a zero-length sub-block is in the way (DGifBufferedInput() reports that).
+******************************************************************************/
+static bool DGifPushCodeReady(const GifFilePrivateType *Private) {
+	const GifPushStateType *Push = Private->Push;
+	int Bits = Private->CrntShiftState + 8 * Private->Buf[0];
+	size_t Pos = Push->Start;
+
+	while (Bits < Private->RunningBits) {
+		if (Pos >= Push->End) {
+			return false;
+		}
+		if (Push->Data[Pos] == 0) {
+			return true;
+		}
+		if (Push->End - Pos <= Push->Data[Pos]) {
+			return false;
+		}
+		Bits += 8 * Push->Data[Pos];
+		Pos += Push->Data[Pos] + 1;
+	}
+	return true;
+}
+
+/* Screen descriptor: signature, then the descriptor and any global map */
+static int DGifPushHeader(GifFileType *GifFile, GifPushEvent *Event) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	const GifByteType *Data = Push->Data + Push->Start;
+	size_t Avail = Push->End - Push->Start, Need = GIF_STAMP_LEN + 7;
+	char Buf[GIF_STAMP_LEN + 1];
+
+	/* Reject non-GIF input as soon as the signature is in */
+	if (Avail >= GIF_VERSION_POS &&
+	    strncmp(GIF_STAMP, (const char *)Data, GIF_VERSION_POS) != 0) {
+		GifFile->Error = D_GIF_ERR_NOT_GIF_FILE;
+		return GIF_ERROR;
+	}
+	if (Avail < Need) {
+		return GIF_NEED_MORE_DATA;
+	}
+	if (Data[GIF_STAMP_LEN + 4] & 0x80) {
+		Need += 3 * (1 << ((Data[GIF_STAMP_LEN + 4] & 0x07) + 1));
+		if (Avail < Need) {
+			return GIF_NEED_MORE_DATA;
+		}
+	}
+
+	(void)InternalRead(GifFile, (GifByteType *)Buf, GIF_STAMP_LEN);
+	if (DGifGetScreenDesc(GifFile) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	Private->gif89 = (Buf[GIF_VERSION_POS + 1] == '9');
+
+	Push->State = PUSH_STATE_RECORD;
+	Event->Type = GIF_PUSH_SCREEN_DESC;
+	return GIF_OK;
+}
+
+/* Next record: an image header, a whole extension, or the trailer */
+static int DGifPushRecord(GifFileType *GifFile, GifPushEvent *Event) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	const GifByteType *Data = Push->Data + Push->Start;
+	size_t Avail = Push->End - Push->Start, Need;
+	GifRecordType RecordType;
+
+	if (Avail < 1) {
+		return GIF_NEED_MORE_DATA;
+	}
+	switch (Data[0]) {
+	case DESCRIPTOR_INTRODUCER:
+		/* Introducer, descriptor, local map, LZW code size */
+		Need = 11;
+		if (Avail < Need) {
+			return GIF_NEED_MORE_DATA;
+		}
+		if (Data[9] & 0x80) {
+			Need += 3 * (1 << ((Data[9] & 0x07) + 1));
+			if (Avail < Need) {
+				return GIF_NEED_MORE_DATA;
+			}
+		}
+		if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR ||
+		    DGifGetImageDesc(GifFile) == GIF_ERROR ||
+		    DGifAllocRaster(GifFile) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		Push->Pass = Push->Row = Push->Col = 0;
+		Push->State = PUSH_STATE_IMAGE_DATA;
+		Event->Type = GIF_PUSH_IMAGE_BEGIN;
+		return GIF_OK;
+
+	case EXTENSION_INTRODUCER:
+		/* Wait for the whole extension, terminator included */
+		for (Need = 2;; Need += Data[Need] + 1) {
+			if (Need >= Avail) {
+				return GIF_NEED_MORE_DATA;
+			}
+			if (Data[Need] == 0) {
+				break;
+			}
+		}
+		if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		return DGifReadExtension(GifFile);
+
+	case TERMINATOR_INTRODUCER:
+		if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		/* Sanity check for corrupted file */
+		if (GifFile->ImageCount == 0) {
+			GifFile->Error = D_GIF_ERR_NO_IMAG_DSCR;
+			return GIF_ERROR;
+		}
+		Push->State = PUSH_STATE_TERMINATED;
+		Event->Type = GIF_PUSH_TERMINATE;
+		return GIF_OK;
+
+	default: /* DGifGetRecordType() reports it */
+		(void)DGifGetRecordType(GifFile, &RecordType);
+		return GIF_ERROR;
+	}
+}
+
+/* Decode (the rest of) one raster row */
+static int DGifPushImageData(GifFileType *GifFile, GifPushEvent *Event) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+	GifPixelType *Line =
+	    sp->RasterBits + (size_t)Push->Row * sp->ImageDesc.Width;
+	int Status;
+
+	Status = DGifDecompressLine(GifFile, Line + Push->Col,
+	                            sp->ImageDesc.Width - Push->Col);
+	if (Status == GIF_NEED_MORE_DATA) {
+		Push->Col += Push->Decoded;
+		return Status;
+	} else if (Status == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+
+	Event->Type = GIF_PUSH_IMAGE_ROW;
+	Event->Row = Push->Row;
+
+	/* Move on to the next row, pass by pass if interlaced */
+	Push->Col = 0;
+	if (sp->ImageDesc.Interlace) {
+		Push->Row += InterlacedJumps[Push->Pass];
+		if (Push->Row >= sp->ImageDesc.Height) {
+			if (Push->Preview) {
+				Push->State = PUSH_STATE_IMAGE_PASS;
+			} else {
+				DGifPushNextPass(Push, sp->ImageDesc.Height);
+			}
+		}
+	} else if (++Push->Row >= sp->ImageDesc.Height) {
+		Push->State = PUSH_STATE_IMAGE_TAIL;
+	}
+	return GIF_OK;
+}
+
+/* Move on to the first row of the next non-empty interlace pass */
+static void DGifPushNextPass(GifPushStateType *Push, int Height) {
+	do {
+		if (++Push->Pass >= 4) {
+			Push->State = PUSH_STATE_IMAGE_TAIL;
+			return;
+		}
+		Push->Row = InterlacedOffset[Push->Pass];
+	} while (Push->Row >= Height);
+	Push->State = PUSH_STATE_IMAGE_DATA;
+}
+
+/* Fill the rows below each row of the pass just done, for a preview */
+static int DGifPushImagePass(GifFileType *GifFile, GifPushEvent *Event) {
+	/* Rows each decoded row stands for once passes 0-3 are done */
+	static const int BandHeight[] = {8, 4, 2, 1};
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+	size_t Width = sp->ImageDesc.Width;
+	int Height = sp->ImageDesc.Height;
+	int Row, j;
+
+	for (Row = InterlacedOffset[Push->Pass]; Row < Height;
+	     Row += InterlacedJumps[Push->Pass]) {
+		GifPixelType *Line = sp->RasterBits + Row * Width;
+
+		for (j = 1; j < BandHeight[Push->Pass] && Row + j < Height;
+		     j++) {
+			memcpy(Line + j * Width, Line, Width);
+		}
+	}
+
+	Event->Type = GIF_PUSH_IMAGE_PASS;
+	Event->Pass = Push->Pass;
+	DGifPushNextPass(Push, Height);
+	return GIF_OK;
+}
+
+/* Skip whatever follows the last pixel up to the block terminator */
+static int DGifPushImageTail(GifFileType *GifFile, GifPushEvent *Event) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	GifByteType *CodeBlock;
+
+	do {
+		size_t Avail = Push->End - Push->Start;
+
+		if (Avail < 1 || Avail <= Push->Data[Push->Start]) {
+			return GIF_NEED_MORE_DATA;
+		}
+		if (DGifGetCodeNext(GifFile, &CodeBlock) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	} while (CodeBlock != NULL);
+
+	DGifAttachExtensions(GifFile);
+	Push->State = PUSH_STATE_RECORD;
+	Event->Type = GIF_PUSH_IMAGE_END;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Advance the push-mode decoder as far as the input pushed so far allows.
+ Returns GIF_OK with *Event filled in each time something of interest has
+ been decoded, GIF_NEED_MORE_DATA once the input runs dry (push more and call
+ again), or GIF_ERROR, after which the decoder stays failed.
+******************************************************************************/
+int DGifPushDecode(GifFileType *GifFile, GifPushEvent *Event) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifPushStateType *Push = Private->Push;
+	int Status;
+
+	if (!IS_READABLE(Private) || Push == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_READABLE;
+		return GIF_ERROR;
+	}
+
+	Event->Row = Event->Pass = -1;
+	do {
+		Event->Type = 0;
+		switch (Push->State) {
+		case PUSH_STATE_HEADER:
+			Status = DGifPushHeader(GifFile, Event);
+			break;
+		case PUSH_STATE_RECORD:
+			Status = DGifPushRecord(GifFile, Event);
+			break;
+		case PUSH_STATE_IMAGE_DATA:
+			Status = DGifPushImageData(GifFile, Event);
+			break;
+		case PUSH_STATE_IMAGE_PASS:
+			Status = DGifPushImagePass(GifFile, Event);
+			break;
+		case PUSH_STATE_IMAGE_TAIL:
+			Status = DGifPushImageTail(GifFile, Event);
+			break;
+		case PUSH_STATE_TERMINATED:
+			Event->Type = GIF_PUSH_TERMINATE;
+			Status = GIF_OK;
+			break;
+		default: /* PUSH_STATE_FAILED */
+			return GIF_ERROR;
+		}
+	} while (Status == GIF_OK && Event->Type == 0);
+
+	if (Status == GIF_ERROR) {
+		Push->State = PUSH_STATE_FAILED;
+	}
+	Event->ImageIndex = GifFile->ImageCount - 1;
+	return Status;
+}
+
 /* end */
@@ -34,11 +34,17 @@ static const GifPixelType CodeMask[] = {0x00, 0x01, 0x03, 0x07, 0x0f,
 /*@-charint@*/
 
 static int EGifPutWord(int Word, GifFileType *GifFile);
+static int EGifWriteImageDesc(GifFileType *GifFile, const int Left,
+                              const int Top, const int Width, const int Height,
+                              const bool Interlace,
+                              const ColorMapObject *ColorMap);
 static int EGifSetupCompress(GifFileType *GifFile);
 static int EGifCompressLine(GifFileType *GifFile, const GifPixelType *Line,
                             const int LineLen);
 static int EGifCompressOutput(GifFileType *GifFile, int Code);
 static int EGifBufferedOutput(GifFileType *GifFile, GifByteType *Buf, int c);
+static unsigned long EGifExtensionsSize(const ExtensionBlock *ExtensionBlocks,
+                                        int ExtensionBlockCount);
 
 /* extract bytes from an unsigned word */
 #define LOBYTE(x) ((x)&0xff)
@@ -367,6 +373,112 @@ int EGifPutScreenDesc(GifFileType *GifFile, const int Width, const int Height,
 int EGifPutImageDesc(GifFileType *GifFile, const int Left, const int Top,
                      const int Width, const int Height, const bool Interlace,
                      const ColorMapObject *ColorMap) {
+	if (EGifWriteImageDesc(GifFile, Left, Top, Width, Height, Interlace,
+	                       ColorMap) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+
+	/* Reset compress algorithm parameters. */
+	(void)EGifSetupCompress(GifFile);
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Put an image whose LZW data is already at hand, as DGifGetSavedImageCode()
+ gives it: the image descriptor from ImageDesc, then Code unchanged.  Code
+ must hold the code size byte, the data sub-blocks and the block terminator,
+ and nothing more; the sub-block chain is checked before anything is
+ written.  Nothing is decoded or compressed, so this runs at I/O speed.
+******************************************************************************/
+int EGifPutImageCode(GifFileType *GifFile, const GifImageDesc *ImageDesc,
+                     const GifByteType *Code, size_t Len) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	size_t Pos = 1;
+
+	if (Len < 2 || Code[0] > 8) {
+		GifFile->Error = E_GIF_ERR_BAD_CODE;
+		return GIF_ERROR;
+	}
+	while (Pos < Len - 1 && Code[Pos] != 0) {
+		Pos += Code[Pos] + 1;
+	}
+	if (Pos != Len - 1 || Code[Pos] != 0) {
+		GifFile->Error = E_GIF_ERR_BAD_CODE;
+		return GIF_ERROR;
+	}
+
+	if (EGifWriteImageDesc(GifFile, ImageDesc->Left, ImageDesc->Top,
+	                       ImageDesc->Width, ImageDesc->Height,
+	                       ImageDesc->Interlace,
+	                       ImageDesc->ColorMap) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	if ((size_t)InternalWrite(GifFile, Code, Len) != Len) {
+		GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+		return GIF_ERROR;
+	}
+	Private->PixelCount = 0; /* The whole image is out */
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Give image ImageIndex of SavedImages the LZW data Code (as for
+ EGifPutImageCode()), so EGifSpew() writes that unchanged while RasterBits
+ is NULL.  The data is copied; a NULL Code drops what the image had.
+******************************************************************************/
+int EGifSetSavedImageCode(GifFileType *GifFile, int ImageIndex,
+                          const GifByteType *Code, size_t Len) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	GifByteType *Data;
+
+	if (ImageIndex < 0 || ImageIndex >= GifFile->ImageCount) {
+		GifFile->Error = E_GIF_ERR_BAD_INDEX;
+		return GIF_ERROR;
+	}
+	if (ImageIndex >= Private->CompressedCount) {
+		GifCompressedImageType *Compressed =
+		    (GifCompressedImageType *)reallocarray(
+		        Private->Compressed, GifFile->ImageCount,
+		        sizeof(GifCompressedImageType));
+		if (Compressed == NULL) {
+			GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		memset(Compressed + Private->CompressedCount, '\0',
+		       (GifFile->ImageCount - Private->CompressedCount) *
+		           sizeof(GifCompressedImageType));
+		Private->Compressed = Compressed;
+		Private->CompressedCount = GifFile->ImageCount;
+	}
+
+	if (Code == NULL) {
+		free(Private->Compressed[ImageIndex].Data);
+		Private->Compressed[ImageIndex].Data = NULL;
+		Private->Compressed[ImageIndex].Len = 0;
+		return GIF_OK;
+	}
+	if ((Data = (GifByteType *)malloc(Len)) == NULL) {
+		GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	memcpy(Data, Code, Len);
+	free(Private->Compressed[ImageIndex].Data);
+	Private->Compressed[ImageIndex].Data = Data;
+	Private->Compressed[ImageIndex].Len = Len;
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Write an image descriptor and local color map, leaving the LZW data to the
+ caller.
+******************************************************************************/
+static int EGifWriteImageDesc(GifFileType *GifFile, const int Left,
+                              const int Top, const int Width, const int Height,
+                              const bool Interlace,
+                              const ColorMapObject *ColorMap) {
 	GifByteType Buf[3];
 	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
 
@@ -438,9 +550,6 @@ int EGifPutImageDesc(GifFileType *GifFile, const int Left, const int Top,
 	Private->FileState |= FILE_STATE_IMAGE;
 	Private->PixelCount = (long)Width * (long)Height;
 
-	/* Reset compress algorithm parameters. */
-	(void)EGifSetupCompress(GifFile);
-
 	return GIF_OK;
 }
 
@@ -791,6 +900,13 @@ int EGifCloseFile(GifFileType *GifFile, int *ErrorCode) {
 		if (Private->HashTable) {
 			free((char *)Private->HashTable);
 		}
+		if (Private->Compressed != NULL) {
+			int i;
+			for (i = 0; i < Private->CompressedCount; i++) {
+				free(Private->Compressed[i].Data);
+			}
+			free(Private->Compressed);
+		}
 		free((char *)Private);
 
 		if (File && fclose(File) != 0) {
@@ -1048,6 +1164,205 @@ static int EGifBufferedOutput(GifFileType *GifFile, GifByteType *Buf, int c) {
 	return GIF_OK;
 }
 
+/******************************************************************************
+ Count the bytes EGifPutImageDesc() and EGifPutLine() would write for the
+ image data of a Width by Height raster with BitsPerPixel bits per pixel:
+ the code size byte, the LZW codes in their sub-blocks, and the empty
+ block ending them.  The dictionary logic is that of EGifCompressLine(),
+ but nothing is buffered or written.  Rows are taken in interlaced order
+ if Interlace is set, and pixels pass through Translation if it is not
+ NULL.  With Sample above 1 only one row in Sample is compressed, and the
+ bits counted are scaled up to all the rows.  Returns -1 if memory runs
+ out.
+******************************************************************************/
+long EGifImageCodeSize(int BitsPerPixel, const GifPixelType *Raster,
+                       int Width, int Height, bool Interlace,
+                       const GifPixelType *Translation, int Sample) {
+	static const int InterlacedOffset[] = {0, 4, 2, 1};
+	static const int InterlacedJumps[] = {8, 8, 4, 2};
+	GifHashTableType *HashTable;
+	GifPixelType Mask;
+	int EOFCode, RunningCode, RunningBits, MaxCode1, CrntCode = FIRST_CODE;
+	int Pass, Passes = Interlace ? 4 : 1, Row, i;
+	int RowsSeen = 0, RowsKept = 0;
+	unsigned long Bits = 0, Bytes;
+
+	if (BitsPerPixel < 2) {
+		BitsPerPixel = 2;
+	}
+	if ((HashTable = _InitHashTable()) == NULL) {
+		return -1;
+	}
+	Mask = CodeMask[BitsPerPixel];
+	EOFCode = (1 << BitsPerPixel) + 1;
+	RunningCode = EOFCode + 1;
+	RunningBits = BitsPerPixel + 1;
+	MaxCode1 = 1 << RunningBits;
+
+/* Account for one code the way EGifCompressOutput() would */
+#define COUNT_CODE()                                                           \
+	do {                                                                   \
+		Bits += RunningBits;                                           \
+		if (RunningCode >= MaxCode1) {                                 \
+			MaxCode1 = 1 << ++RunningBits;                         \
+		}                                                              \
+	} while (0)
+
+	COUNT_CODE(); /* The clear code starting the data */
+	for (Pass = 0; Pass < Passes; Pass++) {
+		int Step = Interlace ? InterlacedJumps[Pass] : 1;
+
+		for (Row = Interlace ? InterlacedOffset[Pass] : 0;
+		     Row < Height; Row += Step) {
+			const GifPixelType *Line =
+			    Raster + (size_t)Row * (size_t)Width;
+
+			if (Sample > 1 && RowsSeen++ % Sample != 0) {
+				continue;
+			}
+			RowsKept++;
+			for (i = 0; i < Width; i++) {
+				GifPixelType Pixel =
+				    (Translation ? Translation[Line[i]]
+				                 : Line[i]) &
+				    Mask;
+				uint32_t NewKey;
+				int NewCode;
+
+				if (CrntCode == FIRST_CODE) {
+					CrntCode = Pixel;
+					continue;
+				}
+				NewKey = (((uint32_t)CrntCode) << 8) + Pixel;
+				if ((NewCode = _ExistsHashTable(HashTable,
+				                                NewKey)) >= 0) {
+					CrntCode = NewCode;
+					continue;
+				}
+				COUNT_CODE();
+				CrntCode = Pixel;
+				if (RunningCode >= LZ_MAX_CODE) {
+					COUNT_CODE(); /* A clear code */
+					RunningCode = EOFCode + 1;
+					RunningBits = BitsPerPixel + 1;
+					MaxCode1 = 1 << RunningBits;
+					_ClearHashTable(HashTable);
+				} else {
+					_InsertHashTable(HashTable, NewKey,
+					                 RunningCode++);
+				}
+			}
+		}
+	}
+	if (CrntCode != FIRST_CODE) {
+		COUNT_CODE(); /* The last string */
+	}
+	COUNT_CODE(); /* The EOF code */
+#undef COUNT_CODE
+	free(HashTable);
+	if (Sample > 1 && RowsKept > 0) {
+		Bits = (unsigned long)((double)Bits * Height / RowsKept + 0.5);
+	}
+
+	/* Code size byte, blocks of up to 255 bytes behind a length byte,
+	 * and the empty block at the end */
+	Bytes = (Bits + 7) / 8;
+	return (long)(1 + Bytes + (Bytes + 254) / 255 + 1);
+}
+
+/******************************************************************************
+ Count the bytes EGifSpew() would write for the in-core GIF, without
+ writing any: the whole file if ImageIndex is negative, or else the
+ extensions, descriptor, color map and image data of the one saved image.
+ Only the LZW dictionary is run, so this is much cheaper than encoding to
+ a discarding output function, and it works on any GifFile, open for
+ reading or writing.  With Sample 0 or 1 the count is exact.  Above that,
+ only one row in Sample of each image is compressed and scaled up, for a
+ quicker estimate.
+******************************************************************************/
+int EGifEstimateSize(GifFileType *GifFile, int ImageIndex, int Sample,
+                     unsigned long *Size) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+	unsigned long Total = 0;
+	int First = ImageIndex, Last = ImageIndex, i;
+
+	if (ImageIndex >= GifFile->ImageCount) {
+		GifFile->Error = E_GIF_ERR_BAD_INDEX;
+		return GIF_ERROR;
+	}
+	if (ImageIndex < 0) {
+		/* Header, screen descriptor, global map, trailing extensions
+		 * and the trailer */
+		Total = 6 + 7 + 1 +
+		        EGifExtensionsSize(GifFile->ExtensionBlocks,
+		                           GifFile->ExtensionBlockCount);
+		if (GifFile->SColorMap != NULL) {
+			Total += 3 * GifFile->SColorMap->ColorCount;
+		}
+		First = 0;
+		Last = GifFile->ImageCount - 1;
+	}
+
+	for (i = First; i <= Last; i++) {
+		const SavedImage *sp = &GifFile->SavedImages[i];
+		const ColorMapObject *Map = sp->ImageDesc.ColorMap;
+		bool Copied = sp->RasterBits == NULL &&
+		              i < Private->CompressedCount &&
+		              Private->Compressed[i].Data != NULL;
+		long Len;
+
+		if (sp->RasterBits == NULL && !Copied) {
+			continue; /* EGifSpew() skips it */
+		}
+		Total += EGifExtensionsSize(sp->ExtensionBlocks,
+		                            sp->ExtensionBlockCount);
+		Total += 10 + (Map != NULL ? 3 * Map->ColorCount : 0);
+		if (Copied) {
+			Total += Private->Compressed[i].Len;
+			continue;
+		}
+		if (Map == NULL && (Map = GifFile->SColorMap) == NULL) {
+			GifFile->Error = E_GIF_ERR_NO_COLOR_MAP;
+			return GIF_ERROR;
+		}
+		Len = EGifImageCodeSize(Map->BitsPerPixel, sp->RasterBits,
+		                        sp->ImageDesc.Width,
+		                        sp->ImageDesc.Height,
+		                        sp->ImageDesc.Interlace, NULL, Sample);
+		if (Len < 0) {
+			GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		Total += Len;
+	}
+
+	*Size = Total;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Bytes EGifWriteExtensions() writes for a list of extension blocks.
+******************************************************************************/
+static unsigned long EGifExtensionsSize(const ExtensionBlock *ExtensionBlocks,
+                                        int ExtensionBlockCount) {
+	unsigned long Total = 0;
+	int j;
+
+	for (j = 0; ExtensionBlocks != NULL && j < ExtensionBlockCount; j++) {
+		const ExtensionBlock *ep = &ExtensionBlocks[j];
+
+		if (ep->Function != CONTINUE_EXT_FUNC_CODE) {
+			Total += 2; /* Introducer and label */
+		}
+		Total += 1 + ep->ByteCount;
+		if (j == ExtensionBlockCount - 1 ||
+		    (ep + 1)->Function != CONTINUE_EXT_FUNC_CODE) {
+			Total += 1; /* Block terminator */
+		}
+	}
+	return Total;
+}
+
 /******************************************************************************
  This routine writes to disk an in-core representation of a GIF previously
  created by DGifSlurp().
@@ -1086,6 +1401,7 @@ static int EGifWriteExtensions(GifFileType *GifFileOut,
 }
 
 int EGifSpew(GifFileType *GifFileOut) {
+	GifFilePrivateType *Private = (GifFilePrivateType *)GifFileOut->Private;
 	int i, j;
 
 	if (EGifPutScreenDesc(GifFileOut, GifFileOut->SWidth,
@@ -1100,6 +1416,22 @@ int EGifSpew(GifFileType *GifFileOut) {
 		int SavedHeight = sp->ImageDesc.Height;
 		int SavedWidth = sp->ImageDesc.Width;
 
+		/* LZW data from EGifSetSavedImageCode() goes out unchanged
+		 * unless a raster has been supplied since */
+		if (sp->RasterBits == NULL && i < Private->CompressedCount &&
+		    Private->Compressed[i].Data != NULL) {
+			if (EGifWriteExtensions(GifFileOut, sp->ExtensionBlocks,
+			                        sp->ExtensionBlockCount) ==
+			        GIF_ERROR ||
+			    EGifPutImageCode(GifFileOut, &sp->ImageDesc,
+			                     Private->Compressed[i].Data,
+			                     Private->Compressed[i].Len) ==
+			        GIF_ERROR) {
+				return (GIF_ERROR);
+			}
+			continue;
+		}
+
 		/* this allows us to delete images by nuking their rasters */
 		if (sp->RasterBits == NULL) {
 			continue;
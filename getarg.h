@@ -36,10 +36,86 @@ extern void PrintGifError(int ErrorCode);
 /******************************************************************************
  Color table quantization
 ******************************************************************************/
+typedef struct GifQuantizerType {
+	int HistogramBits; /* Bits kept per primary when counting colors */
+	int Threads;       /* Worker threads, 0 = one per processor */
+	int Method;        /* How the palette is chosen: */
+#define GIF_QUANTIZE_MEDIAN_CUT 0 /* Heckbert's, widest box first */
+#define GIF_QUANTIZE_VARIANCE 1   /* Split the box of largest squared error */
+#define GIF_QUANTIZE_OCTREE 2     /* Merge the least used octree branches */
+	int Refine;              /* k-means passes over the palette afterwards */
+	bool Nearest;            /* Map pixels to nearest color, not by box */
+	int LookupBits;          /* Resolution of the nearest-color table */
+	int Dither;              /* Spread the error of mapping to the palette: */
+#define GIF_DITHER_NONE 0            /* Nearest color only */
+#define GIF_DITHER_FLOYD_STEINBERG 1 /* Error diffusion, four neighbours */
+#define GIF_DITHER_SIERRA_LITE 2     /* Error diffusion, three neighbours */
+#define GIF_DITHER_BAYER 3           /* Ordered, 8x8 Bayer matrix */
+#define GIF_DITHER_BLUE_NOISE 4      /* Ordered, 16x16 blue-noise matrix */
+	int Subsample;           /* Animations: count one row in this many */
+	double FallbackError;    /* Animations: worse frames get own palette */
+	double ReuseThreshold;   /* Video: keep palette till this share moves */
+	bool PaletteReused;      /* Set if the last frame kept the palette */
+	int TransparentIndex;    /* Set if RGBA input had transparent pixels */
+	double MeanSquaredError; /* Per primary, of the last image quantized */
+	double PeakSNR;          /* The same as PSNR in decibels */
+	int Error;               /* Last error condition reported */
+	void *Private;           /* Don't mess with this! */
+} GifQuantizerType;
+
+/* Layouts of interleaved pixels, one byte per channel */
+#define GIF_PIXELS_RGB 0
+#define GIF_PIXELS_RGBA 1
+#define GIF_PIXELS_BGRA 2
+
+/* One frame of an animation to be quantized to a shared palette */
+typedef struct GifQuantizerFrameType {
+	const GifByteType *Red, *Green, *Blue; /* Width by Height planes */
+	GifByteType *Output;                   /* Width by Height indices */
+	ColorMapObject *LocalColorMap;         /* Set if the frame fell back */
+	double MeanSquaredError;               /* Of this frame alone */
+} GifQuantizerFrameType;
+
+GifQuantizerType *GifMakeQuantizer(void);
+void GifFreeQuantizer(GifQuantizerType *Quantizer);
+int GifQuantizerBuffer(GifQuantizerType *Quantizer, unsigned int Width,
+                       unsigned int Height, int *ColorMapSize,
+                       const GifByteType *RedInput,
+                       const GifByteType *GreenInput,
+                       const GifByteType *BlueInput, GifByteType *OutputBuffer,
+                       GifColorType *OutputColorMap);
 int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
-                      int *ColorMapSize, GifByteType *RedInput,
-                      GifByteType *GreenInput, GifByteType *BlueInput,
-                      GifByteType *OutputBuffer, GifColorType *OutputColorMap);
+                      int *ColorMapSize, const GifByteType *RedInput,
+                      const GifByteType *GreenInput,
+                      const GifByteType *BlueInput, GifByteType *OutputBuffer,
+                      GifColorType *OutputColorMap);
+int GifRemapBuffer(GifQuantizerType *Quantizer, unsigned int Width,
+                   unsigned int Height, const GifByteType *RedInput,
+                   const GifByteType *GreenInput,
+                   const GifByteType *BlueInput, const GifColorType *ColorMap,
+                   int ColorMapSize, GifByteType *OutputBuffer);
+int GifQuantizePixels(GifQuantizerType *Quantizer, unsigned int Width,
+                      unsigned int Height, const GifByteType *Pixels,
+                      size_t Stride, int Format, int *ColorMapSize,
+                      GifByteType *OutputBuffer,
+                      GifColorType *OutputColorMap);
+int GifRemapPixels(GifQuantizerType *Quantizer, unsigned int Width,
+                   unsigned int Height, const GifByteType *Pixels,
+                   size_t Stride, int Format, const GifColorType *ColorMap,
+                   int ColorMapSize, int TransparentIndex,
+                   GifByteType *OutputBuffer);
+int GifQuantizerSample(GifQuantizerType *Quantizer, unsigned int Width,
+                       unsigned int Height, const GifByteType *Pixels,
+                       size_t Stride, int Format);
+int GifQuantizerPalette(GifQuantizerType *Quantizer, int *ColorMapSize,
+                        GifColorType *OutputColorMap);
+int GifQuantizerMap(GifQuantizerType *Quantizer, unsigned int Width,
+                    unsigned int Height, const GifByteType *Pixels,
+                    size_t Stride, int Format, GifByteType *OutputBuffer);
+int GifQuantizeFrames(GifQuantizerType *Quantizer, unsigned int Width,
+                      unsigned int Height, int FrameCount,
+                      GifQuantizerFrameType *Frames, int *ColorMapSize,
+                      GifColorType *OutputColorMap);
 
 /* These used to live in the library header */
 #define GIF_MESSAGE(Msg) fprintf(stderr, "\n%s: %s\n", PROGRAM_NAME, Msg)
@@ -25,6 +25,7 @@ with our utilities mainly interesting as test tools.
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,37 +44,34 @@ static char *VersionStr = PROGRAM_NAME VERSION_COOKIE
     "	Gershon Elber,	" __DATE__ ",   " __TIME__ "\n"
     "(C) Copyright 1989 Gershon Elber.\n";
 static char *CtrlStr = PROGRAM_NAME
-    " v%- c%-#Colors!d s%-Width|Height!d!d 1%- o%-OutFileName!s h%- GifFile!*s";
+    " v%- c%-#Colors!d b%-Bits!d m%-Method!s k%-Passes!d n%- "
+    "d%-Dither!s a%-Frames!d f%-MaxError!F r%-Share!F j%-Threads!d "
+    "s%-Width|Height!d!d t%- 1%- p%- o%-OutFileName!s h%- GifFile!*s";
 
+static int OpenRGB(char *FileName, int OneFileFlag, FILE *rgbfp[3]);
 static void LoadRGB(char *FileName, int OneFileFlag, GifByteType **RedBuffer,
                     GifByteType **GreenBuffer, GifByteType **BlueBuffer,
                     int Width, int Height);
+static GifByteType *LoadPixels(char *FileName, int Channels, int Width,
+                               int Height);
+static GifFileType *OpenGif(int Width, int Height, int ExpColorMapSize,
+                            ColorMapObject *OutputColorMap,
+                            int TransparentIndex);
+static void CloseGif(GifFileType *GifFile);
 static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
-                    int ExpColorMapSize, ColorMapObject *OutputColorMap);
+                    int ExpColorMapSize, ColorMapObject *OutputColorMap,
+                    int TransparentIndex);
+static void SaveAnimation(GifQuantizerFrameType *Frames, int FrameCount,
+                          int Width, int Height, int ExpColorMapSize,
+                          ColorMapObject *OutputColorMap);
 
 /******************************************************************************
- Load RGB file into internal frame buffer.
+ Open the RGB input: one file of interleaved pixels, stdin if FileName is
+ NULL, or else three files of planes named FileName.R, .G and .B.  Returns
+ the number of files opened.
 ******************************************************************************/
-static void LoadRGB(char *FileName, int OneFileFlag, GifByteType **RedBuffer,
-                    GifByteType **GreenBuffer, GifByteType **BlueBuffer,
-                    int Width, int Height) {
+static int OpenRGB(char *FileName, int OneFileFlag, FILE *rgbfp[3]) {
 	int i;
-	unsigned long Size;
-	GifByteType *RedP, *GreenP, *BlueP;
-	FILE *rgbfp[3];
-
-	Size = ((long)Width) * Height * sizeof(GifByteType);
-
-	if ((*RedBuffer = (GifByteType *)malloc((unsigned int)Size)) == NULL ||
-	    (*GreenBuffer = (GifByteType *)malloc((unsigned int)Size)) ==
-	        NULL ||
-	    (*BlueBuffer = (GifByteType *)malloc((unsigned int)Size)) == NULL) {
-		GIF_EXIT("Failed to allocate memory required, aborted.");
-	}
-
-	RedP = *RedBuffer;
-	GreenP = *GreenBuffer;
-	BlueP = *BlueBuffer;
 
 	if (FileName != NULL) {
 		if (OneFileFlag) {
@@ -106,6 +104,34 @@ static void LoadRGB(char *FileName, int OneFileFlag, GifByteType **RedBuffer,
 
 		rgbfp[0] = stdin;
 	}
+	return OneFileFlag ? 1 : 3;
+}
+
+/******************************************************************************
+ Load RGB file into internal frame buffer.
+******************************************************************************/
+static void LoadRGB(char *FileName, int OneFileFlag, GifByteType **RedBuffer,
+                    GifByteType **GreenBuffer, GifByteType **BlueBuffer,
+                    int Width, int Height) {
+	int i;
+	unsigned long Size;
+	GifByteType *RedP, *GreenP, *BlueP;
+	FILE *rgbfp[3];
+
+	Size = ((long)Width) * Height * sizeof(GifByteType);
+
+	if ((*RedBuffer = (GifByteType *)malloc((unsigned int)Size)) == NULL ||
+	    (*GreenBuffer = (GifByteType *)malloc((unsigned int)Size)) ==
+	        NULL ||
+	    (*BlueBuffer = (GifByteType *)malloc((unsigned int)Size)) == NULL) {
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+	}
+
+	RedP = *RedBuffer;
+	GreenP = *GreenBuffer;
+	BlueP = *BlueBuffer;
+
+	OneFileFlag = OpenRGB(FileName, OneFileFlag, rgbfp) == 1;
 
 	GifQprintf("\n%s: RGB image:     ", PROGRAM_NAME);
 
@@ -154,13 +180,52 @@ static void LoadRGB(char *FileName, int OneFileFlag, GifByteType **RedBuffer,
 }
 
 /******************************************************************************
- Save the GIF resulting image.
+ Load an RGB or RGBA file of interleaved pixels into one buffer, as it is.
 ******************************************************************************/
-static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
-                    int ExpColorMapSize, ColorMapObject *OutputColorMap) {
-	int i, Error;
+static GifByteType *LoadPixels(char *FileName, int Channels, int Width,
+                               int Height) {
+	int i;
+	size_t RowSize = (size_t)Width * Channels;
+	GifByteType *Buffer;
+	FILE *rgbfp;
+
+	if ((Buffer = (GifByteType *)malloc(RowSize * Height)) == NULL) {
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+	}
+
+	if (FileName != NULL) {
+		if ((rgbfp = fopen(FileName, "rb")) == NULL) {
+			GIF_EXIT("Can't open input file name.");
+		}
+	} else {
+#ifdef _WIN32
+		_setmode(0, O_BINARY);
+#endif /* _WIN32 */
+
+		rgbfp = stdin;
+	}
+
+	GifQprintf("\n%s: RGB image:     ", PROGRAM_NAME);
+
+	for (i = 0; i < Height; i++) {
+		GifQprintf("\b\b\b\b%-4d", i);
+		if (fread(Buffer + RowSize * i, RowSize, 1, rgbfp) != 1) {
+			GIF_EXIT("Input file(s) terminated prematurly.");
+		}
+	}
+
+	fclose(rgbfp);
+	return Buffer;
+}
+
+/******************************************************************************
+ Open stdout for a GIF of one image and write everything up to its pixels.
+******************************************************************************/
+static GifFileType *OpenGif(int Width, int Height, int ExpColorMapSize,
+                            ColorMapObject *OutputColorMap,
+                            int TransparentIndex) {
+	int Error;
 	GifFileType *GifFile;
-	GifByteType *Ptr = OutputBuffer;
 
 	/* Open stdout for the output file: */
 	if ((GifFile = EGifOpenFileHandle(1, &Error)) == NULL) {
@@ -169,17 +234,61 @@ static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
 	}
 
 	if (EGifPutScreenDesc(GifFile, Width, Height, ExpColorMapSize, 0,
-	                      OutputColorMap) == GIF_ERROR ||
-	    EGifPutImageDesc(GifFile, 0, 0, Width, Height, false, NULL) ==
-	        GIF_ERROR) {
-		PrintGifError(Error);
+	                      OutputColorMap) == GIF_ERROR) {
+		PrintGifError(GifFile->Error);
+		exit(EXIT_FAILURE);
+	}
+	if (TransparentIndex != NO_TRANSPARENT_COLOR) {
+		GraphicsControlBlock GCB;
+		GifByteType Extension[4];
+
+		GCB.DisposalMode = DISPOSAL_UNSPECIFIED;
+		GCB.UserInputFlag = false;
+		GCB.DelayTime = 0;
+		GCB.TransparentColor = TransparentIndex;
+		if (EGifPutExtension(GifFile, GRAPHICS_EXT_FUNC_CODE,
+		                     EGifGCBToExtension(&GCB, Extension),
+		                     Extension) == GIF_ERROR) {
+			PrintGifError(GifFile->Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (EGifPutImageDesc(GifFile, 0, 0, Width, Height, false, NULL) ==
+	    GIF_ERROR) {
+		PrintGifError(GifFile->Error);
 		exit(EXIT_FAILURE);
 	}
 
 	GifQprintf("\n%s: Image 1 at (%d, %d) [%dx%d]:     ", PROGRAM_NAME,
 	           GifFile->Image.Left, GifFile->Image.Top,
 	           GifFile->Image.Width, GifFile->Image.Height);
+	return GifFile;
+}
+
+/******************************************************************************
+ Finish the GIF OpenGif() began.
+******************************************************************************/
+static void CloseGif(GifFileType *GifFile) {
+	int Error;
+
+	if (EGifCloseFile(GifFile, &Error) == GIF_ERROR) {
+		PrintGifError(Error);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/******************************************************************************
+ Save the GIF resulting image.
+******************************************************************************/
+static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
+                    int ExpColorMapSize, ColorMapObject *OutputColorMap,
+                    int TransparentIndex) {
+	int i;
+	GifFileType *GifFile;
+	GifByteType *Ptr = OutputBuffer;
 
+	GifFile = OpenGif(Width, Height, ExpColorMapSize, OutputColorMap,
+	                  TransparentIndex);
 	for (i = 0; i < Height; i++) {
 		if (EGifPutLine(GifFile, Ptr, Width) == GIF_ERROR) {
 			exit(EXIT_FAILURE);
@@ -188,6 +297,54 @@ static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
 
 		Ptr += Width;
 	}
+	CloseGif(GifFile);
+}
+
+/******************************************************************************
+ Save the frames of an animation, all sharing the global color map except
+ those that fell back to a local one.
+******************************************************************************/
+static void SaveAnimation(GifQuantizerFrameType *Frames, int FrameCount,
+                          int Width, int Height, int ExpColorMapSize,
+                          ColorMapObject *OutputColorMap) {
+	int i, j, Error;
+	GifFileType *GifFile;
+
+	/* Open stdout for the output file: */
+	if ((GifFile = EGifOpenFileHandle(1, &Error)) == NULL) {
+		PrintGifError(Error);
+		exit(EXIT_FAILURE);
+	}
+
+	if (EGifPutScreenDesc(GifFile, Width, Height, ExpColorMapSize, 0,
+	                      OutputColorMap) == GIF_ERROR) {
+		PrintGifError(GifFile->Error);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < FrameCount; i++) {
+		GifByteType *Ptr = Frames[i].Output;
+
+		if (EGifPutImageDesc(GifFile, 0, 0, Width, Height, false,
+		                     Frames[i].LocalColorMap) == GIF_ERROR) {
+			PrintGifError(GifFile->Error);
+			exit(EXIT_FAILURE);
+		}
+		GifQprintf("\n%s: Image %d at (%d, %d) [%dx%d]%s:     ",
+		           PROGRAM_NAME, i + 1, GifFile->Image.Left,
+		           GifFile->Image.Top, GifFile->Image.Width,
+		           GifFile->Image.Height,
+		           Frames[i].LocalColorMap != NULL ? " local colors"
+		                                           : "");
+		for (j = 0; j < Height; j++) {
+			if (EGifPutLine(GifFile, Ptr, Width) == GIF_ERROR) {
+				exit(EXIT_FAILURE);
+			}
+			GifQprintf("\b\b\b\b%-4d", Height - j - 1);
+
+			Ptr += Width;
+		}
+	}
 
 	if (EGifCloseFile(GifFile, &Error) == GIF_ERROR) {
 		PrintGifError(Error);
@@ -195,24 +352,249 @@ static void SaveGif(GifByteType *OutputBuffer, int Width, int Height,
 	}
 }
 
+/******************************************************************************
+ Quantize each frame on its own, as a video, keeping the last palette for
+ as long as the colors don't move too much.  The first palette goes in
+ OutputColorMap to be the global one; later frames with another palette
+ get it as a local color map.
+******************************************************************************/
+static void QuantizeEachFrame(GifQuantizerType *Quantizer, int Width,
+                              int Height, int FrameCount,
+                              GifQuantizerFrameType *Frames,
+                              int ExpNumOfColors,
+                              ColorMapObject *OutputColorMap) {
+	int i, ColorMapSize;
+	double SquaredError = 0;
+	ColorMapObject *ColorMap, *Last = NULL;
+
+	for (i = 0; i < FrameCount; i++) {
+		ColorMapSize = 1 << ExpNumOfColors;
+		if ((ColorMap = i == 0 ? OutputColorMap
+		                       : GifMakeMapObject(ColorMapSize,
+		                                          NULL)) == NULL) {
+			GIF_EXIT("Failed to allocate memory required, aborted.");
+		}
+		if (GifQuantizerBuffer(Quantizer, Width, Height, &ColorMapSize,
+		                       Frames[i].Red, Frames[i].Green,
+		                       Frames[i].Blue, Frames[i].Output,
+		                       ColorMap->Colors) == GIF_ERROR) {
+			PrintGifError(Quantizer->Error);
+			exit(EXIT_FAILURE);
+		}
+		if (i > 0 && Quantizer->PaletteReused && Last == NULL) {
+			GifFreeMapObject(ColorMap);
+		} else if (i > 0) {
+			Frames[i].LocalColorMap = Last = ColorMap;
+		}
+		SquaredError += Quantizer->MeanSquaredError;
+	}
+	Quantizer->MeanSquaredError = SquaredError / FrameCount;
+	Quantizer->PeakSNR =
+	    10 * log10(255.0 * 255.0 / Quantizer->MeanSquaredError);
+}
+
+/******************************************************************************
+ Quantize FrameCount frames of Width by Height, read one after another, to
+ one palette and write them out as an animation.
+******************************************************************************/
+static void RGB2Animation(GifQuantizerType *Quantizer, bool OneFileFlag,
+                          int NumFiles, char *FileName, int ExpNumOfColors,
+                          int Width, int Height, int FrameCount) {
+	int i, ColorMapSize = 1 << ExpNumOfColors;
+	size_t Pixels = (size_t)Width * Height;
+	GifByteType *RedBuffer = NULL, *GreenBuffer = NULL, *BlueBuffer = NULL,
+	            *OutputBuffer = NULL;
+	ColorMapObject *OutputColorMap = NULL;
+	GifQuantizerFrameType *Frames;
+
+	/* Frames one after another read just like one tall image */
+	LoadRGB(NumFiles == 1 ? FileName : NULL, OneFileFlag, &RedBuffer,
+	        &GreenBuffer, &BlueBuffer, Width, Height * FrameCount);
+
+	if ((OutputColorMap = GifMakeMapObject(ColorMapSize, NULL)) == NULL ||
+	    (OutputBuffer = (GifByteType *)malloc(Pixels * FrameCount)) ==
+	        NULL ||
+	    (Frames = (GifQuantizerFrameType *)calloc(
+	         FrameCount, sizeof(GifQuantizerFrameType))) == NULL) {
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+	}
+	for (i = 0; i < FrameCount; i++) {
+		Frames[i].Red = RedBuffer + Pixels * i;
+		Frames[i].Green = GreenBuffer + Pixels * i;
+		Frames[i].Blue = BlueBuffer + Pixels * i;
+		Frames[i].Output = OutputBuffer + Pixels * i;
+	}
+
+	if (Quantizer->ReuseThreshold > 0) {
+		QuantizeEachFrame(Quantizer, Width, Height, FrameCount, Frames,
+		                  ExpNumOfColors, OutputColorMap);
+	} else if (GifQuantizeFrames(Quantizer, Width, Height, FrameCount,
+	                             Frames, &ColorMapSize,
+	                             OutputColorMap->Colors) == GIF_ERROR) {
+		PrintGifError(Quantizer->Error);
+		exit(EXIT_FAILURE);
+	}
+	GifQprintf("\n%s: Quantization error: MSE %.2f, PSNR %.2f dB",
+	           PROGRAM_NAME, Quantizer->MeanSquaredError,
+	           Quantizer->PeakSNR);
+	free((char *)RedBuffer);
+	free((char *)GreenBuffer);
+	free((char *)BlueBuffer);
+
+	SaveAnimation(Frames, FrameCount, Width, Height, ExpNumOfColors,
+	              OutputColorMap);
+	for (i = 0; i < FrameCount; i++) {
+		GifFreeMapObject(Frames[i].LocalColorMap);
+	}
+	free((char *)Frames);
+	free((char *)OutputBuffer);
+	GifFreeMapObject(OutputColorMap);
+}
+
+/******************************************************************************
+ Read the next row of the input into Pixels as interleaved pixels of
+ Channels bytes, gathering it from the three planes if need be.
+******************************************************************************/
+static void ReadRow(FILE *rgbfp[3], int Files, int Channels, int Width,
+                    GifByteType *Plane, GifByteType *Pixels) {
+	int i, j;
+
+	if (Files == 1) {
+		if (fread(Pixels, (size_t)Width * Channels, 1, rgbfp[0]) != 1) {
+			GIF_EXIT("Input file(s) terminated prematurly.");
+		}
+		return;
+	}
+	for (i = 0; i < 3; i++) {
+		if (fread(Plane, Width, 1, rgbfp[i]) != 1) {
+			GIF_EXIT("Input file(s) terminated prematurly.");
+		}
+		for (j = 0; j < Width; j++) {
+			Pixels[j * 3 + i] = Plane[j];
+		}
+	}
+}
+
+/******************************************************************************
+ Convert in two passes over the input, a row at a time: first count its
+ colors, then go back and map and write each row in turn, so that only a
+ row of the image is ever in memory.  Returns false, having read nothing,
+ if the input can't be read twice.
+******************************************************************************/
+static bool RGB2GIFStream(GifQuantizerType *Quantizer, bool OneFileFlag,
+                          bool AlphaFlag, char *FileName, int ExpNumOfColors,
+                          int Width, int Height) {
+	int i, Files, ColorMapSize = 1 << ExpNumOfColors,
+	              Channels = AlphaFlag ? 4 : 3,
+	              Format = AlphaFlag ? GIF_PIXELS_RGBA : GIF_PIXELS_RGB;
+	long Start[3];
+	FILE *rgbfp[3];
+	GifByteType *Plane, *Pixels, *Output;
+	ColorMapObject *OutputColorMap;
+	GifFileType *GifFile;
+
+	Files = OpenRGB(FileName, OneFileFlag, rgbfp);
+	if (Files != 1 && AlphaFlag) {
+		GIF_EXIT("RGBA input must be in one file.");
+	}
+	for (i = 0; i < Files; i++) {
+		if ((Start[i] = ftell(rgbfp[i])) < 0) {
+			if (rgbfp[0] == stdin) {
+				return false;
+			}
+			GIF_EXIT("Input file(s) must be seekable.");
+		}
+	}
+
+	if ((Plane = (GifByteType *)malloc(Width)) == NULL ||
+	    (Pixels = (GifByteType *)malloc((size_t)Width * Channels)) ==
+	        NULL ||
+	    (Output = (GifByteType *)malloc(Width)) == NULL ||
+	    (OutputColorMap = GifMakeMapObject(ColorMapSize, NULL)) == NULL) {
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+	}
+
+	GifQprintf("\n%s: RGB image:     ", PROGRAM_NAME);
+	for (i = 0; i < Height; i++) {
+		GifQprintf("\b\b\b\b%-4d", i);
+		ReadRow(rgbfp, Files, Channels, Width, Plane, Pixels);
+		if (GifQuantizerSample(Quantizer, Width, 1, Pixels,
+		                       (size_t)Width * Channels,
+		                       Format) == GIF_ERROR) {
+			PrintGifError(Quantizer->Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (GifQuantizerPalette(Quantizer, &ColorMapSize,
+	                        OutputColorMap->Colors) == GIF_ERROR) {
+		PrintGifError(Quantizer->Error);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < Files; i++) {
+		if (fseek(rgbfp[i], Start[i], SEEK_SET) != 0) {
+			GIF_EXIT("Input file(s) must be seekable.");
+		}
+	}
+
+	GifFile = OpenGif(Width, Height, ExpNumOfColors, OutputColorMap,
+	                  Quantizer->TransparentIndex);
+	for (i = 0; i < Height; i++) {
+		ReadRow(rgbfp, Files, Channels, Width, Plane, Pixels);
+		if (GifQuantizerMap(Quantizer, Width, 1, Pixels,
+		                    (size_t)Width * Channels, Format,
+		                    Output) == GIF_ERROR) {
+			PrintGifError(Quantizer->Error);
+			exit(EXIT_FAILURE);
+		}
+		if (EGifPutLine(GifFile, Output, Width) == GIF_ERROR) {
+			exit(EXIT_FAILURE);
+		}
+		GifQprintf("\b\b\b\b%-4d", Height - i - 1);
+	}
+	CloseGif(GifFile);
+	GifQprintf("\n%s: Quantization error: MSE %.2f, PSNR %.2f dB",
+	           PROGRAM_NAME, Quantizer->MeanSquaredError,
+	           Quantizer->PeakSNR);
+
+	for (i = 0; i < Files; i++) {
+		fclose(rgbfp[i]);
+	}
+	free((char *)Plane);
+	free((char *)Pixels);
+	free((char *)Output);
+	GifFreeMapObject(OutputColorMap);
+	return true;
+}
+
 /******************************************************************************
  Close output file (if open), and exit.
 ******************************************************************************/
-static void RGB2GIF(bool OneFileFlag, int NumFiles, char *FileName,
+static void RGB2GIF(GifQuantizerType *Quantizer, bool OneFileFlag,
+                    bool AlphaFlag, int NumFiles, char *FileName,
                     int ExpNumOfColors, int Width, int Height) {
-	int ColorMapSize;
+	int ColorMapSize, Result;
 
 	GifByteType *RedBuffer = NULL, *GreenBuffer = NULL, *BlueBuffer = NULL,
-	            *OutputBuffer = NULL;
+	            *PixelBuffer = NULL, *OutputBuffer = NULL;
 	ColorMapObject *OutputColorMap = NULL;
 
+	/* Input that can be read twice need not be held in memory */
+	if (RGB2GIFStream(Quantizer, OneFileFlag, AlphaFlag,
+	                  NumFiles == 1 ? FileName : NULL, ExpNumOfColors,
+	                  Width, Height)) {
+		return;
+	}
+
 	ColorMapSize = 1 << ExpNumOfColors;
 
-	if (NumFiles == 1) {
-		LoadRGB(FileName, OneFileFlag, &RedBuffer, &GreenBuffer,
-		        &BlueBuffer, Width, Height);
+	/* Interleaved pixels are quantized where they lie */
+	if (NumFiles != 1 || OneFileFlag) {
+		PixelBuffer = LoadPixels(NumFiles == 1 ? FileName : NULL,
+		                         AlphaFlag ? 4 : 3, Width, Height);
+	} else if (AlphaFlag) {
+		GIF_EXIT("RGBA input must be in one file.");
 	} else {
-		LoadRGB(NULL, OneFileFlag, &RedBuffer, &GreenBuffer,
+		LoadRGB(FileName, OneFileFlag, &RedBuffer, &GreenBuffer,
 		        &BlueBuffer, Width, Height);
 	}
 
@@ -222,16 +604,32 @@ static void RGB2GIF(bool OneFileFlag, int NumFiles, char *FileName,
 		GIF_EXIT("Failed to allocate memory required, aborted.");
 	}
 
-	if (GifQuantizeBuffer(Width, Height, &ColorMapSize, RedBuffer,
-	                      GreenBuffer, BlueBuffer, OutputBuffer,
-	                      OutputColorMap->Colors) == GIF_ERROR) {
+	if (PixelBuffer != NULL) {
+		Result = GifQuantizePixels(
+		    Quantizer, Width, Height, PixelBuffer,
+		    (size_t)Width * (AlphaFlag ? 4 : 3),
+		    AlphaFlag ? GIF_PIXELS_RGBA : GIF_PIXELS_RGB, &ColorMapSize,
+		    OutputBuffer, OutputColorMap->Colors);
+	} else {
+		Result = GifQuantizerBuffer(Quantizer, Width, Height,
+		                            &ColorMapSize, RedBuffer,
+		                            GreenBuffer, BlueBuffer,
+		                            OutputBuffer, OutputColorMap->Colors);
+	}
+	if (Result == GIF_ERROR) {
+		PrintGifError(Quantizer->Error);
 		exit(EXIT_FAILURE);
 	}
+	GifQprintf("\n%s: Quantization error: MSE %.2f, PSNR %.2f dB",
+	           PROGRAM_NAME, Quantizer->MeanSquaredError,
+	           Quantizer->PeakSNR);
+	free((char *)PixelBuffer);
 	free((char *)RedBuffer);
 	free((char *)GreenBuffer);
 	free((char *)BlueBuffer);
 
-	SaveGif(OutputBuffer, Width, Height, ExpNumOfColors, OutputColorMap);
+	SaveGif(OutputBuffer, Width, Height, ExpNumOfColors, OutputColorMap,
+	        Quantizer->TransparentIndex);
 }
 
 /******************************************************************************
@@ -350,34 +748,9 @@ static void DumpScreen2RGB(char *FileName, int OneFileFlag,
 	}
 }
 
-static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
-                    char *OutFileName) {
-	int i, j, Size, Row, Col, Width, Height, ExtCode, Count;
-	GifRecordType RecordType;
-	GifByteType *Extension;
+static GifRowType *AllocScreen(const GifFileType *GifFile) {
+	int i, Size;
 	GifRowType *ScreenBuffer;
-	GifFileType *GifFile;
-	static const int InterlacedOffset[] = {
-	    0, 4, 2, 1}; /* The way Interlaced image should. */
-	static const int InterlacedJumps[] = {
-	    8, 8, 4, 2}; /* be read - offsets and jumps... */
-	int ImageNum = 0;
-	ColorMapObject *ColorMap;
-
-	if (NumFiles == 1) {
-		int Error;
-		if ((GifFile = DGifOpenFileName(FileName, &Error)) == NULL) {
-			PrintGifError(Error);
-			exit(EXIT_FAILURE);
-		}
-	} else {
-		int Error;
-		/* Use stdin instead: */
-		if ((GifFile = DGifOpenFileHandle(0, &Error)) == NULL) {
-			PrintGifError(Error);
-			exit(EXIT_FAILURE);
-		}
-	}
 
 	if (GifFile->SHeight == 0 || GifFile->SWidth == 0) {
 		fprintf(stderr, "Image of width or height 0\n");
@@ -416,6 +789,83 @@ static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
 		memcpy(ScreenBuffer[i], ScreenBuffer[0], Size);
 	}
 
+	return ScreenBuffer;
+}
+
+static void DumpScreenAndClose(GifFileType *GifFile, GifRowType *ScreenBuffer,
+                               bool OneFileFlag, char *OutFileName) {
+	ColorMapObject *ColorMap;
+
+	/* Lets dump it - set the global variables required and do it: */
+	ColorMap = (GifFile->Image.ColorMap ? GifFile->Image.ColorMap
+	                                    : GifFile->SColorMap);
+	if (ColorMap == NULL) {
+		fprintf(stderr, "Gif Image does not have a colormap\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* check that the background color isn't garbage (SF bug #87) */
+	if (GifFile->SBackGroundColor < 0 ||
+	    GifFile->SBackGroundColor >= ColorMap->ColorCount) {
+		fprintf(stderr, "Background color out of range for colormap\n");
+		exit(EXIT_FAILURE);
+	}
+
+	DumpScreen2RGB(OutFileName, OneFileFlag, ColorMap, ScreenBuffer,
+	               GifFile->SWidth, GifFile->SHeight);
+
+	(void)free(ScreenBuffer);
+
+	{
+		int Error;
+		if (DGifCloseFile(GifFile, &Error) == GIF_ERROR) {
+			PrintGifError(Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void CheckImageOnScreen(const GifFileType *GifFile, int ImageNum) {
+	if (GifFile->Image.Left + GifFile->Image.Width > GifFile->SWidth ||
+	    GifFile->Image.Top + GifFile->Image.Height > GifFile->SHeight) {
+		fprintf(stderr,
+		        "Image %d is not confined to screen "
+		        "dimension, aborted.\n",
+		        ImageNum);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
+                    char *OutFileName) {
+	int i, j, Row, Col, Width, Height, ExtCode, Count;
+	GifRecordType RecordType;
+	GifByteType *Extension;
+	GifRowType *ScreenBuffer;
+	GifFileType *GifFile;
+	static const int InterlacedOffset[] = {
+	    0, 4, 2, 1}; /* The way Interlaced image should. */
+	static const int InterlacedJumps[] = {
+	    8, 8, 4, 2}; /* be read - offsets and jumps... */
+	int ImageNum = 0;
+
+	if (NumFiles == 1) {
+		int Error;
+		if ((GifFile = DGifOpenFileName(FileName, &Error)) == NULL) {
+			PrintGifError(Error);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		int Error;
+		/* Use stdin instead: */
+		if ((GifFile = DGifOpenFileHandle(0, &Error)) == NULL) {
+			PrintGifError(Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ScreenBuffer = AllocScreen(GifFile);
+
 	/* Scan the content of the GIF file and load the image(s) in: */
 	do {
 		if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR) {
@@ -436,16 +886,7 @@ static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
 			GifQprintf("\n%s: Image %d at (%d, %d) [%dx%d]:     ",
 			           PROGRAM_NAME, ++ImageNum, Col, Row, Width,
 			           Height);
-			if (GifFile->Image.Left + GifFile->Image.Width >
-			        GifFile->SWidth ||
-			    GifFile->Image.Top + GifFile->Image.Height >
-			        GifFile->SHeight) {
-				fprintf(stderr,
-				        "Image %d is not confined to screen "
-				        "dimension, aborted.\n",
-				        ImageNum);
-				exit(EXIT_FAILURE);
-			}
+			CheckImageOnScreen(GifFile, ImageNum);
 			if (GifFile->Image.Interlace) {
 				/* Need to perform 4 passes on the images: */
 				for (Count = i = 0; i < 4; i++) {
@@ -499,33 +940,107 @@ static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
 		}
 	} while (RecordType != TERMINATE_RECORD_TYPE);
 
-	/* Lets dump it - set the global variables required and do it: */
-	ColorMap = (GifFile->Image.ColorMap ? GifFile->Image.ColorMap
-	                                    : GifFile->SColorMap);
-	if (ColorMap == NULL) {
-		fprintf(stderr, "Gif Image does not have a colormap\n");
-		exit(EXIT_FAILURE);
-	}
-
-	/* check that the background color isn't garbage (SF bug #87) */
-	if (GifFile->SBackGroundColor < 0 ||
-	    GifFile->SBackGroundColor >= ColorMap->ColorCount) {
-		fprintf(stderr, "Background color out of range for colormap\n");
-		exit(EXIT_FAILURE);
-	}
+	DumpScreenAndClose(GifFile, ScreenBuffer, OneFileFlag, OutFileName);
+}
 
-	DumpScreen2RGB(OutFileName, OneFileFlag, ColorMap, ScreenBuffer,
-	               GifFile->SWidth, GifFile->SHeight);
+/******************************************************************************
+ Same as GIF2RGB(), but drive the push-mode decoder, feeding it the input a
+ byte at a time the way a network client would see it trickle in.  Interlaced
+ images are also previewed after each pass; the final screen is the same.
+******************************************************************************/
+static void GIF2RGBPush(int NumFiles, char *FileName, bool OneFileFlag,
+                        char *OutFileName) {
+	int i, c, Status, ImageNum = 0;
+	FILE *InFile;
+	GifByteType Byte;
+	GifPushEvent Event;
+	GifRowType *ScreenBuffer = NULL;
+	GifFileType *GifFile;
+	SavedImage *sp;
 
-	(void)free(ScreenBuffer);
+	if (NumFiles == 1) {
+		if ((InFile = fopen(FileName, "rb")) == NULL) {
+			PrintGifError(D_GIF_ERR_OPEN_FAILED);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+#ifdef _WIN32
+		_setmode(0, O_BINARY);
+#endif /* _WIN32 */
+		InFile = stdin;
+	}
 
 	{
 		int Error;
-		if (DGifCloseFile(GifFile, &Error) == GIF_ERROR) {
+		if ((GifFile = DGifOpenPush(NULL, &Error)) == NULL) {
 			PrintGifError(Error);
 			exit(EXIT_FAILURE);
 		}
 	}
+	/* Repaint interlaced images after every pass, as a viewer would */
+	(void)DGifPushSetPreview(GifFile, true);
+
+	for (;;) {
+		Status = DGifPushDecode(GifFile, &Event);
+		if (Status == GIF_ERROR) {
+			PrintGifError(GifFile->Error);
+			exit(EXIT_FAILURE);
+		} else if (Status == GIF_NEED_MORE_DATA) {
+			if ((c = getc(InFile)) == EOF) {
+				PrintGifError(D_GIF_ERR_READ_FAILED);
+				exit(EXIT_FAILURE);
+			}
+			Byte = (GifByteType)c;
+			if (DGifPushData(GifFile, &Byte, 1) == GIF_ERROR) {
+				PrintGifError(GifFile->Error);
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		if (Event.Type == GIF_PUSH_TERMINATE) {
+			break;
+		}
+		switch (Event.Type) {
+		case GIF_PUSH_SCREEN_DESC:
+			ScreenBuffer = AllocScreen(GifFile);
+			break;
+		case GIF_PUSH_IMAGE_BEGIN:
+			GifQprintf("\n%s: Image %d at (%d, %d) [%dx%d]:     ",
+			           PROGRAM_NAME, ++ImageNum,
+			           GifFile->Image.Left, GifFile->Image.Top,
+			           GifFile->Image.Width, GifFile->Image.Height);
+			CheckImageOnScreen(GifFile, ImageNum);
+			break;
+		case GIF_PUSH_IMAGE_ROW:
+			sp = &GifFile->SavedImages[Event.ImageIndex];
+			GifQprintf("\b\b\b\b%-4d", Event.Row);
+			memcpy(&ScreenBuffer[sp->ImageDesc.Top + Event.Row]
+			                    [sp->ImageDesc.Left],
+			       sp->RasterBits +
+			           (size_t)Event.Row * sp->ImageDesc.Width,
+			       sp->ImageDesc.Width);
+			break;
+		case GIF_PUSH_IMAGE_PASS:
+			sp = &GifFile->SavedImages[Event.ImageIndex];
+			for (i = 0; i < sp->ImageDesc.Height; i++) {
+				memcpy(&ScreenBuffer[sp->ImageDesc.Top + i]
+				                    [sp->ImageDesc.Left],
+				       sp->RasterBits +
+				           (size_t)i * sp->ImageDesc.Width,
+				       sp->ImageDesc.Width);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (InFile != stdin) {
+		(void)fclose(InFile);
+	}
+
+	DumpScreenAndClose(GifFile, ScreenBuffer, OneFileFlag, OutFileName);
 }
 
 /******************************************************************************
@@ -533,14 +1048,27 @@ static void GIF2RGB(int NumFiles, char *FileName, bool OneFileFlag,
  ******************************************************************************/
 int main(int argc, char **argv) {
 	bool Error, OutFileFlag = false, ColorFlag = false, SizeFlag = false,
-	            GifNoisyPrint = false;
-	int NumFiles, Width = 0, Height = 0, ExpNumOfColors = 8;
-	char *OutFileName, **FileName = NULL;
+	            PushFlag = false, GifNoisyPrint = false, BitsFlag = false,
+	            MethodFlag = false, RefineFlag = false, NearestFlag = false,
+	            DitherFlag = false, FramesFlag = false, MaxErrorFlag = false,
+	            ShareFlag = false, ThreadsFlag = false, AlphaFlag = false;
+	int NumFiles, Width = 0, Height = 0, ExpNumOfColors = 8,
+	              HistogramBits = 5, Refine = 0, FrameCount = 1;
+	int Threads = 1;
+	double MaxError = 0, Share = 0;
+	char *OutFileName, **FileName = NULL, *Method = "median",
+	                                        *Dither = "none";
 	static bool OneFileFlag = false, HelpFlag = false;
 
 	if ((Error = GAGetArgs(argc, argv, CtrlStr, &GifNoisyPrint, &ColorFlag,
-	                       &ExpNumOfColors, &SizeFlag, &Width, &Height,
-	                       &OneFileFlag, &OutFileFlag, &OutFileName,
+	                       &ExpNumOfColors, &BitsFlag, &HistogramBits,
+	                       &MethodFlag, &Method, &RefineFlag, &Refine,
+	                       &NearestFlag, &DitherFlag, &Dither,
+	                       &FramesFlag, &FrameCount, &MaxErrorFlag,
+	                       &MaxError, &ShareFlag, &Share, &ThreadsFlag,
+	                       &Threads, &SizeFlag, &Width, &Height, &AlphaFlag,
+	                       &OneFileFlag, &PushFlag, &OutFileFlag,
+	                       &OutFileName,
 	                       &HelpFlag, &NumFiles, &FileName)) != false ||
 	    (NumFiles > 1 && !HelpFlag)) {
 		if (Error) {
@@ -568,8 +1096,61 @@ int main(int argc, char **argv) {
 			    "Image size would be overflow, zero or negative");
 			exit(EXIT_FAILURE);
 		}
-		RGB2GIF(OneFileFlag, NumFiles, *FileName, ExpNumOfColors, Width,
-		        Height);
+		GifQuantizerType *Quantizer = GifMakeQuantizer();
+
+		if (Quantizer == NULL) {
+			GIF_EXIT("Failed to allocate memory required, aborted.");
+		}
+		if (HistogramBits < 1 || HistogramBits > 8) {
+			GIF_EXIT("Histogram precision must be 1 to 8 bits.");
+		}
+		Quantizer->HistogramBits = HistogramBits;
+		if (strcmp(Method, "median") == 0) {
+			Quantizer->Method = GIF_QUANTIZE_MEDIAN_CUT;
+		} else if (strcmp(Method, "variance") == 0) {
+			Quantizer->Method = GIF_QUANTIZE_VARIANCE;
+		} else if (strcmp(Method, "octree") == 0) {
+			Quantizer->Method = GIF_QUANTIZE_OCTREE;
+		} else {
+			GIF_EXIT("Method must be median, variance or octree.");
+		}
+		Quantizer->Refine = Refine;
+		Quantizer->Nearest = NearestFlag;
+		if (strcmp(Dither, "none") == 0) {
+			Quantizer->Dither = GIF_DITHER_NONE;
+		} else if (strcmp(Dither, "fs") == 0) {
+			Quantizer->Dither = GIF_DITHER_FLOYD_STEINBERG;
+		} else if (strcmp(Dither, "sierra") == 0) {
+			Quantizer->Dither = GIF_DITHER_SIERRA_LITE;
+		} else if (strcmp(Dither, "bayer") == 0) {
+			Quantizer->Dither = GIF_DITHER_BAYER;
+		} else if (strcmp(Dither, "blue") == 0) {
+			Quantizer->Dither = GIF_DITHER_BLUE_NOISE;
+		} else {
+			GIF_EXIT("Dither must be none, fs, sierra, bayer or "
+			         "blue.");
+		}
+		if (FrameCount < 1 || FrameCount > INT_MAX / Width / Height) {
+			GIF_EXIT("Frame count must be positive and fit in "
+			         "memory.");
+		}
+		Quantizer->FallbackError = MaxError;
+		Quantizer->ReuseThreshold = Share;
+		if (Threads < 0) {
+			GIF_EXIT("Thread count must not be negative.");
+		}
+		Quantizer->Threads = Threads;
+		if (FramesFlag) {
+			RGB2Animation(Quantizer, OneFileFlag, NumFiles,
+			              *FileName, ExpNumOfColors, Width, Height,
+			              FrameCount);
+		} else {
+			RGB2GIF(Quantizer, OneFileFlag, AlphaFlag, NumFiles,
+			        *FileName, ExpNumOfColors, Width, Height);
+		}
+		GifFreeQuantizer(Quantizer);
+	} else if (PushFlag) {
+		GIF2RGBPush(NumFiles, *FileName, OneFileFlag, OutFileName);
 	} else {
 		GIF2RGB(NumFiles, *FileName, OneFileFlag, OutFileName);
 	}
@@ -48,6 +48,12 @@ const char *GifErrorString(int ErrorCode) {
 	case E_GIF_ERR_NOT_WRITEABLE:
 		Err = "Given file was not opened for write";
 		break;
+	case E_GIF_ERR_BAD_CODE:
+		Err = "Compressed image data is malformed";
+		break;
+	case E_GIF_ERR_BAD_INDEX:
+		Err = "Image index is out of range";
+		break;
 	case D_GIF_ERR_OPEN_FAILED:
 		Err = "Failed to open given file";
 		break;
@@ -87,6 +93,24 @@ const char *GifErrorString(int ErrorCode) {
 	case D_GIF_ERR_EOF_TOO_SOON:
 		Err = "Image EOF detected before image complete";
 		break;
+	case D_GIF_ERR_CANVAS_TOO_BIG:
+		Err = "Screen size exceeds the decode limit";
+		break;
+	case D_GIF_ERR_IMAGE_TOO_BIG:
+		Err = "Image size exceeds the decode limit";
+		break;
+	case D_GIF_ERR_TOO_MANY_IMAGES:
+		Err = "Number of images exceeds the decode limit";
+		break;
+	case D_GIF_ERR_TOO_MANY_PIXELS:
+		Err = "Total pixels of all images exceed the decode limit";
+		break;
+	case D_GIF_ERR_ALLOC_LIMIT:
+		Err = "Memory needed exceeds the decode limit";
+		break;
+	case D_GIF_ERR_LZW_RATIO:
+		Err = "LZW expansion ratio exceeds the decode limit";
+		break;
 	default:
 		Err = NULL;
 		break;
@@ -19,6 +19,7 @@ extern "C" {
 
 #define GIF_ERROR 0
 #define GIF_OK 1
+#define GIF_NEED_MORE_DATA 2 /* Push-mode decoder has run out of input */
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -130,6 +131,12 @@ GifFileType *EGifOpenFileName(const char *GifFileName,
 GifFileType *EGifOpenFileHandle(const int GifFileHandle, int *Error);
 GifFileType *EGifOpen(void *userPtr, OutputFunc writeFunc, int *Error);
 int EGifSpew(GifFileType *GifFile);
+int EGifEstimateSize(GifFileType *GifFile, int ImageIndex, int Sample,
+                     unsigned long *Size);
+int EGifSetSavedImageCode(GifFileType *GifFile, int ImageIndex,
+                          const GifByteType *Code, size_t Len);
+int EGifPutImageCode(GifFileType *GifFile, const GifImageDesc *ImageDesc,
+                     const GifByteType *Code, size_t Len);
 const char *EGifGetGifVersion(GifFileType *GifFile); /* new in 5.x */
 int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 
@@ -144,6 +151,8 @@ int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 #define E_GIF_ERR_DISK_IS_FULL 8
 #define E_GIF_ERR_CLOSE_FAILED 9
 #define E_GIF_ERR_NOT_WRITEABLE 10
+#define E_GIF_ERR_BAD_CODE 11
+#define E_GIF_ERR_BAD_INDEX 12
 
 /* These are legacy.  You probably do not want to call them directly */
 int EGifPutScreenDesc(GifFileType *GifFile, const int GifWidth,
@@ -194,6 +203,12 @@ int DGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 #define D_GIF_ERR_NOT_READABLE 111
 #define D_GIF_ERR_IMAGE_DEFECT 112
 #define D_GIF_ERR_EOF_TOO_SOON 113
+#define D_GIF_ERR_CANVAS_TOO_BIG 114 /* Decode limits, see DGifSetLimits() */
+#define D_GIF_ERR_IMAGE_TOO_BIG 115
+#define D_GIF_ERR_TOO_MANY_IMAGES 116
+#define D_GIF_ERR_TOO_MANY_PIXELS 117
+#define D_GIF_ERR_ALLOC_LIMIT 118
+#define D_GIF_ERR_LZW_RATIO 119
 
 /* These are legacy.  You probably do not want to call them directly */
 int DGifGetScreenDesc(GifFileType *GifFile);
@@ -211,6 +226,65 @@ int DGifGetCodeNext(GifFileType *GifFile, GifByteType **GifCodeBlock);
 int DGifGetLZCodes(GifFileType *GifFile, int *GifCode);
 const char *DGifGetGifVersion(GifFileType *GifFile);
 
+/******************************************************************************
+ Resource limits for decoding untrusted input; 0 means no limit
+******************************************************************************/
+typedef struct GifDecodeLimits {
+	unsigned long MaxCanvasPixels; /* SWidth * SHeight */
+	unsigned long MaxImagePixels;  /* Width * Height of any one image */
+	int MaxImageCount;             /* Images in the file */
+	unsigned long MaxTotalPixels;  /* Sum of Width * Height over images */
+	size_t MaxAllocation; /* Bytes for rasters, LZW data, extensions... */
+	unsigned int MaxLZWRatio; /* Decoded pixels per byte of LZW data */
+} GifDecodeLimits;
+
+int DGifSetLimits(GifFileType *GifFile, const GifDecodeLimits *Limits);
+
+/******************************************************************************
+ Slurping without decoding, so the images can be decoded independently later
+******************************************************************************/
+int DGifSlurpCompressed(GifFileType *GifFile);
+int DGifDecodeSavedImage(GifFileType *GifFile, int ImageIndex, int *ErrorCode);
+int DGifDecodeSavedImages(GifFileType *GifFile, int Threads);
+int DGifGetSavedImageCode(GifFileType *GifFile, int ImageIndex,
+                          const GifByteType **Code, size_t *Len);
+bool DGifSavedImageIsKeyframe(GifFileType *GifFile, int ImageIndex);
+
+/******************************************************************************
+ Probing a GIF for its vital statistics without decoding any image
+******************************************************************************/
+typedef struct GifProbeInfo {
+	GifWord SWidth, SHeight; /* Screen dimensions */
+	int ImageCount;          /* Number of images (animation frames) */
+	int LoopCount;        /* NETSCAPE2.0 loop count, 0 = forever, -1 = none */
+	long TotalDelay;      /* Sum of GCB delay times, in 1/100 second */
+	bool HasTransparency; /* Some GCB sets a transparent color */
+} GifProbeInfo;
+
+int DGifProbe(GifFileType *GifFile, GifProbeInfo *Info);
+
+/******************************************************************************
+ Push-mode (incremental) decoding, for input that arrives in pieces
+******************************************************************************/
+
+typedef struct GifPushEvent {
+	int Type;
+#define GIF_PUSH_SCREEN_DESC 1 /* Screen descriptor and global map read */
+#define GIF_PUSH_IMAGE_BEGIN 2 /* Image descriptor read, raster allocated */
+#define GIF_PUSH_IMAGE_ROW 3   /* One more raster row has been decoded */
+#define GIF_PUSH_IMAGE_END 4   /* Image complete, extensions attached */
+#define GIF_PUSH_TERMINATE 5   /* GIF trailer seen, nothing more to do */
+#define GIF_PUSH_IMAGE_PASS 6  /* Interlace pass done, preview filled in */
+	int ImageIndex; /* Index into SavedImages, -1 if no image yet */
+	int Row;        /* Raster row just decoded, for GIF_PUSH_IMAGE_ROW */
+	int Pass;       /* Interlace pass (0-3) done, for GIF_PUSH_IMAGE_PASS */
+} GifPushEvent;
+
+GifFileType *DGifOpenPush(void *userPtr, int *Error);
+int DGifPushData(GifFileType *GifFile, const GifByteType *Data, size_t Len);
+int DGifPushDecode(GifFileType *GifFile, GifPushEvent *Event);
+int DGifPushSetPreview(GifFileType *GifFile, bool Preview);
+
 /******************************************************************************
  Error handling and reporting.
 ******************************************************************************/
@@ -231,6 +305,9 @@ extern void GifFreeMapObject(ColorMapObject *Object);
 extern ColorMapObject *GifUnionColorMap(const ColorMapObject *ColorIn1,
                                         const ColorMapObject *ColorIn2,
                                         GifPixelType ColorTransIn2[]);
+extern ColorMapObject *GifUnionColorMaps(int MapCount,
+                                         const ColorMapObject *const ColorIn[],
+                                         GifPixelType *ColorTrans[]);
 extern int GifBitSize(int n);
 
 /******************************************************************************
@@ -239,6 +316,11 @@ extern int GifBitSize(int n);
 
 extern void GifApplyTranslation(SavedImage *Image,
                                 const GifPixelType Translation[]);
+extern int GifApplyTranslations(GifFileType *GifFile,
+                                const GifPixelType *const Translations[],
+                                int Threads);
+extern int GifCompactColorMaps(GifFileType *GifFile);
+extern int GifOptimizeColorMaps(GifFileType *GifFile);
 extern int GifAddExtensionBlock(int *ExtensionBlock_Count,
                                 ExtensionBlock **ExtensionBlocks, int Function,
                                 unsigned int Len, unsigned char ExtData[]);
@@ -35,6 +35,34 @@ SPDX-License-Identifier: MIT
 #define IS_READABLE(Private) (Private->FileState & FILE_STATE_READ)
 #define IS_WRITEABLE(Private) (Private->FileState & FILE_STATE_WRITE)
 
+/* Where the push-mode decoder is in the GIF stream */
+#define PUSH_STATE_HEADER 0     /* Waiting for signature and screen desc. */
+#define PUSH_STATE_RECORD 1     /* Waiting for the next record */
+#define PUSH_STATE_IMAGE_DATA 2 /* Decoding the rows of an image */
+#define PUSH_STATE_IMAGE_TAIL 3 /* Skipping sub-blocks after the last row */
+#define PUSH_STATE_TERMINATED 4 /* Trailer seen */
+#define PUSH_STATE_FAILED 5     /* A previous call returned GIF_ERROR */
+#define PUSH_STATE_IMAGE_PASS 6 /* Interlace pass done, preview pending */
+
+typedef struct GifPushStateType {
+	GifByteType *Data; /* Input pushed by the caller (on malloc(3) heap) */
+	size_t Start,      /* First byte not yet consumed by the decoder */
+	    End,           /* One past the last byte pushed */
+	    Size;          /* Allocated size of Data */
+	int State;         /* One of the PUSH_STATE_* values */
+	bool Preview;      /* Replicate rows after each interlace pass */
+	int Pass,          /* Interlace pass of the current image */
+	    Row,           /* Row of the current image being decoded */
+	    Col,           /* Pixels of that row already decoded */
+	    Decoded;       /* Pixels decoded by an interrupted line */
+} GifPushStateType;
+
+/* An image's LZW data kept undecoded by DGifSlurpCompressed() */
+typedef struct GifCompressedImageType {
+	GifByteType *Data; /* Code size byte, sub-blocks, block terminator */
+	size_t Len;
+} GifCompressedImageType;
+
 typedef struct GifFilePrivateType {
 	GifWord FileState, FileHandle, /* Where all this data goes to! */
 	    BitsPerPixel, /* Bits per pixel (Codes uses at least this + 1). */
@@ -58,10 +86,33 @@ typedef struct GifFilePrivateType {
 	GifByteType Stack[LZ_MAX_CODE]; /* Decoded pixels are stacked here. */
 	GifByteType Suffix[LZ_MAX_CODE + 1]; /* So we can trace the codes. */
 	GifPrefixType Prefix[LZ_MAX_CODE + 1];
+	GifPrefixType RunLength[LZ_MAX_CODE + 1]; /* If one pixel repeated */
+	GifPrefixType CodeLength[LZ_MAX_CODE + 1]; /* Pixels, 0 if unknown */
+	GifByteType FirstPixel[LZ_MAX_CODE + 1]; /* Where its chain ends */
+	GifWord PrefixHigh; /* Prefix[] is all NO_SUCH_CODE from here up */
 	GifHashTableType *HashTable;
+	GifPushStateType *Push; /* Non-NULL for push-mode decoding */
+	GifCompressedImageType *Compressed; /* One per SavedImages entry */
+	int CompressedCount;
+	GifDecodeLimits Limits;     /* All zero unless DGifSetLimits() */
+	int ImagesSeen;             /* Image descriptors read so far */
+	unsigned long TotalPixels;  /* Their Width * Height, summed */
+	size_t Allocated;           /* Bytes charged against MaxAllocation */
+	unsigned long LZWBytes,     /* LZW input of this image so far */
+	    DecodedPixels;          /* Pixels of this image decoded so far */
 	bool gif89;
 } GifFilePrivateType;
 
+/* Run Job(Arg, 0) ... Job(Arg, Count - 1) on up to Threads threads */
+extern int GifParallelFor(int Count, int Threads,
+                          int (*Job)(void *Arg, int Index), void *Arg);
+
+/* Bytes of image data EGifSpew() would write for a raster, see egif_lib.c */
+extern long EGifImageCodeSize(int BitsPerPixel, const GifPixelType *Raster,
+                              int Width, int Height, bool Interlace,
+                              const GifPixelType *Translation,
+                              int Sample);
+
 #ifndef HAVE_REALLOCARRAY
 extern void *openbsd_reallocarray(void *optr, size_t nmemb, size_t size);
 #define reallocarray openbsd_reallocarray
@@ -6,15 +6,19 @@ SPDX-License-Identifier: MIT
 
 ****************************************************************************/
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif /* HAVE_PTHREADS */
+
 #include "gif_lib.h"
 #include "gif_lib_private.h"
 
-#define MAX(x, y) (((x) > (y)) ? (x) : (y))
-
 /******************************************************************************
  Miscellaneous utility functions
 ******************************************************************************/
@@ -31,6 +35,100 @@ int GifBitSize(int n) {
 	return (i);
 }
 
+/******************************************************************************
+ Work sharing for the routines that handle all images of a GIF at once
+******************************************************************************/
+
+typedef struct GifParallelJob {
+	int (*Job)(void *Arg, int Index);
+	void *Arg;
+	int Count, Next; /* Indices handed out so far */
+	bool Failed;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t Lock;
+#endif /* HAVE_PTHREADS */
+} GifParallelJob;
+
+static void *GifParallelWorker(void *Arg) {
+	GifParallelJob *Job = (GifParallelJob *)Arg;
+	int Index;
+
+	for (;;) {
+#ifdef HAVE_PTHREADS
+		pthread_mutex_lock(&Job->Lock);
+#endif /* HAVE_PTHREADS */
+		Index = Job->Next++;
+#ifdef HAVE_PTHREADS
+		pthread_mutex_unlock(&Job->Lock);
+#endif /* HAVE_PTHREADS */
+		if (Index >= Job->Count) {
+			break;
+		}
+		if (Job->Job(Job->Arg, Index) == GIF_ERROR) {
+#ifdef HAVE_PTHREADS
+			pthread_mutex_lock(&Job->Lock);
+#endif /* HAVE_PTHREADS */
+			Job->Failed = true;
+#ifdef HAVE_PTHREADS
+			pthread_mutex_unlock(&Job->Lock);
+#endif /* HAVE_PTHREADS */
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Call Job(Arg, Index) for every Index in [0, Count), on up to Threads
+ * threads (0 meaning one per online processor) counting the caller's, if
+ * built with HAVE_PTHREADS; otherwise in order on the calling thread.
+ * Jobs must not depend on each other.  Returns GIF_ERROR if any job did.
+ */
+int GifParallelFor(int Count, int Threads, int (*Job)(void *Arg, int Index),
+                   void *Arg) {
+	GifParallelJob Work;
+#ifdef HAVE_PTHREADS
+	pthread_t *Workers = NULL;
+	int i, Started = 0;
+#endif /* HAVE_PTHREADS */
+
+	Work.Job = Job;
+	Work.Arg = Arg;
+	Work.Count = Count;
+	Work.Next = 0;
+	Work.Failed = false;
+
+#ifdef HAVE_PTHREADS
+	if (Threads <= 0) {
+		Threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (Threads > Count) {
+		Threads = Count;
+	}
+	pthread_mutex_init(&Work.Lock, NULL);
+	if (Threads > 1) {
+		Workers = (pthread_t *)calloc(Threads - 1, sizeof(pthread_t));
+	}
+	/* If threads can't be had, fewer of them just do more each */
+	for (i = 0; Workers != NULL && i < Threads - 1; i++) {
+		if (pthread_create(&Workers[Started], NULL, GifParallelWorker,
+		                   &Work) == 0) {
+			Started++;
+		}
+	}
+	(void)GifParallelWorker(&Work);
+	for (i = 0; i < Started; i++) {
+		pthread_join(Workers[i], NULL);
+	}
+	free(Workers);
+	pthread_mutex_destroy(&Work.Lock);
+#else
+	(void)Threads;
+	(void)GifParallelWorker(&Work);
+#endif /* HAVE_PTHREADS */
+
+	return Work.Failed ? GIF_ERROR : GIF_OK;
+}
+
 /******************************************************************************
  Color map object functions
 ******************************************************************************/
@@ -101,28 +199,91 @@ void DumpColorMap(ColorMapObject *Object, FILE *fp) {
 }
 #endif /* DEBUG */
 
+/* Colors already placed in a union, keyed by packed RGB */
+#define UNION_HASH_SIZE 1024 /* A power of two, well over 256 */
+#define UNION_HASH_EMPTY 0xffffffffU
+
+typedef struct GifUnionHashType {
+	uint32_t Key[UNION_HASH_SIZE];
+	GifPixelType Slot[UNION_HASH_SIZE];
+} GifUnionHashType;
+
+/*
+ * Return the slot Color already has in the union, or give it NewSlot if
+ * it has none.  Only slots below 256 are ever recorded, so the table
+ * never fills up.
+ */
+static int UnionHashSlot(GifUnionHashType *Hash, const GifColorType *Color,
+                         int NewSlot) {
+	uint32_t Key = ((uint32_t)Color->Red << 16) |
+	               ((uint32_t)Color->Green << 8) | Color->Blue;
+	unsigned int h = (Key * 2654435761U) >> 22;
+
+	while (Hash->Key[h] != UNION_HASH_EMPTY) {
+		if (Hash->Key[h] == Key) {
+			return Hash->Slot[h];
+		}
+		h = (h + 1) & (UNION_HASH_SIZE - 1);
+	}
+	if (NewSlot < 256) {
+		Hash->Key[h] = Key;
+		Hash->Slot[h] = (GifPixelType)NewSlot;
+	}
+	return NewSlot;
+}
+
+/*
+ * Black out the slots of ColorUnion from CrntSlot up to the next power
+ * of two, and shrink it to that size.
+ */
+static ColorMapObject *UnionFinish(ColorMapObject *ColorUnion, int CrntSlot) {
+	int j, NewGifBitSize = GifBitSize(CrntSlot);
+	int RoundUpTo = (1 << NewGifBitSize);
+
+	for (j = CrntSlot; j < RoundUpTo; j++) {
+		ColorUnion->Colors[j].Red = ColorUnion->Colors[j].Green =
+		    ColorUnion->Colors[j].Blue = 0;
+	}
+
+	/* perhaps we can shrink the map? */
+	if (RoundUpTo < ColorUnion->ColorCount) {
+		GifColorType *new_map = (GifColorType *)reallocarray(
+		    ColorUnion->Colors, RoundUpTo, sizeof(GifColorType));
+		if (new_map == NULL) {
+			GifFreeMapObject(ColorUnion);
+			return ((ColorMapObject *)NULL);
+		}
+		ColorUnion->Colors = new_map;
+	}
+
+	ColorUnion->ColorCount = RoundUpTo;
+	ColorUnion->BitsPerPixel = NewGifBitSize;
+
+	return (ColorUnion);
+}
+
 /*******************************************************************************
  Compute the union of two given color maps and return it.  If result can't
  fit into 256 colors, NULL is returned, the allocated union otherwise.
  ColorIn1 is copied as is to ColorUnion, while colors from ColorIn2 are
  copied iff they didn't exist before.  ColorTransIn2 maps the old
- ColorIn2 into the ColorUnion color map table./
+ ColorIn2 into the ColorUnion color map table.  Colors are looked up in a
+ hash of the union so far, not by comparing against every slot.
 *******************************************************************************/
 ColorMapObject *GifUnionColorMap(const ColorMapObject *ColorIn1,
                                  const ColorMapObject *ColorIn2,
                                  GifPixelType ColorTransIn2[]) {
-	int i, j, CrntSlot, RoundUpTo, NewGifBitSize;
+	int i, CrntSlot;
 	ColorMapObject *ColorUnion;
+	GifUnionHashType Hash;
 
 	/*
-	 * We don't worry about duplicates within either color map; if
-	 * the caller wants to resolve those, he can perform unions
-	 * with an empty color map.
+	 * Duplicates within ColorIn1 are kept, as its indices must not
+	 * change; a color of ColorIn2 maps to the first of them.
 	 */
 
 	/* Allocate table which will hold the result for sure. */
-	ColorUnion = GifMakeMapObject(
-	    MAX(ColorIn1->ColorCount, ColorIn2->ColorCount) * 2, NULL);
+	ColorUnion = GifMakeMapObject(256, NULL);
 
 	if (ColorUnion == NULL) {
 		return (NULL);
@@ -143,80 +304,586 @@ ColorMapObject *GifUnionColorMap(const ColorMapObject *ColorIn1,
 	 * of table 1.  This is very useful if your display is limited to
 	 * 16 colors.
 	 */
-	while (ColorIn1->Colors[CrntSlot - 1].Red == 0 &&
+	while (CrntSlot > 0 && ColorIn1->Colors[CrntSlot - 1].Red == 0 &&
 	       ColorIn1->Colors[CrntSlot - 1].Green == 0 &&
 	       ColorIn1->Colors[CrntSlot - 1].Blue == 0) {
 		CrntSlot--;
 	}
 
+	/* Only the slots kept from ColorIn1 can be matched */
+	memset(Hash.Key, 0xff, sizeof(Hash.Key));
+	for (i = 0; i < CrntSlot; i++) {
+		(void)UnionHashSlot(&Hash, &ColorIn1->Colors[i], i);
+	}
+
 	/* Copy ColorIn2 to ColorUnion (use old colors if they exist): */
-	for (i = 0; i < ColorIn2->ColorCount && CrntSlot <= 256; i++) {
-		/* Let's see if this color already exists: */
-		for (j = 0; j < ColorIn1->ColorCount; j++) {
-			if (memcmp(&ColorIn1->Colors[j], &ColorIn2->Colors[i],
-			           sizeof(GifColorType)) == 0) {
-				break;
+	for (i = 0; i < ColorIn2->ColorCount; i++) {
+		int Slot = UnionHashSlot(&Hash, &ColorIn2->Colors[i], CrntSlot);
+
+		if (Slot == CrntSlot) {
+			/* Color is new - copy it to a new slot: */
+			if (CrntSlot == 256) {
+				GifFreeMapObject(ColorUnion);
+				return ((ColorMapObject *)NULL);
 			}
+			ColorUnion->Colors[CrntSlot++] = ColorIn2->Colors[i];
+		}
+		ColorTransIn2[i] = (GifPixelType)Slot;
+	}
+
+	return UnionFinish(ColorUnion, CrntSlot);
+}
+
+/*******************************************************************************
+ Compute the union of MapCount color maps at once, each color appearing in
+ it only once, and return it; NULL if that needs more than 256 colors.
+ ColorTrans[k] (ColorIn[k]->ColorCount entries) is filled in with where
+ each color of ColorIn[k] went.  NULL entries of ColorIn are skipped.
+*******************************************************************************/
+ColorMapObject *GifUnionColorMaps(int MapCount,
+                                  const ColorMapObject *const ColorIn[],
+                                  GifPixelType *ColorTrans[]) {
+	int i, k, CrntSlot = 0;
+	ColorMapObject *ColorUnion;
+	GifUnionHashType Hash;
+
+	if ((ColorUnion = GifMakeMapObject(256, NULL)) == NULL) {
+		return (NULL);
+	}
+	memset(Hash.Key, 0xff, sizeof(Hash.Key));
+
+	for (k = 0; k < MapCount; k++) {
+		if (ColorIn[k] == NULL) {
+			continue;
 		}
+		for (i = 0; i < ColorIn[k]->ColorCount; i++) {
+			int Slot = UnionHashSlot(&Hash, &ColorIn[k]->Colors[i],
+			                         CrntSlot);
+
+			if (Slot == CrntSlot) {
+				if (CrntSlot == 256) {
+					GifFreeMapObject(ColorUnion);
+					return ((ColorMapObject *)NULL);
+				}
+				ColorUnion->Colors[CrntSlot++] =
+				    ColorIn[k]->Colors[i];
+			}
+			ColorTrans[k][i] = (GifPixelType)Slot;
+		}
+	}
+
+	return UnionFinish(ColorUnion, CrntSlot);
+}
+
+/* True if all 256 entries of Translation leave their color where it is */
+static bool TranslationIsIdentity(const GifPixelType Translation[]) {
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (Translation[i] != i) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Translate Len pixels.  The lookups of a group of eight are independent
+ * of each other's stores, so they can all be in flight at once.
+ */
+static void TranslatePixels(GifPixelType *Bits, size_t Len,
+                            const GifPixelType Translation[]) {
+	size_t i = 0;
+
+	for (; i + 8 <= Len; i += 8) {
+		GifPixelType p0 = Translation[Bits[i]],
+		             p1 = Translation[Bits[i + 1]],
+		             p2 = Translation[Bits[i + 2]],
+		             p3 = Translation[Bits[i + 3]],
+		             p4 = Translation[Bits[i + 4]],
+		             p5 = Translation[Bits[i + 5]],
+		             p6 = Translation[Bits[i + 6]],
+		             p7 = Translation[Bits[i + 7]];
+
+		Bits[i] = p0;
+		Bits[i + 1] = p1;
+		Bits[i + 2] = p2;
+		Bits[i + 3] = p3;
+		Bits[i + 4] = p4;
+		Bits[i + 5] = p5;
+		Bits[i + 6] = p6;
+		Bits[i + 7] = p7;
+	}
+	for (; i < Len; i++) {
+		Bits[i] = Translation[Bits[i]];
+	}
+}
+
+/*******************************************************************************
+ Apply a given color translation to the raster bits of an image
+*******************************************************************************/
+void GifApplyTranslation(SavedImage *Image, const GifPixelType Translation[]) {
+	TranslatePixels(Image->RasterBits,
+	                (size_t)Image->ImageDesc.Height *
+	                    Image->ImageDesc.Width,
+	                Translation);
+}
+
+/* Pixels translated by one job of GifApplyTranslations() */
+#define TRANSLATE_CHUNK 65536
+
+typedef struct GifTranslateJob {
+	SavedImage *SavedImages;
+	const GifPixelType *const *Translations;
+	int ImageCount;
+	int *FirstChunk; /* Job index of each image's first chunk, and a
+	                    last entry with the total */
+} GifTranslateJob;
+
+/* GifParallelFor() job translating one chunk of one image */
+static int TranslateChunk(void *Arg, int Index) {
+	GifTranslateJob *Job = (GifTranslateJob *)Arg;
+	int Low = 0, High = Job->ImageCount - 1;
+	SavedImage *sp;
+	size_t Size, Offset;
 
-		if (j < ColorIn1->ColorCount) {
-			ColorTransIn2[i] = j; /* color exists in Color1 */
+	/* The last image whose first chunk is not past Index */
+	while (Low < High) {
+		int Middle = (Low + High + 1) / 2;
+
+		if (Job->FirstChunk[Middle] <= Index) {
+			Low = Middle;
 		} else {
-			/* Color is new - copy it to a new slot: */
-			ColorUnion->Colors[CrntSlot] = ColorIn2->Colors[i];
-			ColorTransIn2[i] = CrntSlot++;
+			High = Middle - 1;
 		}
 	}
+	sp = &Job->SavedImages[Low];
+	Size = (size_t)sp->ImageDesc.Height * sp->ImageDesc.Width;
+	Offset = (size_t)(Index - Job->FirstChunk[Low]) * TRANSLATE_CHUNK;
+	TranslatePixels(sp->RasterBits + Offset,
+	                Size - Offset < TRANSLATE_CHUNK ? Size - Offset
+	                                                : TRANSLATE_CHUNK,
+	                Job->Translations[Low]);
+	return GIF_OK;
+}
 
-	if (CrntSlot > 256) {
-		GifFreeMapObject(ColorUnion);
-		return ((ColorMapObject *)NULL);
+/*******************************************************************************
+ Apply Translations[i] to the raster bits of SavedImages[i], for every
+ image at once, on up to Threads threads (0 means one per online
+ processor).  Large images are split between threads too.  Images with a
+ NULL translation or no raster are left alone, and so are those whose
+ translation is the identity, so every non-NULL table must have all 256
+ entries.
+*******************************************************************************/
+int GifApplyTranslations(GifFileType *GifFile,
+                         const GifPixelType *const Translations[],
+                         int Threads) {
+	GifTranslateJob Job;
+	int i, Chunks = 0;
+
+	Job.SavedImages = GifFile->SavedImages;
+	Job.Translations = Translations;
+	Job.ImageCount = GifFile->ImageCount;
+	Job.FirstChunk = (int *)calloc(GifFile->ImageCount + 1, sizeof(int));
+	if (Job.FirstChunk == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
 	}
+	for (i = 0; i < GifFile->ImageCount; i++) {
+		const SavedImage *sp = &GifFile->SavedImages[i];
+
+		Job.FirstChunk[i] = Chunks;
+		if (Translations[i] != NULL && sp->RasterBits != NULL &&
+		    !TranslationIsIdentity(Translations[i])) {
+			size_t Size =
+			    (size_t)sp->ImageDesc.Height * sp->ImageDesc.Width;
+			Chunks += (int)((Size + TRANSLATE_CHUNK - 1) /
+			                TRANSLATE_CHUNK);
+		}
+	}
+	Job.FirstChunk[i] = Chunks;
 
-	NewGifBitSize = GifBitSize(CrntSlot);
-	RoundUpTo = (1 << NewGifBitSize);
+	(void)GifParallelFor(Chunks, Threads, TranslateChunk, &Job);
+	free(Job.FirstChunk);
+	return GIF_OK;
+}
 
-	if (RoundUpTo != ColorUnion->ColorCount) {
-		register GifColorType *Map = ColorUnion->Colors;
+/*
+ * Put the indices below ColorCount with nonzero Counts in Order, most used
+ * first; a stable insertion sort keeps ties in index order.  Returns how
+ * many there are.
+ */
+static int OrderByUse(const unsigned long Counts[], int ColorCount,
+                      int Order[]) {
+	int Used = 0, i, j;
 
-		/*
-		 * Zero out slots up to next power of 2.
-		 * We know these slots exist because of the way ColorUnion's
-		 * start dimension was computed.
-		 */
-		for (j = CrntSlot; j < RoundUpTo; j++) {
-			Map[j].Red = Map[j].Green = Map[j].Blue = 0;
+	for (i = 0; i < ColorCount; i++) {
+		if (Counts[i] == 0) {
+			continue;
+		}
+		for (j = Used++; j > 0 && Counts[Order[j - 1]] < Counts[i];
+		     j--) {
+			Order[j] = Order[j - 1];
 		}
+		Order[j] = i;
+	}
+	return Used;
+}
 
-		/* perhaps we can shrink the map? */
-		if (RoundUpTo < ColorUnion->ColorCount) {
-			GifColorType *new_map = (GifColorType *)reallocarray(
-			    Map, RoundUpTo, sizeof(GifColorType));
-			if (new_map == NULL) {
-				GifFreeMapObject(ColorUnion);
-				return ((ColorMapObject *)NULL);
+/*
+ * Drop the colors of one color map that no pixel uses, put the rest in
+ * order of decreasing use, and remap the images drawing on it.  With
+ * ImageIndex < 0 that is the global map, used by the images without a
+ * local map and by the background color; otherwise the local map of
+ * that image.  Transparent colors count as used.  The map is left alone
+ * if an image using it was never decoded, or has pixels past its end.
+ */
+static int CompactColorMap(GifFileType *GifFile, int ImageIndex) {
+	ColorMapObject **Map, *NewMap;
+	unsigned long Counts[256];
+	GifPixelType Translation[256];
+	int Order[256], Used, First, Last, i, j;
+
+	if (ImageIndex < 0) {
+		Map = &GifFile->SColorMap;
+		First = 0;
+		Last = GifFile->ImageCount - 1;
+	} else {
+		Map = &GifFile->SavedImages[ImageIndex].ImageDesc.ColorMap;
+		First = Last = ImageIndex;
+	}
+	if (*Map == NULL) {
+		return GIF_OK;
+	}
+
+	memset(Counts, '\0', sizeof(Counts));
+	for (i = First; i <= Last; i++) {
+		const SavedImage *sp = &GifFile->SavedImages[i];
+		size_t k, Size = (size_t)sp->ImageDesc.Height *
+		                 sp->ImageDesc.Width;
+		GraphicsControlBlock GCB;
+
+		if (ImageIndex < 0 && sp->ImageDesc.ColorMap != NULL) {
+			continue;
+		}
+		if (sp->RasterBits == NULL) {
+			return GIF_OK;
+		}
+		for (k = 0; k < Size; k++) {
+			Counts[sp->RasterBits[k]]++;
+		}
+		if (DGifSavedExtensionToGCB(GifFile, i, &GCB) == GIF_OK &&
+		    GCB.TransparentColor >= 0 &&
+		    GCB.TransparentColor < (*Map)->ColorCount) {
+			Counts[GCB.TransparentColor]++;
+		}
+	}
+	if (ImageIndex < 0 && GifFile->SBackGroundColor >= 0 &&
+	    GifFile->SBackGroundColor < (*Map)->ColorCount) {
+		Counts[GifFile->SBackGroundColor]++;
+	}
+	for (i = (*Map)->ColorCount; i < 256; i++) {
+		if (Counts[i] != 0) {
+			return GIF_OK;
+		}
+	}
+
+	Used = OrderByUse(Counts, (*Map)->ColorCount, Order);
+	if ((NewMap = GifMakeMapObject(1 << GifBitSize(Used), NULL)) == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	memset(Translation, '\0', sizeof(Translation));
+	for (j = 0; j < Used; j++) {
+		NewMap->Colors[j] = (*Map)->Colors[Order[j]];
+		Translation[Order[j]] = (GifPixelType)j;
+	}
+	NewMap->SortFlag = true;
+
+	for (i = First; i <= Last; i++) {
+		SavedImage *sp = &GifFile->SavedImages[i];
+		GraphicsControlBlock GCB;
+
+		if (ImageIndex < 0 && sp->ImageDesc.ColorMap != NULL) {
+			continue;
+		}
+		GifApplyTranslation(sp, Translation);
+		if (DGifSavedExtensionToGCB(GifFile, i, &GCB) == GIF_OK &&
+		    GCB.TransparentColor >= 0 &&
+		    GCB.TransparentColor < (*Map)->ColorCount) {
+			GCB.TransparentColor =
+			    Translation[GCB.TransparentColor];
+			if (EGifGCBToSavedExtension(&GCB, GifFile, i) ==
+			    GIF_ERROR) {
+				GifFreeMapObject(NewMap);
+				GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+				return GIF_ERROR;
 			}
-			ColorUnion->Colors = new_map;
 		}
 	}
+	if (ImageIndex < 0 && GifFile->SBackGroundColor >= 0 &&
+	    GifFile->SBackGroundColor < (*Map)->ColorCount) {
+		GifFile->SBackGroundColor =
+		    Translation[GifFile->SBackGroundColor];
+	}
 
-	ColorUnion->ColorCount = RoundUpTo;
-	ColorUnion->BitsPerPixel = NewGifBitSize;
+	GifFreeMapObject(*Map);
+	*Map = NewMap;
+	return GIF_OK;
+}
 
-	return (ColorUnion);
+/*******************************************************************************
+ Shrink every color map of a slurped GIF to the colors its images actually
+ use, sorted by decreasing use, with as few bits per pixel as will hold
+ them; the rasters, transparent colors and background color are remapped
+ to match.  Fewer bits per pixel mean narrower LZW codes when the GIF is
+ written out again.  Maps used by images that were never decoded are left
+ as they are.
+*******************************************************************************/
+int GifCompactColorMaps(GifFileType *GifFile) {
+	int i;
+
+	if (CompactColorMap(GifFile, -1) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	for (i = 0; i < GifFile->ImageCount; i++) {
+		if (GifFile->SavedImages[i].ImageDesc.ColorMap != NULL &&
+		    CompactColorMap(GifFile, i) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/*
+ * Give pixels that are the same color the same index: every entry of one
+ * color map (as for CompactColorMap()) that repeats an earlier one is
+ * folded into it.  Equal pixels make longer LZW strings, and the entries
+ * freed are dropped by a later compaction.  Transparent colors are never
+ * folded, since their pixels only look like their color map entry.
+ */
+static void MergeDuplicateColors(GifFileType *GifFile, int ImageIndex) {
+	ColorMapObject *Map;
+	GifPixelType Translation[256];
+	bool Transparent[256], Changed = false;
+	int First, Last, i, j;
+
+	if (ImageIndex < 0) {
+		Map = GifFile->SColorMap;
+		First = 0;
+		Last = GifFile->ImageCount - 1;
+	} else {
+		Map = GifFile->SavedImages[ImageIndex].ImageDesc.ColorMap;
+		First = Last = ImageIndex;
+	}
+	if (Map == NULL) {
+		return;
+	}
+
+	memset(Transparent, '\0', sizeof(Transparent));
+	for (i = First; i <= Last; i++) {
+		GraphicsControlBlock GCB;
+
+		if (ImageIndex < 0 &&
+		    GifFile->SavedImages[i].ImageDesc.ColorMap != NULL) {
+			continue;
+		}
+		if (DGifSavedExtensionToGCB(GifFile, i, &GCB) == GIF_OK &&
+		    GCB.TransparentColor >= 0 &&
+		    GCB.TransparentColor < Map->ColorCount) {
+			Transparent[GCB.TransparentColor] = true;
+		}
+	}
+
+	for (i = 0; i < 256; i++) {
+		Translation[i] = (GifPixelType)i;
+		if (i >= Map->ColorCount || Transparent[i]) {
+			continue;
+		}
+		for (j = 0; j < i; j++) {
+			if (!Transparent[j] && Translation[j] == j &&
+			    Map->Colors[j].Red == Map->Colors[i].Red &&
+			    Map->Colors[j].Green == Map->Colors[i].Green &&
+			    Map->Colors[j].Blue == Map->Colors[i].Blue) {
+				Translation[i] = (GifPixelType)j;
+				Changed = true;
+				break;
+			}
+		}
+	}
+	if (!Changed) {
+		return;
+	}
+
+	/* The map itself stays as it is, so undecoded images are still right */
+	for (i = First; i <= Last; i++) {
+		SavedImage *sp = &GifFile->SavedImages[i];
+
+		if ((ImageIndex < 0 && sp->ImageDesc.ColorMap != NULL) ||
+		    sp->RasterBits == NULL) {
+			continue;
+		}
+		GifApplyTranslation(sp, Translation);
+	}
+	if (ImageIndex < 0 && GifFile->SBackGroundColor >= 0 &&
+	    GifFile->SBackGroundColor < Map->ColorCount) {
+		GifFile->SBackGroundColor =
+		    Translation[GifFile->SBackGroundColor];
+	}
+}
+
+/*
+ * Decide whether one decoded image is smaller with a local color map or
+ * drawing on the global one, sizing its LZW data each way the way
+ * EGifSpew() would write it, and switch it over if the other is smaller.
+ * An image with a local map can only move to the global map if every
+ * color it shows is there, plus a spare index for its transparent color.
+ * One on the global map moves to a local map of just its own colors.
+ */
+static int ChooseColorMap(GifFileType *GifFile, int ImageIndex) {
+	SavedImage *sp = &GifFile->SavedImages[ImageIndex];
+	ColorMapObject *Local = sp->ImageDesc.ColorMap;
+	ColorMapObject *Global = GifFile->SColorMap, *NewMap = NULL;
+	ColorMapObject *Map = Local != NULL ? Local : Global;
+	unsigned long Counts[256];
+	GifPixelType Translation[256];
+	bool Taken[256];
+	int Order[256], Used, Transparent = NO_TRANSPARENT_COLOR, i, j;
+	int Width = sp->ImageDesc.Width, Height = sp->ImageDesc.Height;
+	bool Interlace = sp->ImageDesc.Interlace;
+	size_t k, Size = (size_t)Width * Height;
+	long OldLen, NewLen;
+	GraphicsControlBlock GCB;
+
+	if (Global == NULL || sp->RasterBits == NULL || Size == 0) {
+		return GIF_OK;
+	}
+	memset(Counts, '\0', sizeof(Counts));
+	for (k = 0; k < Size; k++) {
+		Counts[sp->RasterBits[k]]++;
+	}
+	for (i = Map->ColorCount; i < 256; i++) {
+		if (Counts[i] != 0) {
+			return GIF_OK;
+		}
+	}
+	if (DGifSavedExtensionToGCB(GifFile, ImageIndex, &GCB) == GIF_OK &&
+	    GCB.TransparentColor >= 0 &&
+	    GCB.TransparentColor < Map->ColorCount) {
+		Transparent = GCB.TransparentColor;
+		Counts[Transparent]++;
+	}
+
+	memset(Translation, '\0', sizeof(Translation));
+	if (Local != NULL) {
+		memset(Taken, '\0', sizeof(Taken));
+		for (i = 0; i < Local->ColorCount; i++) {
+			if (Counts[i] == 0 || i == Transparent) {
+				continue;
+			}
+			for (j = 0; j < Global->ColorCount; j++) {
+				if (Global->Colors[j].Red ==
+				        Local->Colors[i].Red &&
+				    Global->Colors[j].Green ==
+				        Local->Colors[i].Green &&
+				    Global->Colors[j].Blue ==
+				        Local->Colors[i].Blue) {
+					break;
+				}
+			}
+			if (j == Global->ColorCount) {
+				return GIF_OK;
+			}
+			Translation[i] = (GifPixelType)j;
+			Taken[j] = true;
+		}
+		if (Transparent != NO_TRANSPARENT_COLOR) {
+			for (j = 0; j < Global->ColorCount && Taken[j]; j++) {
+				continue;
+			}
+			if (j == Global->ColorCount) {
+				return GIF_OK;
+			}
+			Translation[Transparent] = (GifPixelType)j;
+		}
+		OldLen = EGifImageCodeSize(Local->BitsPerPixel,
+		                           sp->RasterBits, Width, Height,
+		                           Interlace, NULL, 1);
+		OldLen += 3 * Local->ColorCount;
+		NewLen = EGifImageCodeSize(Global->BitsPerPixel,
+		                           sp->RasterBits, Width, Height,
+		                           Interlace, Translation, 1);
+	} else {
+		Used = OrderByUse(Counts, Global->ColorCount, Order);
+		NewMap = GifMakeMapObject(1 << GifBitSize(Used), NULL);
+		if (NewMap == NULL) {
+			GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		for (j = 0; j < Used; j++) {
+			NewMap->Colors[j] = Global->Colors[Order[j]];
+			Translation[Order[j]] = (GifPixelType)j;
+		}
+		NewMap->SortFlag = true;
+		OldLen = EGifImageCodeSize(Global->BitsPerPixel,
+		                           sp->RasterBits, Width, Height,
+		                           Interlace, NULL, 1);
+		NewLen = EGifImageCodeSize(NewMap->BitsPerPixel,
+		                           sp->RasterBits, Width, Height,
+		                           Interlace, Translation, 1);
+		NewLen += 3 * NewMap->ColorCount;
+	}
+	if (OldLen < 0 || NewLen < 0) {
+		GifFreeMapObject(NewMap);
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	if (NewLen >= OldLen) {
+		GifFreeMapObject(NewMap);
+		return GIF_OK;
+	}
+
+	if (Transparent != NO_TRANSPARENT_COLOR) {
+		GCB.TransparentColor = Translation[Transparent];
+		if (EGifGCBToSavedExtension(&GCB, GifFile, ImageIndex) ==
+		    GIF_ERROR) {
+			GifFreeMapObject(NewMap);
+			GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+	}
+	GifApplyTranslation(sp, Translation);
+	GifFreeMapObject(Local);
+	sp->ImageDesc.ColorMap = NewMap;
+	return GIF_OK;
 }
 
 /*******************************************************************************
- Apply a given color translation to the raster bits of an image
+ Choose the color indices of a slurped GIF to make it smaller when written
+ out again.  Pixels of the same color are given the same index, the color
+ maps are compacted as by GifCompactColorMaps(), and then each image in
+ turn is moved between the global map and a local map of its own if the
+ LZW data plus color map would come out smaller, as counted by a dry run
+ of the encoder.  How the GIF looks does not change.  Only the choice of
+ which pixels share an index matters to LZW, not which index they get,
+ which is why the colors are not searched for a better order.
 *******************************************************************************/
-void GifApplyTranslation(SavedImage *Image, const GifPixelType Translation[]) {
-	register int i;
-	register int RasterSize =
-	    Image->ImageDesc.Height * Image->ImageDesc.Width;
+int GifOptimizeColorMaps(GifFileType *GifFile) {
+	int i;
 
-	for (i = 0; i < RasterSize; i++) {
-		Image->RasterBits[i] = Translation[Image->RasterBits[i]];
+	MergeDuplicateColors(GifFile, -1);
+	for (i = 0; i < GifFile->ImageCount; i++) {
+		MergeDuplicateColors(GifFile, i);
+	}
+	if (GifCompactColorMaps(GifFile) == GIF_ERROR) {
+		return GIF_ERROR;
 	}
+	for (i = 0; i < GifFile->ImageCount; i++) {
+		if (ChooseColorMap(GifFile, i) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GifCompactColorMaps(GifFile);
 }
 
 /******************************************************************************
@@ -339,6 +1006,7 @@ SavedImage *GifMakeSavedImage(GifFileType *GifFile,
 		return ((SavedImage *)NULL);
 	} else {
 		SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount++];
+		int i;
 
 		if (CopyFrom != NULL) {
 			memcpy((char *)sp, CopyFrom, sizeof(SavedImage));
@@ -360,20 +1028,22 @@ SavedImage *GifMakeSavedImage(GifFileType *GifFile,
 				}
 			}
 
-			/* next, the raster */
-			sp->RasterBits = (unsigned char *)reallocarray(
-			    NULL,
-			    (CopyFrom->ImageDesc.Height *
-			     CopyFrom->ImageDesc.Width),
-			    sizeof(GifPixelType));
-			if (sp->RasterBits == NULL) {
-				FreeLastSavedImage(GifFile);
-				return (SavedImage *)(NULL);
+			/* next, the raster, unless it was never decoded */
+			if (CopyFrom->RasterBits != NULL) {
+				sp->RasterBits = (unsigned char *)reallocarray(
+				    NULL,
+				    (CopyFrom->ImageDesc.Height *
+				     CopyFrom->ImageDesc.Width),
+				    sizeof(GifPixelType));
+				if (sp->RasterBits == NULL) {
+					FreeLastSavedImage(GifFile);
+					return (SavedImage *)(NULL);
+				}
+				memcpy(sp->RasterBits, CopyFrom->RasterBits,
+				       sizeof(GifPixelType) *
+				           CopyFrom->ImageDesc.Height *
+				           CopyFrom->ImageDesc.Width);
 			}
-			memcpy(sp->RasterBits, CopyFrom->RasterBits,
-			       sizeof(GifPixelType) *
-			           CopyFrom->ImageDesc.Height *
-			           CopyFrom->ImageDesc.Width);
 
 			/* finally, the extension blocks */
 			if (CopyFrom->ExtensionBlocks != NULL) {
@@ -389,6 +1059,22 @@ SavedImage *GifMakeSavedImage(GifFileType *GifFile,
 				       CopyFrom->ExtensionBlocks,
 				       sizeof(ExtensionBlock) *
 				           CopyFrom->ExtensionBlockCount);
+				for (i = 0; i < CopyFrom->ExtensionBlockCount;
+				     i++) {
+					ExtensionBlock *ep =
+					    &sp->ExtensionBlocks[i];
+					GifByteType *Bytes = (GifByteType *)
+					    malloc(ep->ByteCount + 1);
+
+					if (Bytes == NULL) {
+						/* Free only the copies */
+						sp->ExtensionBlockCount = i;
+						FreeLastSavedImage(GifFile);
+						return (SavedImage *)(NULL);
+					}
+					memcpy(Bytes, ep->Bytes, ep->ByteCount);
+					ep->Bytes = Bytes;
+				}
 			}
 		} else {
 			memset((char *)sp, '\0', sizeof(SavedImage));
@@ -21,6 +21,7 @@ SPDX-License-Identifier: MIT
 ****************************************************************************/
 
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,15 +31,169 @@ SPDX-License-Identifier: MIT
 
 #define PROGRAM_NAME "gifsponge"
 
+static char *CtrlStr =
+    PROGRAM_NAME " a%-MaxBytes!d c%- e%-Sample!d j%-Threads!d "
+                 "l%-MaxPixels!d n%-MaxImages!d o%- p%- r%-MaxRatio!d "
+                 "s%-MaxScreen!d t%-MaxTotal!d u%- h%-";
+
+/*
+ * Merge the global color map and every local one into a single global
+ * map, and remap the rasters (on Threads threads), the background and the
+ * transparent colors to match.  Fails if that takes more than 256 colors.
+ */
+static int UnionColorMaps(GifFileType *GifFile, int Threads) {
+	int i, MapCount = GifFile->ImageCount + 1;
+	const ColorMapObject **ColorIn;
+	GifPixelType **ColorTrans, *Tables;
+	const GifPixelType **Translations;
+	ColorMapObject *ColorUnion = NULL;
+	bool GlobalMoved = false;
+
+	ColorIn = (const ColorMapObject **)calloc(MapCount,
+	                                          sizeof(ColorMapObject *));
+	ColorTrans = (GifPixelType **)calloc(MapCount, sizeof(GifPixelType *));
+	Tables = (GifPixelType *)calloc(MapCount, 256);
+	Translations = (const GifPixelType **)calloc(MapCount,
+	                                             sizeof(GifPixelType *));
+	if (ColorIn != NULL && ColorTrans != NULL && Tables != NULL &&
+	    Translations != NULL) {
+		/* GifApplyTranslations() reads all 256 entries of a table,
+		 * and those past the end of a map stay where they are */
+		for (i = 0; i < MapCount * 256; i++) {
+			Tables[i] = (GifPixelType)(i & 0xff);
+		}
+		ColorIn[0] = GifFile->SColorMap;
+		for (i = 0; i < MapCount; i++) {
+			if (i > 0) {
+				ColorIn[i] = GifFile->SavedImages[i - 1]
+				                 .ImageDesc.ColorMap;
+			}
+			ColorTrans[i] = Tables + 256 * i;
+		}
+		ColorUnion = GifUnionColorMaps(MapCount, ColorIn, ColorTrans);
+	}
+	if (ColorUnion == NULL) {
+		free(ColorIn);
+		free(ColorTrans);
+		free(Tables);
+		free(Translations);
+		return GIF_ERROR;
+	}
+
+	/* The global map comes first, so it moves only if it repeats colors */
+	for (i = 0; ColorIn[0] != NULL && i < ColorIn[0]->ColorCount; i++) {
+		GlobalMoved |= (ColorTrans[0][i] != i);
+	}
+	for (i = 0; i < GifFile->ImageCount; i++) {
+		SavedImage *sp = &GifFile->SavedImages[i];
+		GifPixelType *Trans = ColorIn[i + 1] != NULL ? ColorTrans[i + 1]
+		                      : ColorIn[0] != NULL   ? ColorTrans[0]
+		                                             : NULL;
+		GraphicsControlBlock GCB;
+
+		if (Trans == NULL) {
+			continue;
+		}
+		/* Images left on an unmoved global map need no translation */
+		if (ColorIn[i + 1] != NULL || GlobalMoved) {
+			Translations[i] = Trans;
+		}
+		if (DGifSavedExtensionToGCB(GifFile, i, &GCB) == GIF_OK &&
+		    GCB.TransparentColor != NO_TRANSPARENT_COLOR) {
+			GCB.TransparentColor = Trans[GCB.TransparentColor];
+			(void)EGifGCBToSavedExtension(&GCB, GifFile, i);
+		}
+		GifFreeMapObject(sp->ImageDesc.ColorMap);
+		sp->ImageDesc.ColorMap = NULL;
+	}
+	if (GifFile->SColorMap != NULL) {
+		GifFile->SBackGroundColor =
+		    ColorTrans[0][GifFile->SBackGroundColor & 0xff];
+		GifFreeMapObject(GifFile->SColorMap);
+	}
+	GifFile->SColorMap = ColorUnion;
+
+	i = GifApplyTranslations(GifFile, Translations, Threads);
+	free(ColorIn);
+	free(ColorTrans);
+	free(Tables);
+	free(Translations);
+	return i;
+}
+
 int main(int argc, char **argv) {
-	int i, ErrorCode;
+	int i, ErrorCode, Sample = 1, Threads = 0, MaxPixels = 0, MaxImages = 0;
+	int MaxBytes = 0, MaxRatio = 0, MaxScreen = 0, MaxTotal = 0;
+	bool Error, CopyFlag = false, EstimateFlag = false, ThreadsFlag = false,
+	            PixelsFlag = false, ImagesFlag = false, BytesFlag = false,
+	            RatioFlag = false, ScreenFlag = false, TotalFlag = false,
+	            OptimizeFlag = false, CompactFlag = false,
+	            UnionFlag = false, HelpFlag = false;
 	GifFileType *GifFileIn, *GifFileOut = (GifFileType *)NULL;
 
+	if ((Error = GAGetArgs(argc, argv, CtrlStr, &BytesFlag, &MaxBytes,
+	                       &CopyFlag, &EstimateFlag, &Sample, &ThreadsFlag,
+	                       &Threads, &PixelsFlag, &MaxPixels, &ImagesFlag,
+	                       &MaxImages, &OptimizeFlag, &CompactFlag,
+	                       &RatioFlag, &MaxRatio, &ScreenFlag, &MaxScreen,
+	                       &TotalFlag, &MaxTotal, &UnionFlag, &HelpFlag)) !=
+	    false) {
+		GAPrintErrMsg(Error);
+		GAPrintHowTo(CtrlStr);
+		exit(EXIT_FAILURE);
+	}
+	if (HelpFlag) {
+		GAPrintHowTo(CtrlStr);
+		exit(EXIT_SUCCESS);
+	}
+	if (CopyFlag && UnionFlag) {
+		fprintf(stderr, "%s: -u needs the images decoded, not -c.\n",
+		        PROGRAM_NAME);
+		exit(EXIT_FAILURE);
+	}
+
 	if ((GifFileIn = DGifOpenFileHandle(0, &ErrorCode)) == NULL) {
 		PrintGifError(ErrorCode);
 		exit(EXIT_FAILURE);
 	}
-	if (DGifSlurp(GifFileIn) == GIF_ERROR) {
+	/*
+	 * -l and -n refuse images bigger than, or more than, given; -s and
+	 * -t a bigger screen or more pixels in all; -a more memory, and -r
+	 * more pixels per byte of LZW data
+	 */
+	if (PixelsFlag || ImagesFlag || BytesFlag || RatioFlag || ScreenFlag ||
+	    TotalFlag) {
+		GifDecodeLimits Limits;
+
+		memset(&Limits, '\0', sizeof(Limits));
+		Limits.MaxImagePixels = (unsigned long)MaxPixels;
+		Limits.MaxImageCount = MaxImages;
+		Limits.MaxCanvasPixels = (unsigned long)MaxScreen;
+		Limits.MaxTotalPixels = (unsigned long)MaxTotal;
+		Limits.MaxAllocation = (size_t)MaxBytes;
+		Limits.MaxLZWRatio = (unsigned int)MaxRatio;
+		if (DGifSetLimits(GifFileIn, &Limits) == GIF_ERROR) {
+			PrintGifError(GifFileIn->Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+	/*
+	 * With -c, read the images undecoded and copy their LZW data as it
+	 * is.  With -j, decode them all at once on that many threads (0 for
+	 * one per processor) afterwards.
+	 */
+	if (CopyFlag) {
+		if (DGifSlurpCompressed(GifFileIn) == GIF_ERROR) {
+			PrintGifError(GifFileIn->Error);
+			exit(EXIT_FAILURE);
+		}
+	} else if (ThreadsFlag) {
+		if (DGifSlurpCompressed(GifFileIn) == GIF_ERROR ||
+		    DGifDecodeSavedImages(GifFileIn, Threads) == GIF_ERROR) {
+			PrintGifError(GifFileIn->Error);
+			exit(EXIT_FAILURE);
+		}
+	} else if (DGifSlurp(GifFileIn) == GIF_ERROR) {
 		PrintGifError(GifFileIn->Error);
 		exit(EXIT_FAILURE);
 	}
@@ -47,6 +202,26 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	/* With -o, also choose color indices and maps for the smallest GIF */
+	if (OptimizeFlag && GifOptimizeColorMaps(GifFileIn) == GIF_ERROR) {
+		PrintGifError(GifFileIn->Error);
+		exit(EXIT_FAILURE);
+	}
+
+	/* With -p, drop unused colors and shrink the color maps to fit */
+	if (CompactFlag && GifCompactColorMaps(GifFileIn) == GIF_ERROR) {
+		PrintGifError(GifFileIn->Error);
+		exit(EXIT_FAILURE);
+	}
+
+	/* With -u, put every image on one global color map */
+	if (UnionFlag &&
+	    UnionColorMaps(GifFileIn, ThreadsFlag ? Threads : 1) == GIF_ERROR) {
+		fprintf(stderr, "%s: color maps need over 256 colors.\n",
+		        PROGRAM_NAME);
+		exit(EXIT_FAILURE);
+	}
+
 	/*
 	 * Your operations on in-core structures go here.
 	 * This code just copies the header and each image from the incoming
@@ -65,7 +240,31 @@ int main(int argc, char **argv) {
 	}
 
 	for (i = 0; i < GifFileIn->ImageCount; i++) {
+		const GifByteType *Code;
+		size_t Len;
+
 		(void)GifMakeSavedImage(GifFileOut, &GifFileIn->SavedImages[i]);
+		if (CopyFlag &&
+		    DGifGetSavedImageCode(GifFileIn, i, &Code, &Len) ==
+		        GIF_OK &&
+		    EGifSetSavedImageCode(GifFileOut, i, Code, Len) ==
+		        GIF_ERROR) {
+			PrintGifError(GifFileOut->Error);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* With -e, say how big the output would be instead of writing it */
+	if (EstimateFlag) {
+		unsigned long Size;
+
+		if (EGifEstimateSize(GifFileOut, -1, Sample, &Size) ==
+		    GIF_ERROR) {
+			PrintGifError(GifFileOut->Error);
+			exit(EXIT_FAILURE);
+		}
+		printf("%lu\n", Size);
+		exit(EXIT_SUCCESS);
 	}
 
 	/*
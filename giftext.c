@@ -26,7 +26,8 @@ SPDX-License-Identifier: MIT
 static char *VersionStr = PROGRAM_NAME VERSION_COOKIE
     "	Gershon Elber,	" __DATE__ ",   " __TIME__ "\n"
     "(C) Copyright 1989 Gershon Elber.\n";
-static char *CtrlStr = PROGRAM_NAME " v%- c%- e%- z%- p%- r%- h%- GifFile!*s";
+static char *CtrlStr =
+    PROGRAM_NAME " v%- c%- e%- z%- p%- r%- s%- h%- GifFile!*s";
 
 static void PrintCodeBlock(GifFileType *GifFile, GifByteType *CodeBlock,
                            bool Reset);
@@ -41,7 +42,7 @@ int main(int argc, char **argv) {
 	int i, j, ExtCode, ErrorCode, CodeSize, NumFiles, Len, ImageNum = 1;
 	bool Error, ColorMapFlag = false, EncodedFlag = false,
 	            LZCodesFlag = false, PixelFlag = false, HelpFlag = false,
-	            RawFlag = false, GifNoisyPrint;
+	            RawFlag = false, SummaryFlag = false, GifNoisyPrint;
 	char *GifFileName, **FileName = NULL;
 	GifPixelType *Line;
 	GifRecordType RecordType;
@@ -51,7 +52,8 @@ int main(int argc, char **argv) {
 	if ((Error =
 	         GAGetArgs(argc, argv, CtrlStr, &GifNoisyPrint, &ColorMapFlag,
 	                   &EncodedFlag, &LZCodesFlag, &PixelFlag, &RawFlag,
-	                   &HelpFlag, &NumFiles, &FileName)) != false ||
+	                   &SummaryFlag, &HelpFlag, &NumFiles, &FileName)) !=
+	        false ||
 	    (NumFiles > 1 && !HelpFlag)) {
 		if (Error) {
 			GAPrintErrMsg(Error);
@@ -85,6 +87,27 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	/* Just the vital statistics, without decoding anything */
+	if (SummaryFlag) {
+		GifProbeInfo Info;
+
+		if (DGifProbe(GifFile, &Info) == GIF_ERROR) {
+			PrintGifError(GifFile->Error);
+			exit(EXIT_FAILURE);
+		}
+		printf("\n%s:\n\n\tScreen Size - Width = %d, Height = %d.\n",
+		       GifFileName, Info.SWidth, Info.SHeight);
+		printf("\tImages = %d, Loop Count = %d, Total Delay = %ld.\n",
+		       Info.ImageCount, Info.LoopCount, Info.TotalDelay);
+		printf("\t%s Transparency.\n",
+		       Info.HasTransparency ? "Has" : "No");
+		if (DGifCloseFile(GifFile, &ErrorCode) == GIF_ERROR) {
+			PrintGifError(ErrorCode);
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+
 	/* Because we write binary data - make sure no text will be written. */
 	if (RawFlag) {
 		ColorMapFlag = EncodedFlag = LZCodesFlag = PixelFlag = false;
@@ -113,6 +113,319 @@ struct operation {
 	};
 };
 
+/* apply an operation's effect on the screen descriptor, if any */
+static void apply_to_screen(GifFileType *GifFile, const struct operation *op) {
+	switch (op->mode) {
+	case aspect:
+		GifFile->AspectByte = op->numerator;
+		break;
+
+	case background:
+		GifFile->SBackGroundColor = op->color;
+		break;
+
+	case screensize:
+		GifFile->SWidth = op->p.x;
+		GifFile->SHeight = op->p.y;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* apply an operation's effect on one saved image, if any */
+static void apply_to_image(GifFileType *GifFile, int index,
+                           const struct operation *op) {
+	SavedImage *sp = &GifFile->SavedImages[index];
+	GraphicsControlBlock gcb;
+
+	switch (op->mode) {
+	case delaytime:
+	case transparent:
+	case userinput:
+	case disposal:
+		DGifSavedExtensionToGCB(GifFile, index, &gcb);
+		if (op->mode == delaytime) {
+			gcb.DelayTime = op->delay;
+		} else if (op->mode == transparent) {
+			gcb.TransparentColor = op->color;
+		} else if (op->mode == userinput) {
+			gcb.UserInputFlag = op->flag;
+		} else {
+			gcb.DisposalMode = op->dispose;
+		}
+		EGifGCBToSavedExtension(&gcb, GifFile, index);
+		break;
+
+	case interlace:
+		sp->ImageDesc.Interlace = op->flag;
+		break;
+
+	case position:
+		sp->ImageDesc.Left = op->p.x;
+		sp->ImageDesc.Top = op->p.y;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void stream_fail(int ErrorCode) {
+	PrintGifError(ErrorCode);
+	exit(EXIT_FAILURE);
+}
+
+/* read one extension record onto the blocks waiting for the next image */
+static void stream_extension(GifFileType *GifFileIn) {
+	GifByteType *ExtData;
+	int ExtFunction;
+
+	if (DGifGetExtension(GifFileIn, &ExtFunction, &ExtData) == GIF_ERROR) {
+		stream_fail(GifFileIn->Error);
+	}
+	while (ExtData != NULL) {
+		if (GifAddExtensionBlock(
+		        &GifFileIn->ExtensionBlockCount,
+		        &GifFileIn->ExtensionBlocks, ExtFunction, ExtData[0],
+		        &ExtData[1]) == GIF_ERROR) {
+			stream_fail(E_GIF_ERR_NOT_ENOUGH_MEM);
+		}
+		if (DGifGetExtensionNext(GifFileIn, &ExtData) == GIF_ERROR) {
+			stream_fail(GifFileIn->Error);
+		}
+		ExtFunction = CONTINUE_EXT_FUNC_CODE;
+	}
+}
+
+static void stream_put_extensions(GifFileType *GifFileOut,
+                                  const ExtensionBlock *blocks, int count) {
+	int j;
+
+	for (j = 0; j < count; j++) {
+		const ExtensionBlock *ep = &blocks[j];
+
+		if ((ep->Function != CONTINUE_EXT_FUNC_CODE &&
+		     EGifPutExtensionLeader(GifFileOut, ep->Function) ==
+		         GIF_ERROR) ||
+		    EGifPutExtensionBlock(GifFileOut, ep->ByteCount,
+		                          ep->Bytes) == GIF_ERROR ||
+		    ((j == count - 1 ||
+		      (ep + 1)->Function != CONTINUE_EXT_FUNC_CODE) &&
+		     EGifPutExtensionTrailer(GifFileOut) == GIF_ERROR)) {
+			stream_fail(GifFileOut->Error);
+		}
+	}
+}
+
+/*
+ * Copy the LZW data of the image just read unchanged.  It is gathered
+ * first, as EGifPutImageCode() wants it whole; that is the only buffer
+ * that grows, and only with the largest image.
+ */
+static void stream_copy_code(GifFileType *GifFileIn, GifFileType *GifFileOut,
+                             const GifImageDesc *desc, GifByteType **code,
+                             size_t *size) {
+	GifByteType *block;
+	size_t len = 1;
+	int codesize;
+
+	if (DGifGetCode(GifFileIn, &codesize, &block) == GIF_ERROR) {
+		stream_fail(GifFileIn->Error);
+	}
+	for (;;) {
+		size_t need = len + (block != NULL ? block[0] + 1 : 1);
+
+		if (need > *size) {
+			GifByteType *grown;
+
+			while (need > *size) {
+				*size = *size ? *size * 2 : 4096;
+			}
+			if ((grown = realloc(*code, *size)) == NULL) {
+				stream_fail(D_GIF_ERR_NOT_ENOUGH_MEM);
+			}
+			*code = grown;
+		}
+		if (block == NULL) {
+			(*code)[len++] = 0;
+			break;
+		}
+		memcpy(*code + len, block, block[0] + 1);
+		len += block[0] + 1;
+		if (DGifGetCodeNext(GifFileIn, &block) == GIF_ERROR) {
+			stream_fail(GifFileIn->Error);
+		}
+	}
+	(*code)[0] = (GifByteType)codesize;
+
+	if (EGifPutImageCode(GifFileOut, desc, *code, len) == GIF_ERROR) {
+		stream_fail(GifFileOut->Error);
+	}
+}
+
+/* read or write the rows of an image in the order they are stored in */
+static void stream_rows(GifFileType *GifFile, GifPixelType *raster,
+                        const GifImageDesc *desc, bool interlaced,
+                        bool writing) {
+	static const int offsets[] = {0, 4, 2, 1}, jumps[] = {8, 8, 4, 2};
+	int pass, row;
+
+	for (pass = 0; pass < (interlaced ? 4 : 1); pass++) {
+		for (row = interlaced ? offsets[pass] : 0; row < desc->Height;
+		     row += interlaced ? jumps[pass] : 1) {
+			GifPixelType *line =
+			    raster + (size_t)row * desc->Width;
+
+			if ((writing ? EGifPutLine(GifFile, line, desc->Width)
+			             : DGifGetLine(GifFile, line,
+			                           desc->Width)) == GIF_ERROR) {
+				stream_fail(GifFile->Error);
+			}
+		}
+	}
+}
+
+/*
+ * Decode the image just read and compress it again with the interlacing
+ * desc asks for, the other one from the input's.  That changes the order
+ * the rows are stored in, so the LZW data cannot be kept.
+ */
+static void stream_reinterlace(GifFileType *GifFileIn, GifFileType *GifFileOut,
+                               const GifImageDesc *desc,
+                               GifPixelType **raster, size_t *size) {
+	size_t need = (size_t)desc->Width * desc->Height;
+
+	if (need > *size) {
+		free(*raster);
+		if ((*raster = malloc(need)) == NULL) {
+			stream_fail(D_GIF_ERR_NOT_ENOUGH_MEM);
+		}
+		*size = need;
+	}
+
+	stream_rows(GifFileIn, *raster, desc, !desc->Interlace, false);
+	if (EGifPutImageDesc(GifFileOut, desc->Left, desc->Top, desc->Width,
+	                     desc->Height, desc->Interlace,
+	                     desc->ColorMap) == GIF_ERROR) {
+		stream_fail(GifFileOut->Error);
+	}
+	stream_rows(GifFileOut, *raster, desc, desc->Interlace, true);
+}
+
+/*
+ * Copy the GIF a record at a time, applying the operations to the screen
+ * descriptor and to each selected image on the way through.  Memory use
+ * does not grow with the number of images.  Images keep their LZW data
+ * unless their interlacing changes.  With nselected < 0, all images are
+ * selected.
+ */
+static void stream_gif(GifFileType *GifFileIn, GifFileType *GifFileOut,
+                       const struct operation *operations,
+                       const struct operation *top, const int selected[],
+                       int nselected) {
+	const struct operation *op;
+	GifRecordType RecordType;
+	GifByteType *code = NULL;
+	GifPixelType *raster = NULL;
+	size_t codesize = 0, rastersize = 0;
+	int i, n = 0;
+
+	for (op = operations; op < top; op++) {
+		apply_to_screen(GifFileIn, op);
+	}
+	/* extensions needing GIF89 may turn up anywhere, so always say so */
+	EGifSetGifVersion(GifFileOut, true);
+	GifFileOut->AspectByte = GifFileIn->AspectByte;
+	if (EGifPutScreenDesc(GifFileOut, GifFileIn->SWidth, GifFileIn->SHeight,
+	                      GifFileIn->SColorResolution,
+	                      GifFileIn->SBackGroundColor,
+	                      GifFileIn->SColorMap) == GIF_ERROR) {
+		stream_fail(GifFileOut->Error);
+	}
+
+	do {
+		if (DGifGetRecordType(GifFileIn, &RecordType) == GIF_ERROR) {
+			stream_fail(GifFileIn->Error);
+		}
+
+		switch (RecordType) {
+		case EXTENSION_RECORD_TYPE:
+			stream_extension(GifFileIn);
+			break;
+
+		case IMAGE_DESC_RECORD_TYPE: {
+			SavedImage *sp;
+			bool interlaced;
+
+			/* the image just read is always SavedImages[0] */
+			if (DGifGetImageDesc(GifFileIn) == GIF_ERROR) {
+				stream_fail(GifFileIn->Error);
+			}
+			sp = &GifFileIn->SavedImages[0];
+			sp->ExtensionBlocks = GifFileIn->ExtensionBlocks;
+			sp->ExtensionBlockCount =
+			    GifFileIn->ExtensionBlockCount;
+			GifFileIn->ExtensionBlocks = NULL;
+			GifFileIn->ExtensionBlockCount = 0;
+
+			interlaced = sp->ImageDesc.Interlace;
+			for (i = 0; i < nselected && selected[i] != n; i++) {
+				continue;
+			}
+			if (nselected < 0 || i < nselected) {
+				for (op = operations; op < top; op++) {
+					apply_to_image(GifFileIn, 0, op);
+				}
+			}
+
+			stream_put_extensions(GifFileOut, sp->ExtensionBlocks,
+			                      sp->ExtensionBlockCount);
+			if (sp->ImageDesc.Interlace == interlaced) {
+				stream_copy_code(GifFileIn, GifFileOut,
+				                 &sp->ImageDesc, &code,
+				                 &codesize);
+			} else {
+				stream_reinterlace(GifFileIn, GifFileOut,
+				                   &sp->ImageDesc, &raster,
+				                   &rastersize);
+			}
+
+			GifFreeSavedImages(GifFileIn);
+			GifFileIn->ImageCount = 0;
+			n++;
+			break;
+		}
+
+		default:
+			break;
+		}
+	} while (RecordType != TERMINATE_RECORD_TYPE);
+
+	/* extensions after the last image */
+	stream_put_extensions(GifFileOut, GifFileIn->ExtensionBlocks,
+	                      GifFileIn->ExtensionBlockCount);
+	GifFreeExtensions(&GifFileIn->ExtensionBlockCount,
+	                  &GifFileIn->ExtensionBlocks);
+	free(code);
+	free(raster);
+
+	if (n == 0) {
+		stream_fail(D_GIF_ERR_NO_IMAG_DSCR);
+	}
+	for (i = 0; i < nselected; i++) {
+		if (selected[i] >= n) {
+			(void)fprintf(stderr, "giftool: selection "
+			                      "index out of bounds.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (EGifCloseFile(GifFileOut, &i) == GIF_ERROR) {
+		stream_fail(i);
+	}
+}
+
 int main(int argc, char **argv) {
 	extern char *optarg; /* set by getopt */
 	extern int optind;   /* set by getopt */
@@ -130,7 +443,7 @@ int main(int argc, char **argv) {
 	 * getopt(3) here rather than Gershom's argument getter because
 	 * preserving the order of operations is important.
 	 */
-	while ((status = getopt(argc, argv, "a:b:d:f:i:n:p:s:u:x:")) != EOF) {
+	while ((status = getopt(argc, argv, "a:b:d:f:i:n:p:s:t:u:x:")) != EOF) {
 		if (top >= operations + MAX_OPERATIONS) {
 			(void)fprintf(stderr, "giftool: too many operations.");
 			exit(EXIT_FAILURE);
@@ -175,6 +488,7 @@ int main(int argc, char **argv) {
 					if (*cp == '\0') {
 						break;
 					} else if (*cp == ',') {
+						cp++;
 						continue;
 					}
 				}
@@ -183,7 +497,7 @@ int main(int argc, char **argv) {
 				              "giftool: bad selection.\n");
 				exit(EXIT_FAILURE);
 			}
-			break;
+			continue; /* a selection is not an operation */
 
 		case 'p':
 		case 's':
@@ -207,6 +521,11 @@ int main(int argc, char **argv) {
 			}
 			break;
 
+		case 't':
+			top->mode = transparent;
+			top->color = atoi(optarg);
+			break;
+
 		case 'u':
 			top->mode = userinput;
 			top->flag = getbool(optarg);
@@ -221,23 +540,52 @@ int main(int argc, char **argv) {
 			fprintf(stderr,
 			        "usage: giftool [-b color] [-d delay] [-iI] "
 			        "[-t color] -[uU] [-x disposal]\n");
-			break;
+			exit(EXIT_FAILURE);
 		}
 
 		++top;
 	}
 
+	/* selections are 1-origin on the command line */
+	for (i = 0; i < nselected; i++) {
+		if (selected[i] < 0) {
+			(void)fprintf(stderr, "giftool: selection "
+			                      "index out of bounds.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* read in a GIF */
 	if ((GifFileIn = DGifOpenFileHandle(0, &ErrorCode)) == NULL) {
 		PrintGifError(ErrorCode);
 		exit(EXIT_FAILURE);
 	}
-	if (DGifSlurp(GifFileIn) == GIF_ERROR) {
-		PrintGifError(GifFileIn->Error);
-		exit(EXIT_FAILURE);
+
+	/*
+	 * Every operation but -f acts on the screen or on one image at a
+	 * time, so without -f the GIF is edited as it streams through.
+	 */
+	for (op = operations; op < top; op++) {
+		if (op->mode == info) {
+			break;
+		}
 	}
-	if ((GifFileOut = EGifOpenFileHandle(1, &ErrorCode)) == NULL) {
-		PrintGifError(ErrorCode);
+	if (op == top) {
+		if ((GifFileOut = EGifOpenFileHandle(1, &ErrorCode)) == NULL) {
+			PrintGifError(ErrorCode);
+			exit(EXIT_FAILURE);
+		}
+		stream_gif(GifFileIn, GifFileOut, operations, top, selected,
+		           have_selection ? nselected : -1);
+		if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR) {
+			PrintGifError(ErrorCode);
+		}
+		return 0;
+	}
+
+	/* -f needs the whole GIF, but none of the images decoded */
+	if (DGifSlurpCompressed(GifFileIn) == GIF_ERROR) {
+		PrintGifError(GifFileIn->Error);
 		exit(EXIT_FAILURE);
 	}
 
@@ -249,8 +597,7 @@ int main(int argc, char **argv) {
 		}
 	} else {
 		for (i = 0; i < nselected; i++) {
-			if (selected[i] >= GifFileIn->ImageCount ||
-			    selected[i] < 0) {
+			if (selected[i] >= GifFileIn->ImageCount) {
 				(void)fprintf(stderr, "giftool: selection "
 				                      "index out of bounds.\n");
 				exit(EXIT_FAILURE);
@@ -258,25 +605,9 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	/* perform the operations we've gathered */
+	/* perform the operations we've gathered, up to the -f */
 	for (op = operations; op < top; op++) {
 		switch (op->mode) {
-		case background:
-			GifFileIn->SBackGroundColor = op->color;
-			break;
-
-		case delaytime:
-			for (i = 0; i < nselected; i++) {
-				GraphicsControlBlock gcb;
-
-				DGifSavedExtensionToGCB(GifFileIn, selected[i],
-				                        &gcb);
-				gcb.DelayTime = op->delay;
-				EGifGCBToSavedExtension(&gcb, GifFileIn,
-				                        selected[i]);
-			}
-			break;
-
 		case info:
 			for (i = 0; i < nselected; i++) {
 				SavedImage *ip =
@@ -559,91 +890,15 @@ int main(int argc, char **argv) {
 			exit(EXIT_SUCCESS);
 			break;
 
-		case interlace:
-			for (i = 0; i < nselected; i++) {
-				GifFileIn->SavedImages[selected[i]]
-				    .ImageDesc.Interlace = op->flag;
-			}
-			break;
-
-		case position:
-			for (i = 0; i < nselected; i++) {
-				GifFileIn->SavedImages[selected[i]]
-				    .ImageDesc.Left = op->p.x;
-				GifFileIn->SavedImages[selected[i]]
-				    .ImageDesc.Top = op->p.y;
-			}
-			break;
-
-		case screensize:
-			GifFileIn->SWidth = op->p.x;
-			GifFileIn->SHeight = op->p.y;
-			break;
-
-		case transparent:
-			for (i = 0; i < nselected; i++) {
-				GraphicsControlBlock gcb;
-
-				DGifSavedExtensionToGCB(GifFileIn, selected[i],
-				                        &gcb);
-				gcb.TransparentColor = op->color;
-				EGifGCBToSavedExtension(&gcb, GifFileIn,
-				                        selected[i]);
-			}
-			break;
-
-		case userinput:
-			for (i = 0; i < nselected; i++) {
-				GraphicsControlBlock gcb;
-
-				DGifSavedExtensionToGCB(GifFileIn, selected[i],
-				                        &gcb);
-				gcb.UserInputFlag = op->flag;
-				EGifGCBToSavedExtension(&gcb, GifFileIn,
-				                        selected[i]);
-			}
-			break;
-
-		case disposal:
+		default:
+			apply_to_screen(GifFileIn, op);
 			for (i = 0; i < nselected; i++) {
-				GraphicsControlBlock gcb;
-
-				DGifSavedExtensionToGCB(GifFileIn, selected[i],
-				                        &gcb);
-				gcb.DisposalMode = op->dispose;
-				EGifGCBToSavedExtension(&gcb, GifFileIn,
-				                        selected[i]);
+				apply_to_image(GifFileIn, selected[i], op);
 			}
 			break;
-
-		default:
-			(void)fprintf(stderr,
-			              "giftool: unknown operation mode\n");
-			exit(EXIT_FAILURE);
 		}
 	}
 
-	/* write out the results */
-	GifFileOut->SWidth = GifFileIn->SWidth;
-	GifFileOut->SHeight = GifFileIn->SHeight;
-	GifFileOut->SColorResolution = GifFileIn->SColorResolution;
-	GifFileOut->SBackGroundColor = GifFileIn->SBackGroundColor;
-	if (GifFileIn->SColorMap != NULL) {
-		GifFileOut->SColorMap =
-		    GifMakeMapObject(GifFileIn->SColorMap->ColorCount,
-		                     GifFileIn->SColorMap->Colors);
-	}
-
-	for (i = 0; i < GifFileIn->ImageCount; i++) {
-		(void)GifMakeSavedImage(GifFileOut, &GifFileIn->SavedImages[i]);
-	}
-
-	if (EGifSpew(GifFileOut) == GIF_ERROR) {
-		PrintGifError(GifFileOut->Error);
-	} else if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR) {
-		PrintGifError(ErrorCode);
-	}
-
 	return 0;
 }
 
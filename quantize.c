@@ -13,210 +13,2304 @@ SPDX-License-Identifier: MIT
 
 ******************************************************************************/
 
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "getarg.h"
 #include "gif_lib.h"
 #include "gif_lib_private.h"
 
-#define ABS(x) ((x) > 0 ? (x) : (-(x)))
+#define SQR(x) ((x) * (x))
+#define CLAMP(x) ((x) < 0 ? 0 : (x) > 255 ? 255 : (x))
+/* x / 16, rounded to nearest */
+#define ROUND16(x) ((x) >= 0 ? ((x) + 8) / 16 : -((8 - (x)) / 16))
 
-#define COLOR_ARRAY_SIZE 32768
-#define BITS_PER_PRIM_COLOR 5
-#define MAX_PRIM_COLOR 0x1f
+#define BITS_PER_PRIM_COLOR 5 /* default histogram precision */
+#define MAX_DENSE_BITS 6      /* finer histograms are hashed */
+#define HASH_EMPTY 0xffffffffU
+#define HASH_MIN_BITS 12
+#define PARALLEL_MIN_PIXELS (1 << 18) /* smaller images aren't worth it */
+#define PARALLEL_BLOCKS 8 /* row blocks if Threads is 0 */
+#define ALPHA_OPAQUE 128  /* alpha from which a pixel is opaque */
 
-static int SortRGBAxis;
+/* 8-bit level at the center of histogram level v */
+#define LEVEL(v, Bits) (((v) << (8 - (Bits))) + ((1 << (8 - (Bits))) >> 1))
+
+/* Color key of a pixel, with Bits bits kept per primary */
+#define COLOR_KEY(r, g, b, Bits)                                               \
+	((((uint32_t)(r) >> (8 - (Bits))) << (2 * (Bits))) |                   \
+	 (((uint32_t)(g) >> (8 - (Bits))) << (Bits)) |                          \
+	 ((uint32_t)(b) >> (8 - (Bits))))
+
+/* A pixel of the last video frame as one word, 0 if it is transparent */
+#define FRAME_WORD(r, g, b)                                                    \
+	(0xff000000U | (uint32_t)(r) << 16 | (uint32_t)(g) << 8 | (uint32_t)(b))
+#define FRAME_KEY(w, Bits)                                                     \
+	COLOR_KEY(((w) >> 16) & 0xff, ((w) >> 8) & 0xff, (w)&0xff, Bits)
+
+/*
+ * Pixel counts per color.  Up to MAX_DENSE_BITS the table is indexed by
+ * color key directly; above that the colors actually present are kept in
+ * an open-addressed hash, since a dense 24-bit table would be 64MB.
+ * Once the palette is built each count is replaced by its color's index.
+ */
+typedef struct HistogramType {
+	unsigned int Bits;    /* per primary */
+	unsigned int Size;    /* number of cells */
+	unsigned int Shift;   /* hash: 32 - log2(Size) */
+	unsigned int Used;    /* hash: cells holding a color */
+	uint32_t *Keys;       /* hash: color key per cell, or HASH_EMPTY */
+	unsigned int *Counts; /* pixels per cell */
+	unsigned long Total;  /* pixels counted */
+} HistogramType;
+
+/*
+ * The input image.  The bytes of pixel (x, y) are at offset y * Stride +
+ * x * Step from each channel pointer, so planar and interleaved input are
+ * read in place.  Alpha is NULL if the image has none.  A band of a
+ * bigger picture starts at row Top of it, which keeps dither patterns
+ * lined up from one band to the next.
+ */
+typedef struct ImageType {
+	const GifByteType *Red, *Green, *Blue, *Alpha;
+	unsigned int Width, Height;
+	unsigned int Top;
+	size_t Step, Stride;
+} ImageType;
 
 typedef struct QuantizedColorType {
 	GifByteType RGB[3];
 	GifByteType NewColorIndex;
-	long Count;
-	struct QuantizedColorType *Pnext;
+	unsigned int Cell;  /* where this color lives in the histogram */
+	unsigned int Count; /* pixels of this color */
+	uint32_t Key;       /* octree order, for GIF_QUANTIZE_OCTREE */
 } QuantizedColorType;
 
-typedef struct NewColorMapType {
-	GifByteType RGBMin[3], RGBWidth[3];
-	unsigned int
-	    NumEntries;      /* # of QuantizedColorType in linked list below */
-	unsigned long Count; /* Total number of pixels in all the entries */
-	QuantizedColorType *QuantizedColors;
-} NewColorMapType;
+typedef struct NewColorMapType {
+	GifByteType RGBMin[3], RGBWidth[3];
+	unsigned int NumEntries; /* # of QuantizedColorType in this box */
+	unsigned long Count;     /* Total number of pixels in all the entries */
+	unsigned int First;      /* Index of the box's first color in Colors */
+	double Error;            /* Squared error of the box, variance cut */
+} NewColorMapType;
+
+/*
+ * Inverse color map: which palette entries can be nearest to some color in
+ * each cell of a LookupBits-per-primary grid.  Cells are worked out the
+ * first time a pixel lands in them.  A cell with one candidate holds its
+ * index with LOOKUP_SINGLE set; otherwise it is an offset into Pool, where
+ * a count is followed by that many candidate indices.  0 means not yet
+ * worked out.
+ */
+#define LOOKUP_SINGLE 0x80000000U
+#define LOOKUP_DEFAULT_BITS 5
+
+typedef struct LookupType {
+	unsigned int Bits;
+	int ColorMapSize;
+	int Skip;                   /* entry never chosen, or -1 */
+	GifColorType ColorMap[256]; /* the palette the cells were made for */
+	uint32_t *Cells;
+	GifByteType *Pool;
+	size_t PoolUsed, PoolSize;
+} LookupType;
+
+/* Ordered dither thresholds, 0 to 63 */
+static const GifByteType BayerMatrix[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+
+/* Blue-noise thresholds, 0 to 255, made by void-and-cluster (Ulichney) */
+static const GifByteType BlueNoiseMatrix[16 * 16] = {
+    234,  50, 188,  19,  58, 171, 121,  47,
+    163,   3, 247, 104,  22, 132,  14,  65,
+    209,   8, 118,  97, 240, 205,  23, 228,
+    138,  64, 123, 170,  72, 224,  99, 149,
+     85, 139, 229, 165,  78, 146, 111,  84,
+    176, 216,  30, 231, 153, 201,  42, 180,
+     25,  62, 195,  29,  43, 185,   7, 249,
+     41, 100, 191,  48,  87,   5, 128, 243,
+    221, 152, 101, 253, 130, 220,  59, 200,
+    156,  12, 136, 112, 254, 174,  69, 109,
+     46, 189,   2,  73, 172,  90, 142, 116,
+     80, 237, 210,  61, 147,  33, 206, 160,
+     81, 124, 217, 113, 208,  15, 241,  27,
+    168,  45, 178,  20, 193,  96, 225,  18,
+    242, 164,  60,  35, 157,  53, 181,  68,
+    223, 105, 125,  83, 236, 131,  55, 141,
+    197,  10, 227, 134, 246,  95, 126, 198,
+    148,   1, 244, 161,  71,   9, 182, 106,
+     40,  93, 179,  75, 192,   6, 218,  36,
+     91,  57, 202,  34, 215, 155, 233,  74,
+    252, 120, 150,  24, 110,  63, 166, 119,
+    232, 183, 133, 103,  49, 117,  31, 167,
+     16, 212,  51, 238, 207, 137, 255,  21,
+     76, 151,  13, 250, 190,  88, 203, 135,
+    102, 184,  82, 169,  38,  89, 187,  52,
+    204,  98, 173,  67, 129,   4, 222,  56,
+    230, 144,   0, 127, 226,  11, 154, 114,
+    239,  39, 219,  28, 235, 145, 175,  77,
+    196,  37, 248,  70, 107, 199,  66, 177,
+     17, 143, 115, 159,  86,  44, 108,  26,
+    122,  92, 158, 214, 140,  32, 245,  94,
+    213,  79, 194,  54, 211, 186, 251, 162};
+
+/* Error diffusion kernels in sixteenths: {dx, dy, weight} */
+static const int FloydSteinbergKernel[][3] = {
+    {1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}, {0, 0, 0}};
+static const int SierraLiteKernel[][3] = {
+    {1, 0, 8}, {-1, 1, 4}, {0, 1, 4}, {0, 0, 0}};
+
+/* A node of the octree, as a run of Colors sorted in octree order */
+typedef struct OctreeNodeType {
+	unsigned int First, NumEntries;
+	unsigned int Children; /* distinct child nodes one level down */
+	unsigned long Count;
+	bool Merged;
+} OctreeNodeType;
+
+/* Where a streamed quantization has got to */
+#define STAGE_IDLE 0     /* no histogram being gathered */
+#define STAGE_SAMPLING 1 /* GifQuantizerSample() has been called */
+#define STAGE_MAPPING 2  /* GifQuantizerPalette() has chosen a palette */
+
+/* Everything one quantization run needs; nothing is shared between runs */
+typedef struct QuantizerPrivateType {
+	unsigned int Bits; /* histogram precision of the current run */
+	HistogramType Histogram;
+	HistogramType *Blocks; /* per row block, for parallel sampling */
+	int BlocksSize;        /* allocated entries of Blocks */
+	QuantizedColorType *Colors;  /* the distinct colors, grouped by box */
+	QuantizedColorType *Scratch; /* sort buffer as big as Colors */
+	unsigned int ColorsSize;     /* allocated entries of each */
+	NewColorMapType NewColorSubdiv[256];
+	LookupType Lookup;
+	LookupType *BlockLookups; /* per row block, for parallel remapping */
+	int BlockLookupsSize;
+	int *Carry;       /* two rows of diffused error */
+	size_t CarrySize; /* allocated entries of Carry */
+	/* Streaming state, see GifQuantizerSample() */
+	int Stage;
+	unsigned int Width;    /* of the bands */
+	unsigned long Offered; /* pixels sampled, transparent or not */
+	GifColorType ColorMap[256];
+	int ColorMapSize, TransparentIndex;
+	unsigned int NextRow; /* picture row of the next band mapped */
+	uint64_t SquaredError;
+	unsigned long Mapped; /* opaque pixels mapped so far */
+	/* Video state, see ReuseThreshold */
+	HistogramType Counted; /* the last frame's, never turned to indices */
+	uint32_t *LastFrame;   /* the last frame as FRAME_WORD()s */
+	GifByteType *LastOutput;  /* and what it was mapped to */
+	uint64_t *RowErrors;      /* squared error of each row of that */
+	GifByteType *RowChanged;  /* rows of the new frame that differ */
+	bool OutputKept;          /* LastOutput and RowErrors are good */
+	int LastDither;
+	unsigned int LastWidth, LastHeight;
+	unsigned long Moved; /* pixels that changed cell since the palette */
+	GifColorType LastColorMap[256];
+	int LastColorMapSize, LastTransparentIndex;
+	int LastRequested; /* size asked for, or -1 to choose afresh */
+} QuantizerPrivateType;
+
+/* One row block of a parallel remapping pass */
+typedef struct RemapJobType {
+	GifQuantizerType *Quantizer;
+	LookupType *Lookups; /* one per block */
+	uint64_t *Errors;    /* squared error of each block */
+	uint64_t *RowErrors; /* squared error of each row, or NULL */
+	int Blocks;
+	int TransparentIndex;
+	const ImageType *Image;
+	GifByteType *Output;
+} RemapJobType;
+
+/* One share of the frames of a parallel animation histogram pass */
+typedef struct FrameSampleJobType {
+	QuantizerPrivateType *Private;
+	int Blocks, FrameCount;
+	unsigned int Width, Height, Step;
+	const GifQuantizerFrameType *Frames;
+} FrameSampleJobType;
+
+/* One row block of a parallel histogram pass */
+typedef struct SampleJobType {
+	QuantizerPrivateType *Private;
+	int Blocks;
+	const ImageType *Image;
+} SampleJobType;
+
+static int SubdivColorMap(QuantizerPrivateType *Private,
+                          unsigned int ColorMapSize,
+                          unsigned int *NewColorMapSize);
+static void VarianceSubdivColorMap(QuantizerPrivateType *Private,
+                                   unsigned int ColorMapSize,
+                                   unsigned int *NewColorMapSize);
+static void MeanColor(const QuantizedColorType *Colors,
+                      unsigned int NumEntries, unsigned int Bits,
+                      GifColorType *Color);
+static int OctreeColorMap(QuantizerPrivateType *Private,
+                          unsigned int NumOfEntries, unsigned int ColorMapSize,
+                          unsigned int *NewColorMapSize,
+                          GifColorType *OutputColorMap);
+static void RefineColorMap(QuantizerPrivateType *Private,
+                           unsigned int NumOfEntries,
+                           unsigned int ColorMapSize,
+                           GifColorType *OutputColorMap, int Iterations);
+static int RemapRows(GifQuantizerType *Quantizer, const ImageType *Input,
+                     const GifColorType *ColorMap, int ColorMapSize,
+                     int TransparentIndex, GifByteType *OutputBuffer,
+                     uint64_t *SquaredError, unsigned long *Pixels,
+                     uint64_t *RowErrors);
+
+/******************************************************************************
+ Empty a histogram for Bits bits per primary, reusing its storage when
+ possible.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int HistogramReset(HistogramType *Histogram, unsigned int Bits) {
+	unsigned int Size;
+
+	if (Bits <= MAX_DENSE_BITS) {
+		Size = 1U << (3 * Bits);
+	} else if (Histogram->Keys != NULL && Histogram->Bits == Bits) {
+		Size = Histogram->Size; /* a table that grew once will again */
+	} else {
+		Size = 1U << HASH_MIN_BITS;
+	}
+	if (Histogram->Counts == NULL || Histogram->Size != Size ||
+	    (Bits > MAX_DENSE_BITS) != (Histogram->Keys != NULL)) {
+		free(Histogram->Keys);
+		free(Histogram->Counts);
+		Histogram->Keys = NULL;
+		Histogram->Counts =
+		    (unsigned int *)malloc(Size * sizeof(unsigned int));
+		if (Bits > MAX_DENSE_BITS) {
+			Histogram->Keys =
+			    (uint32_t *)malloc(Size * sizeof(uint32_t));
+		}
+		if (Histogram->Counts == NULL ||
+		    (Bits > MAX_DENSE_BITS && Histogram->Keys == NULL)) {
+			free(Histogram->Keys);
+			free(Histogram->Counts);
+			Histogram->Keys = NULL;
+			Histogram->Counts = NULL;
+			Histogram->Size = 0;
+			return GIF_ERROR;
+		}
+	}
+	Histogram->Bits = Bits;
+	Histogram->Size = Size;
+	Histogram->Used = 0;
+	Histogram->Total = 0;
+	for (Histogram->Shift = 32; Size > 1; Size >>= 1) {
+		Histogram->Shift--;
+	}
+	memset(Histogram->Counts, 0, Histogram->Size * sizeof(unsigned int));
+	if (Histogram->Keys != NULL) {
+		memset(Histogram->Keys, 0xff, Histogram->Size * sizeof(uint32_t));
+	}
+	return GIF_OK;
+}
+
+static void HistogramFree(HistogramType *Histogram) {
+	free(Histogram->Keys);
+	free(Histogram->Counts);
+	Histogram->Keys = NULL;
+	Histogram->Counts = NULL;
+	Histogram->Size = 0;
+}
+
+/******************************************************************************
+ Find the hash cell of Key: the one holding it, or the empty one where it
+ would go.
+******************************************************************************/
+static unsigned int HistogramProbe(const HistogramType *Histogram,
+                                   uint32_t Key) {
+	unsigned int Cell = (Key * 0x9e3779b1U) >> Histogram->Shift;
+
+	while (Histogram->Keys[Cell] != Key &&
+	       Histogram->Keys[Cell] != HASH_EMPTY) {
+		Cell = (Cell + 1) & (Histogram->Size - 1);
+	}
+	return Cell;
+}
+
+/******************************************************************************
+ Double a hash histogram.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int HistogramGrow(HistogramType *Histogram) {
+	HistogramType Old = *Histogram;
+	unsigned int i, Cell;
+
+	Histogram->Size = Old.Size * 2;
+	Histogram->Shift = Old.Shift - 1;
+	Histogram->Keys = (uint32_t *)malloc(Histogram->Size * sizeof(uint32_t));
+	Histogram->Counts = (unsigned int *)calloc(Histogram->Size,
+	                                           sizeof(unsigned int));
+	if (Histogram->Keys == NULL || Histogram->Counts == NULL) {
+		free(Histogram->Keys);
+		free(Histogram->Counts);
+		*Histogram = Old;
+		return GIF_ERROR;
+	}
+	memset(Histogram->Keys, 0xff, Histogram->Size * sizeof(uint32_t));
+	for (i = 0; i < Old.Size; i++) {
+		if (Old.Keys[i] != HASH_EMPTY) {
+			Cell = HistogramProbe(Histogram, Old.Keys[i]);
+			Histogram->Keys[Cell] = Old.Keys[i];
+			Histogram->Counts[Cell] = Old.Counts[i];
+		}
+	}
+	free(Old.Keys);
+	free(Old.Counts);
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Add Count pixels of color Key to a histogram.  Returns GIF_ERROR if out
+ of memory.
+******************************************************************************/
+static int HistogramAdd(HistogramType *Histogram, uint32_t Key,
+                        unsigned int Count) {
+	unsigned int Cell;
+
+	if (Histogram->Keys == NULL) {
+		Histogram->Counts[Key] += Count;
+		return GIF_OK;
+	}
+	Cell = HistogramProbe(Histogram, Key);
+	if (Histogram->Keys[Cell] == HASH_EMPTY) {
+		/* Keep the table at most half full so probes stay short */
+		if (2 * (Histogram->Used + 1) > Histogram->Size) {
+			if (HistogramGrow(Histogram) == GIF_ERROR) {
+				return GIF_ERROR;
+			}
+			Cell = HistogramProbe(Histogram, Key);
+		}
+		Histogram->Keys[Cell] = Key;
+		Histogram->Used++;
+	}
+	Histogram->Counts[Cell] += Count;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Where color Key lives in a histogram it was counted in.
+******************************************************************************/
+static unsigned int HistogramCell(const HistogramType *Histogram,
+                                  uint32_t Key) {
+	return Histogram->Keys == NULL ? Key : HistogramProbe(Histogram, Key);
+}
+
+/******************************************************************************
+ Count Count pixels, Step bytes apart, into a histogram, leaving out those
+ that Alpha (if not NULL) makes transparent.  Hash lookups are done once
+ per run of identical colors, which is most of the work on flat artwork.
+******************************************************************************/
+static int HistogramSample(HistogramType *Histogram, const GifByteType *Red,
+                           const GifByteType *Green, const GifByteType *Blue,
+                           const GifByteType *Alpha, size_t Step,
+                           unsigned long Count) {
+	unsigned long i, Counted = 0;
+	unsigned int Bits = Histogram->Bits, Run = 0;
+	uint32_t Key, RunKey = 0;
+	size_t k;
+
+	if (Histogram->Keys == NULL) {
+		unsigned int *Counts = Histogram->Counts;
+
+		if (Alpha == NULL) {
+			for (i = 0, k = 0; i < Count; i++, k += Step) {
+				Counts[COLOR_KEY(Red[k], Green[k], Blue[k],
+				                 Bits)]++;
+			}
+			Histogram->Total += Count;
+			return GIF_OK;
+		}
+		for (i = 0, k = 0; i < Count; i++, k += Step) {
+			if (Alpha[k] < ALPHA_OPAQUE) {
+				continue;
+			}
+			Counts[COLOR_KEY(Red[k], Green[k], Blue[k], Bits)]++;
+			Counted++;
+		}
+		Histogram->Total += Counted;
+		return GIF_OK;
+	}
+	for (i = 0, k = 0; i < Count; i++, k += Step) {
+		if (Alpha != NULL && Alpha[k] < ALPHA_OPAQUE) {
+			continue;
+		}
+		Counted++;
+		Key = COLOR_KEY(Red[k], Green[k], Blue[k], Bits);
+		if (Run > 0 && Key == RunKey) {
+			Run++;
+			continue;
+		}
+		if (Run > 0 && HistogramAdd(Histogram, RunKey, Run) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		RunKey = Key;
+		Run = 1;
+	}
+	Histogram->Total += Counted;
+	if (Run > 0) {
+		return HistogramAdd(Histogram, RunKey, Run);
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Count row Row of an image into a histogram.
+******************************************************************************/
+static int HistogramSampleRow(HistogramType *Histogram,
+                              const ImageType *Image, unsigned int Row) {
+	size_t Offset = Row * Image->Stride;
+
+	return HistogramSample(
+	    Histogram, Image->Red + Offset, Image->Green + Offset,
+	    Image->Blue + Offset,
+	    Image->Alpha != NULL ? Image->Alpha + Offset : NULL, Image->Step,
+	    Image->Width);
+}
+
+/******************************************************************************
+ Make Target a copy of Source.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int HistogramCopy(HistogramType *Target, const HistogramType *Source) {
+	uint32_t *Keys;
+	unsigned int *Counts;
+
+	if (Target->Counts == NULL || Target->Size != Source->Size ||
+	    (Target->Keys == NULL) != (Source->Keys == NULL)) {
+		HistogramFree(Target);
+		Target->Counts =
+		    (unsigned int *)malloc(Source->Size * sizeof(unsigned int));
+		if (Source->Keys != NULL) {
+			Target->Keys =
+			    (uint32_t *)malloc(Source->Size * sizeof(uint32_t));
+		}
+		if (Target->Counts == NULL ||
+		    (Source->Keys != NULL && Target->Keys == NULL)) {
+			HistogramFree(Target);
+			return GIF_ERROR;
+		}
+	}
+	Keys = Target->Keys;
+	Counts = Target->Counts;
+	*Target = *Source;
+	Target->Keys = Keys;
+	Target->Counts = Counts;
+	memcpy(Counts, Source->Counts, Source->Size * sizeof(unsigned int));
+	if (Keys != NULL) {
+		memcpy(Keys, Source->Keys, Source->Size * sizeof(uint32_t));
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Fold the counts of Source into Target.
+******************************************************************************/
+static int HistogramMerge(HistogramType *Target, const HistogramType *Source) {
+	unsigned int i;
+
+	Target->Total += Source->Total;
+	for (i = 0; i < Source->Size; i++) {
+		if (Source->Counts[i] > 0 &&
+		    HistogramAdd(Target,
+		                 Source->Keys == NULL ? i : Source->Keys[i],
+		                 Source->Counts[i]) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Make sure there is a histogram for each of Blocks parallel jobs.
+******************************************************************************/
+static int GrowBlocks(QuantizerPrivateType *Private, int Blocks) {
+	HistogramType *New;
+
+	if (Private->BlocksSize >= Blocks) {
+		return GIF_OK;
+	}
+	New = (HistogramType *)reallocarray(Private->Blocks, Blocks,
+	                                    sizeof(HistogramType));
+	if (New == NULL) {
+		return GIF_ERROR;
+	}
+	memset(New + Private->BlocksSize, 0,
+	       (Blocks - Private->BlocksSize) * sizeof(HistogramType));
+	Private->Blocks = New;
+	Private->BlocksSize = Blocks;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ GifParallelFor() job counting one block of rows into its own histogram.
+******************************************************************************/
+static int SampleBlock(void *Arg, int Block) {
+	SampleJobType *Job = (SampleJobType *)Arg;
+	QuantizerPrivateType *Private = Job->Private;
+	unsigned int Row, First, Last;
+
+	First = (unsigned long)Job->Image->Height * Block / Job->Blocks;
+	Last = (unsigned long)Job->Image->Height * (Block + 1) / Job->Blocks;
+	if (HistogramReset(&Private->Blocks[Block], Private->Bits) ==
+	    GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	for (Row = First; Row < Last; Row++) {
+		if (HistogramSampleRow(&Private->Blocks[Block], Job->Image,
+		                       Row) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Add the colors of an image to the histogram, on several threads if the
+ context asks for that and the image is big enough to pay for it.
+******************************************************************************/
+static int SampleColors(GifQuantizerType *Quantizer, const ImageType *Image) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	SampleJobType Job;
+	unsigned int Row;
+	int i, Blocks;
+
+	Blocks = Quantizer->Threads > 0 ? Quantizer->Threads : PARALLEL_BLOCKS;
+	if (Quantizer->Threads == 1 || Image->Height < (unsigned int)Blocks ||
+	    (unsigned long)Image->Width * Image->Height < PARALLEL_MIN_PIXELS) {
+		for (Row = 0; Row < Image->Height; Row++) {
+			if (HistogramSampleRow(&Private->Histogram, Image,
+			                       Row) == GIF_ERROR) {
+				return GIF_ERROR;
+			}
+		}
+		return GIF_OK;
+	}
+
+	if (GrowBlocks(Private, Blocks) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	Job.Private = Private;
+	Job.Blocks = Blocks;
+	Job.Image = Image;
+	if (GifParallelFor(Blocks, Quantizer->Threads, SampleBlock, &Job) ==
+	    GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	for (i = 0; i < Blocks; i++) {
+		if (HistogramMerge(&Private->Histogram, &Private->Blocks[i]) ==
+		    GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Count one row in Step of an animation frame into Histogram, starting from
+ a row that moves on with each frame so that every row gets a look in.
+******************************************************************************/
+static int SampleFrame(HistogramType *Histogram, unsigned int Width,
+                       unsigned int Height, unsigned int Step, int Frame,
+                       const GifQuantizerFrameType *Frames) {
+	unsigned int Row;
+	size_t Offset;
+
+	if (Step <= 1) {
+		return HistogramSample(Histogram, Frames[Frame].Red,
+		                       Frames[Frame].Green, Frames[Frame].Blue,
+		                       NULL, 1, (unsigned long)Width * Height);
+	}
+	for (Row = Frame % Step; Row < Height; Row += Step) {
+		Offset = (size_t)Row * Width;
+		if (HistogramSample(Histogram, Frames[Frame].Red + Offset,
+		                    Frames[Frame].Green + Offset,
+		                    Frames[Frame].Blue + Offset, NULL, 1,
+		                    Width) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ GifParallelFor() job counting every Blocks'th frame into its own histogram.
+******************************************************************************/
+static int SampleFrameBlock(void *Arg, int Block) {
+	FrameSampleJobType *Job = (FrameSampleJobType *)Arg;
+	QuantizerPrivateType *Private = Job->Private;
+	int Frame;
+
+	if (HistogramReset(&Private->Blocks[Block], Private->Bits) ==
+	    GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	for (Frame = Block; Frame < Job->FrameCount; Frame += Job->Blocks) {
+		if (SampleFrame(&Private->Blocks[Block], Job->Width,
+		                Job->Height, Job->Step, Frame,
+		                Job->Frames) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Build one histogram of all the frames of an animation, spreading the
+ frames over threads if the context asks for that.  *Sampled is set to
+ the number of pixels counted.
+******************************************************************************/
+static int SampleFrames(GifQuantizerType *Quantizer, unsigned int Width,
+                        unsigned int Height, int FrameCount,
+                        const GifQuantizerFrameType *Frames,
+                        unsigned long *Sampled) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	unsigned int Step = Quantizer->Subsample > 1 ? Quantizer->Subsample : 1;
+	FrameSampleJobType Job;
+	int i, Blocks;
+
+	*Sampled = 0;
+	for (i = 0; i < FrameCount; i++) {
+		unsigned int First = i % Step;
+
+		if (First < Height) {
+			*Sampled += (unsigned long)Width *
+			            ((Height - First + Step - 1) / Step);
+		}
+	}
+	if (HistogramReset(&Private->Histogram, Private->Bits) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	Blocks = Quantizer->Threads > 0 ? Quantizer->Threads : PARALLEL_BLOCKS;
+	if (Blocks > FrameCount) {
+		Blocks = FrameCount;
+	}
+	if (Quantizer->Threads == 1 || Blocks < 2 ||
+	    *Sampled < PARALLEL_MIN_PIXELS) {
+		for (i = 0; i < FrameCount; i++) {
+			if (SampleFrame(&Private->Histogram, Width, Height, Step,
+			                i, Frames) == GIF_ERROR) {
+				return GIF_ERROR;
+			}
+		}
+		return GIF_OK;
+	}
+
+	if (GrowBlocks(Private, Blocks) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	Job.Private = Private;
+	Job.Blocks = Blocks;
+	Job.FrameCount = FrameCount;
+	Job.Width = Width;
+	Job.Height = Height;
+	Job.Step = Step;
+	Job.Frames = Frames;
+	if (GifParallelFor(Blocks, Quantizer->Threads, SampleFrameBlock,
+	                   &Job) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	for (i = 0; i < Blocks; i++) {
+		if (HistogramMerge(&Private->Histogram, &Private->Blocks[i]) ==
+		    GIF_ERROR) {
+			return GIF_ERROR;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Point the inverse color map at ColorMap, keeping the cells already worked
+ out if the palette and resolution are the ones they were made for.
+ Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int LookupReset(LookupType *Lookup, const GifColorType *ColorMap,
+                       int ColorMapSize, int Skip, unsigned int Bits) {
+	size_t Cells = (size_t)1 << (3 * Bits);
+
+	if (Lookup->Cells != NULL && Lookup->Bits == Bits &&
+	    Lookup->ColorMapSize == ColorMapSize && Lookup->Skip == Skip &&
+	    memcmp(Lookup->ColorMap, ColorMap,
+	           ColorMapSize * sizeof(GifColorType)) == 0) {
+		return GIF_OK;
+	}
+	if (Lookup->Cells == NULL || Lookup->Bits != Bits) {
+		free(Lookup->Cells);
+		Lookup->Cells = (uint32_t *)malloc(Cells * sizeof(uint32_t));
+		if (Lookup->Cells == NULL) {
+			return GIF_ERROR;
+		}
+	}
+	memset(Lookup->Cells, 0, Cells * sizeof(uint32_t));
+	memcpy(Lookup->ColorMap, ColorMap, ColorMapSize * sizeof(GifColorType));
+	Lookup->Bits = Bits;
+	Lookup->ColorMapSize = ColorMapSize;
+	Lookup->Skip = Skip;
+	Lookup->PoolUsed = 1; /* so that no offset is 0 */
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Work out which palette entries may be nearest to some color in a cell.
+ An entry can be ruled out if even the nearest point of the cell is
+ farther from it than the farthest point of the cell is from some other
+ entry.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int LookupFill(LookupType *Lookup, uint32_t Cell) {
+	unsigned int Side = 1U << (8 - Lookup->Bits), Bits = Lookup->Bits;
+	int Low[3], High[3], Near[256], Bound = INT_MAX, i, j, Count = 0;
+	const GifColorType *ColorMap = Lookup->ColorMap;
+
+	Low[0] = (Cell >> (2 * Bits)) * Side;
+	Low[1] = ((Cell >> Bits) & ((1U << Bits) - 1)) * Side;
+	Low[2] = (Cell & ((1U << Bits) - 1)) * Side;
+	for (j = 0; j < 3; j++) {
+		High[j] = Low[j] + Side - 1;
+	}
+	for (i = 0; i < Lookup->ColorMapSize; i++) {
+		int Color[3], Far = 0;
+
+		if (i == Lookup->Skip) {
+			Near[i] = INT_MAX;
+			continue;
+		}
+		Color[0] = ColorMap[i].Red;
+		Color[1] = ColorMap[i].Green;
+		Color[2] = ColorMap[i].Blue;
+		Near[i] = 0;
+		for (j = 0; j < 3; j++) {
+			if (Color[j] < Low[j]) {
+				Near[i] += SQR(Low[j] - Color[j]);
+			} else if (Color[j] > High[j]) {
+				Near[i] += SQR(Color[j] - High[j]);
+			}
+			Far += Color[j] - Low[j] > High[j] - Color[j]
+			           ? SQR(Color[j] - Low[j])
+			           : SQR(High[j] - Color[j]);
+		}
+		if (Far < Bound) {
+			Bound = Far;
+		}
+	}
+	for (i = 0; i < Lookup->ColorMapSize; i++) {
+		Count += Near[i] <= Bound;
+	}
+	if (Count == 1) {
+		for (i = 0; Near[i] > Bound; i++) {
+			;
+		}
+		Lookup->Cells[Cell] = LOOKUP_SINGLE | i;
+		return GIF_OK;
+	}
+
+	if (Lookup->PoolUsed + Count + 1 > Lookup->PoolSize) {
+		size_t Size = Lookup->PoolSize > 0 ? Lookup->PoolSize : 4096;
+		GifByteType *Pool;
+
+		while (Lookup->PoolUsed + Count + 1 > Size) {
+			Size *= 2;
+		}
+		if (Size >= LOOKUP_SINGLE ||
+		    (Pool = (GifByteType *)realloc(Lookup->Pool, Size)) ==
+		        NULL) {
+			return GIF_ERROR;
+		}
+		Lookup->Pool = Pool;
+		Lookup->PoolSize = Size;
+	}
+	Lookup->Cells[Cell] = Lookup->PoolUsed;
+	/* A count of 0 stands for 256 */
+	Lookup->Pool[Lookup->PoolUsed++] = (GifByteType)Count;
+	for (i = 0; i < Lookup->ColorMapSize; i++) {
+		if (Near[i] <= Bound) {
+			Lookup->Pool[Lookup->PoolUsed++] = (GifByteType)i;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Index of the palette entry nearest to a color, the lowest such index on
+ a tie.  Returns -1 if out of memory.
+******************************************************************************/
+static int LookupColor(LookupType *Lookup, int Red, int Green, int Blue) {
+	const GifColorType *ColorMap = Lookup->ColorMap;
+	uint32_t Cell = COLOR_KEY(Red, Green, Blue, Lookup->Bits), Entry;
+	int Best = INT_MAX, Distance, Count, n, Index = 0;
+
+	if ((Entry = Lookup->Cells[Cell]) == 0) {
+		if (LookupFill(Lookup, Cell) == GIF_ERROR) {
+			return -1;
+		}
+		Entry = Lookup->Cells[Cell];
+	}
+	if (Entry & LOOKUP_SINGLE) {
+		return Entry & ~LOOKUP_SINGLE;
+	}
+	Count = Lookup->Pool[Entry] == 0 ? 256 : Lookup->Pool[Entry];
+	for (n = 1; n <= Count; n++) {
+		const GifColorType *Color = &ColorMap[Lookup->Pool[Entry + n]];
+
+		Distance = SQR(Color->Red - Red);
+		if (Distance >= Best) {
+			continue;
+		}
+		Distance += SQR(Color->Green - Green);
+		if (Distance >= Best) {
+			continue;
+		}
+		Distance += SQR(Color->Blue - Blue);
+		if (Distance < Best) {
+			Best = Distance;
+			Index = Lookup->Pool[Entry + n];
+		}
+	}
+	return Index;
+}
+
+/******************************************************************************
+ How far ordered dithering pushes the pixels: about the spacing of the
+ palette's colors if they were spread evenly through the color cube.
+******************************************************************************/
+static int DitherSpread(int ColorMapSize) {
+	return (int)(128 / cbrt((double)ColorMapSize));
+}
+
+/******************************************************************************
+ Map row Row of the image to the nearest palette entries, ordered
+ dithering it if asked to, and add the squared error to *SquaredError.
+ Transparent pixels get TransparentIndex.  Rows are independent of one
+ another.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int LookupRow(LookupType *Lookup, int Dither, const ImageType *Image,
+                     unsigned int Row, int TransparentIndex,
+                     GifByteType *Output, uint64_t *SquaredError) {
+	const GifColorType *ColorMap = Lookup->ColorMap;
+	const GifByteType *Red = Image->Red + Row * Image->Stride,
+	                  *Green = Image->Green + Row * Image->Stride,
+	                  *Blue = Image->Blue + Row * Image->Stride,
+	                  *Alpha = Image->Alpha;
+	int Spread = DitherSpread(Lookup->ColorMapSize), Index = 0, Offset;
+	unsigned int Phase = Row + Image->Top;
+	unsigned long i;
+	size_t k, Step = Image->Step;
+	uint64_t Error = 0, Last = 0;
+
+	if (Alpha != NULL) {
+		Alpha += Row * Image->Stride;
+	}
+	for (i = 0, k = 0; i < Image->Width; i++, k += Step) {
+		if (Alpha != NULL && Alpha[k] < ALPHA_OPAQUE) {
+			Output[i] = (GifByteType)TransparentIndex;
+			continue;
+		}
+		if (Dither == GIF_DITHER_BAYER) {
+			Offset = (2 * BayerMatrix[Phase & 7][i & 7] + 1 - 64) *
+			         Spread / 128;
+		} else if (Dither == GIF_DITHER_BLUE_NOISE) {
+			Offset =
+			    (2 * BlueNoiseMatrix[(Phase & 15) * 16 + (i & 15)] +
+			     1 - 256) *
+			    Spread / 512;
+		} else if (i > 0 && Red[k] == Red[k - Step] &&
+		           Green[k] == Green[k - Step] &&
+		           Blue[k] == Blue[k - Step] &&
+		           Output[i - 1] != TransparentIndex) {
+			/* Runs of one color are common and cost nothing */
+			Output[i] = Output[i - 1];
+			Error += Last;
+			continue;
+		} else {
+			Offset = 0;
+		}
+		if (Offset == 0) {
+			Index = LookupColor(Lookup, Red[k], Green[k], Blue[k]);
+		} else {
+			Index = LookupColor(
+			    Lookup, CLAMP(Red[k] + Offset),
+			    CLAMP(Green[k] + Offset), CLAMP(Blue[k] + Offset));
+		}
+		if (Index < 0) {
+			return GIF_ERROR;
+		}
+		Output[i] = (GifByteType)Index;
+		Last = SQR(ColorMap[Index].Red - Red[k]) +
+		       SQR(ColorMap[Index].Green - Green[k]) +
+		       SQR(ColorMap[Index].Blue - Blue[k]);
+		Error += Last;
+	}
+	*SquaredError += Error;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Map the image to the nearest palette entries with error diffusion.  Rows
+ go alternately left to right and right to left, and the error carried
+ forward lives in Carry, two rows of Width + 2 pixels.  It is cleared at
+ the top of the picture and otherwise picks up where the band above left
+ off.  Transparent pixels get TransparentIndex and neither take nor pass
+ on error.  The squared error of each row is also left in RowErrors if
+ that is not NULL.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int DiffuseRows(LookupType *Lookup, int Dither, const ImageType *Image,
+                       int TransparentIndex, int *Carry, GifByteType *Output,
+                       uint64_t *SquaredError, uint64_t *RowErrors) {
+	const GifColorType *ColorMap = Lookup->ColorMap;
+	const int(*Kernel)[3] = Dither == GIF_DITHER_SIERRA_LITE
+	                            ? SierraLiteKernel
+	                            : FloydSteinbergKernel;
+	unsigned int Width = Image->Width, Row;
+	size_t RowSize = ((size_t)Width + 2) * 3;
+	int *This, *Next, *Swap, Index, Step, Value[3], j, n;
+	long x, Start, End;
+	uint64_t Error = 0, RowError;
+
+	/* One column of slack at each end saves bounds checks */
+	This = Carry + (Image->Top % 2) * RowSize;
+	Next = Carry + (1 - Image->Top % 2) * RowSize;
+	if (Image->Top == 0) {
+		memset(This, 0, RowSize * sizeof(int));
+	}
+	for (Row = 0; Row < Image->Height; Row++) {
+		size_t Offset = Row * Image->Stride;
+		GifByteType *Out = Output + (size_t)Row * Width;
+
+		Step = (Row + Image->Top) % 2 == 0 ? 1 : -1;
+		Start = Step > 0 ? 0 : (long)Width - 1;
+		End = Step > 0 ? (long)Width : -1;
+		RowError = 0;
+		memset(Next, 0, RowSize * sizeof(int));
+		for (x = Start; x != End; x += Step) {
+			size_t k = Offset + x * Image->Step;
+			int *Here = This + (x + 1) * 3, Pixel[3];
+
+			if (Image->Alpha != NULL &&
+			    Image->Alpha[k] < ALPHA_OPAQUE) {
+				Out[x] = (GifByteType)TransparentIndex;
+				continue;
+			}
+			Pixel[0] = Image->Red[k];
+			Pixel[1] = Image->Green[k];
+			Pixel[2] = Image->Blue[k];
+			for (j = 0; j < 3; j++) {
+				Value[j] = CLAMP(Pixel[j] + ROUND16(Here[j]));
+			}
+			Index = LookupColor(Lookup, Value[0], Value[1], Value[2]);
+			if (Index < 0) {
+				return GIF_ERROR;
+			}
+			Out[x] = (GifByteType)Index;
+			Value[0] -= ColorMap[Index].Red;
+			Value[1] -= ColorMap[Index].Green;
+			Value[2] -= ColorMap[Index].Blue;
+			for (n = 0; Kernel[n][2] != 0; n++) {
+				int *Target = (Kernel[n][1] == 0 ? This : Next) +
+				              (x + 1 + Kernel[n][0] * Step) * 3;
+
+				for (j = 0; j < 3; j++) {
+					Target[j] += Value[j] * Kernel[n][2];
+				}
+			}
+			RowError += SQR(ColorMap[Index].Red - Pixel[0]) +
+			            SQR(ColorMap[Index].Green - Pixel[1]) +
+			            SQR(ColorMap[Index].Blue - Pixel[2]);
+		}
+		Error += RowError;
+		if (RowErrors != NULL) {
+			RowErrors[Row] = RowError;
+		}
+		Swap = This;
+		This = Next;
+		Next = Swap;
+	}
+	*SquaredError += Error;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ GifParallelFor() job remapping one block of rows with its own lookup.
+******************************************************************************/
+static int RemapBlock(void *Arg, int Block) {
+	RemapJobType *Job = (RemapJobType *)Arg;
+	unsigned int Row, First, Last;
+
+	First = (unsigned long)Job->Image->Height * Block / Job->Blocks;
+	Last = (unsigned long)Job->Image->Height * (Block + 1) / Job->Blocks;
+	Job->Errors[Block] = 0;
+	for (Row = First; Row < Last; Row++) {
+		uint64_t Error = 0;
+
+		if (LookupRow(&Job->Lookups[Block], Job->Quantizer->Dither,
+		              Job->Image, Row, Job->TransparentIndex,
+		              Job->Output + (size_t)Row * Job->Image->Width,
+		              &Error) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		Job->Errors[Block] += Error;
+		if (Job->RowErrors != NULL) {
+			Job->RowErrors[Row] = Error;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Pixels of the image that are not transparent.
+******************************************************************************/
+static unsigned long CountOpaque(const ImageType *Image) {
+	unsigned long Count = 0;
+	unsigned int Row, i;
+	size_t k;
+
+	if (Image->Alpha == NULL) {
+		return (unsigned long)Image->Width * Image->Height;
+	}
+	for (Row = 0; Row < Image->Height; Row++) {
+		k = Row * Image->Stride;
+		for (i = 0; i < Image->Width; i++, k += Image->Step) {
+			Count += Image->Alpha[k] >= ALPHA_OPAQUE;
+		}
+	}
+	return Count;
+}
+
+/******************************************************************************
+ View three planes of Width by Height bytes as an image.
+******************************************************************************/
+static void PlanarImage(ImageType *Image, unsigned int Width,
+                        unsigned int Height, const GifByteType *Red,
+                        const GifByteType *Green, const GifByteType *Blue) {
+	Image->Red = Red;
+	Image->Green = Green;
+	Image->Blue = Blue;
+	Image->Alpha = NULL;
+	Image->Width = Width;
+	Image->Height = Height;
+	Image->Top = 0;
+	Image->Step = 1;
+	Image->Stride = Width;
+}
+
+/******************************************************************************
+ View interleaved pixels in one of the GIF_PIXELS_* layouts as an image.
+ Returns GIF_ERROR if the layout or stride makes no sense.
+******************************************************************************/
+static int InterleavedImage(ImageType *Image, unsigned int Width,
+                            unsigned int Height, const GifByteType *Pixels,
+                            size_t Stride, int Format) {
+	switch (Format) {
+	case GIF_PIXELS_RGB:
+		Image->Red = Pixels;
+		Image->Blue = Pixels + 2;
+		Image->Alpha = NULL;
+		Image->Step = 3;
+		break;
+	case GIF_PIXELS_RGBA:
+		Image->Red = Pixels;
+		Image->Blue = Pixels + 2;
+		Image->Alpha = Pixels + 3;
+		Image->Step = 4;
+		break;
+	case GIF_PIXELS_BGRA:
+		Image->Red = Pixels + 2;
+		Image->Blue = Pixels;
+		Image->Alpha = Pixels + 3;
+		Image->Step = 4;
+		break;
+	default:
+		return GIF_ERROR;
+	}
+	Image->Green = Pixels + 1;
+	Image->Width = Width;
+	Image->Height = Height;
+	Image->Top = 0;
+	Image->Stride = Stride;
+	return Stride < Image->Step * Width && Height > 1 ? GIF_ERROR
+	                                                  : GIF_OK;
+}
+
+/******************************************************************************
+ Record the error of the image just mapped in the context.
+******************************************************************************/
+static void SetError(GifQuantizerType *Quantizer, uint64_t SquaredError,
+                     unsigned long Pixels) {
+	Quantizer->MeanSquaredError =
+	    Pixels > 0 ? (double)SquaredError / (3.0 * Pixels) : 0;
+	Quantizer->PeakSNR =
+	    Quantizer->MeanSquaredError > 0
+	        ? 10 * log10(255.0 * 255.0 / Quantizer->MeanSquaredError)
+	        : HUGE_VAL;
+
+#ifdef DEBUG
+	fprintf(stderr, "Quantization errors: MSE = %g, PSNR = %g dB.\n",
+	        Quantizer->MeanSquaredError, Quantizer->PeakSNR);
+#endif /* DEBUG */
+}
+
+/******************************************************************************
+ Choose a palette of at most ColorMapSize entries for the colors counted in
+ the context's histogram, Pixels pixels in all.  On return the colors are
+ grouped by palette entry, each knowing its new index.  Returns GIF_ERROR
+ if out of memory.
+******************************************************************************/
+static int BuildColorMap(GifQuantizerType *Quantizer, unsigned long Pixels,
+                         int ColorMapSize, GifColorType *OutputColorMap,
+                         unsigned int *NewSize, unsigned int *Entries) {
+	unsigned int Index, NumOfEntries, Bits, Cell;
+	unsigned int NewColorMapSize;
+	int i, j;
+	long Red, Green, Blue;
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	NewColorMapType *NewColorSubdiv = Private->NewColorSubdiv;
+	HistogramType *Histogram = &Private->Histogram;
+	QuantizedColorType *QuantizedColor;
+
+	Bits = Private->Bits;
+
+	/* Put all the colors in the first entry of the color map, and call the
+	 * recursive subdivision process.  */
+	for (i = 0; i < 256; i++) {
+		NewColorSubdiv[i].First = 0;
+		NewColorSubdiv[i].Count = NewColorSubdiv[i].NumEntries = 0;
+		for (j = 0; j < 3; j++) {
+			NewColorSubdiv[i].RGBMin[j] = 0;
+			NewColorSubdiv[i].RGBWidth[j] = 255;
+		}
+	}
+
+	/* Gather the non empty cells of the histogram into one array: */
+	NumOfEntries = 0;
+	for (Cell = 0; Cell < Histogram->Size; Cell++) {
+		NumOfEntries += Histogram->Counts[Cell] > 0;
+	}
+	if (NumOfEntries > Private->ColorsSize) {
+		free((char *)Private->Colors);
+		free((char *)Private->Scratch);
+		Private->Colors = (QuantizedColorType *)malloc(
+		    NumOfEntries * sizeof(QuantizedColorType));
+		Private->Scratch = (QuantizedColorType *)malloc(
+		    NumOfEntries * sizeof(QuantizedColorType));
+		if (Private->Colors == NULL || Private->Scratch == NULL) {
+			free((char *)Private->Colors);
+			free((char *)Private->Scratch);
+			Private->Colors = Private->Scratch = NULL;
+			Private->ColorsSize = 0;
+			return GIF_ERROR;
+		}
+		Private->ColorsSize = NumOfEntries;
+	}
+	QuantizedColor = Private->Colors;
+	for (Cell = 0; Cell < Histogram->Size; Cell++) {
+		uint32_t Key;
+
+		if (Histogram->Counts[Cell] == 0) {
+			continue;
+		}
+		Key = Histogram->Keys == NULL ? Cell : Histogram->Keys[Cell];
+		QuantizedColor->RGB[0] = Key >> (2 * Bits);
+		QuantizedColor->RGB[1] = (Key >> Bits) & ((1U << Bits) - 1);
+		QuantizedColor->RGB[2] = Key & ((1U << Bits) - 1);
+		QuantizedColor->Cell = Cell;
+		QuantizedColor->Count = Histogram->Counts[Cell];
+		QuantizedColor++;
+	}
+
+	NewColorSubdiv[0].NumEntries =
+	    NumOfEntries; /* Different sampled colors */
+	NewColorSubdiv[0].Count = Pixels; /* Pixels */
+	NewColorMapSize = 1;
+	switch (Quantizer->Method) {
+	case GIF_QUANTIZE_VARIANCE:
+		VarianceSubdivColorMap(Private, ColorMapSize, &NewColorMapSize);
+		for (i = 0; i < NewColorMapSize; i++) {
+			QuantizedColor = Private->Colors + NewColorSubdiv[i].First;
+			for (Index = 0; Index < NewColorSubdiv[i].NumEntries;
+			     Index++) {
+				QuantizedColor[Index].NewColorIndex = i;
+			}
+			MeanColor(QuantizedColor, NewColorSubdiv[i].NumEntries,
+			          Bits, &OutputColorMap[i]);
+		}
+		break;
+	case GIF_QUANTIZE_OCTREE:
+		if (OctreeColorMap(Private, NumOfEntries, ColorMapSize,
+		                   &NewColorMapSize,
+		                   OutputColorMap) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		break;
+	default:
+		if (SubdivColorMap(Private, ColorMapSize, &NewColorMapSize) !=
+		    GIF_OK) {
+			return GIF_ERROR;
+		}
+
+		/* Average the colors in each entry to be the color to be
+		 * used in the output color map, and plug it into the output
+		 * color map itself. */
+		for (i = 0; i < NewColorMapSize; i++) {
+			if ((j = NewColorSubdiv[i].NumEntries) > 0) {
+				QuantizedColor =
+				    Private->Colors + NewColorSubdiv[i].First;
+				Red = Green = Blue = 0;
+				for (Index = 0; Index < (unsigned int)j;
+				     Index++) {
+					QuantizedColor[Index].NewColorIndex = i;
+					Red += QuantizedColor[Index].RGB[0];
+					Green += QuantizedColor[Index].RGB[1];
+					Blue += QuantizedColor[Index].RGB[2];
+				}
+				OutputColorMap[i].Red =
+				    (Red << (8 - Bits)) / j;
+				OutputColorMap[i].Green =
+				    (Green << (8 - Bits)) / j;
+				OutputColorMap[i].Blue =
+				    (Blue << (8 - Bits)) / j;
+			}
+		}
+		break;
+	}
+	if (NumOfEntries > 0 && Quantizer->Refine > 0) {
+		RefineColorMap(Private, NumOfEntries, NewColorMapSize,
+		               OutputColorMap, Quantizer->Refine);
+	}
+	if (NewColorMapSize < ColorMapSize) {
+		/* And clear rest of color map: */
+		for (i = NewColorMapSize; i < ColorMapSize; i++) {
+			OutputColorMap[i].Red = OutputColorMap[i].Green =
+			    OutputColorMap[i].Blue = 0;
+		}
+	}
+
+	*NewSize = NewColorMapSize;
+	*Entries = NumOfEntries;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Allocate a quantizer context.  A context may be used by one thread at a
+ time; any number of contexts may be used concurrently.  Returns NULL if
+ out of memory.
+******************************************************************************/
+GifQuantizerType *GifMakeQuantizer(void) {
+	GifQuantizerType *Quantizer;
+	QuantizerPrivateType *Private;
+
+	Quantizer = (GifQuantizerType *)calloc(1, sizeof(GifQuantizerType));
+	if (Quantizer == NULL) {
+		return NULL;
+	}
+	Private = (QuantizerPrivateType *)calloc(1,
+	                                         sizeof(QuantizerPrivateType));
+	if (Private == NULL) {
+		free(Quantizer);
+		return NULL;
+	}
+	Quantizer->Private = (void *)Private;
+	Quantizer->Error = 0;
+	Quantizer->HistogramBits = BITS_PER_PRIM_COLOR;
+	Quantizer->Threads = 1;
+	Quantizer->LookupBits = LOOKUP_DEFAULT_BITS;
+	Quantizer->TransparentIndex = NO_TRANSPARENT_COLOR;
+	Private->LastRequested = -1;
+	return Quantizer;
+}
+
+/******************************************************************************
+ Release a quantizer context and its working storage.
+******************************************************************************/
+void GifFreeQuantizer(GifQuantizerType *Quantizer) {
+	QuantizerPrivateType *Private;
+
+	if (Quantizer == NULL) {
+		return;
+	}
+	Private = (QuantizerPrivateType *)Quantizer->Private;
+	if (Private != NULL) {
+		int i;
+
+		HistogramFree(&Private->Histogram);
+		for (i = 0; i < Private->BlocksSize; i++) {
+			HistogramFree(&Private->Blocks[i]);
+		}
+		free((char *)Private->Blocks);
+		free((char *)Private->Colors);
+		free((char *)Private->Scratch);
+		free((char *)Private->Lookup.Cells);
+		free((char *)Private->Lookup.Pool);
+		for (i = 0; i < Private->BlockLookupsSize; i++) {
+			free((char *)Private->BlockLookups[i].Cells);
+			free((char *)Private->BlockLookups[i].Pool);
+		}
+		free((char *)Private->BlockLookups);
+		free((char *)Private->Carry);
+		HistogramFree(&Private->Counted);
+		free((char *)Private->LastFrame);
+		free((char *)Private->LastOutput);
+		free((char *)Private->RowErrors);
+		free((char *)Private->RowChanged);
+		free((char *)Private);
+	}
+	free((char *)Quantizer);
+}
+
+/******************************************************************************
+ Quantize with a throwaway context.  Kept for existing callers; it is as
+ reentrant as GifQuantizerBuffer() but allocates its tables on every call.
+******************************************************************************/
+int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
+                      int *ColorMapSize, const GifByteType *RedInput,
+                      const GifByteType *GreenInput,
+                      const GifByteType *BlueInput, GifByteType *OutputBuffer,
+                      GifColorType *OutputColorMap) {
+	GifQuantizerType *Quantizer;
+	int Result;
+
+	if ((Quantizer = GifMakeQuantizer()) == NULL) {
+		return GIF_ERROR;
+	}
+	Result = GifQuantizerBuffer(Quantizer, Width, Height, ColorMapSize,
+	                            RedInput, GreenInput, BlueInput,
+	                            OutputBuffer, OutputColorMap);
+	GifFreeQuantizer(Quantizer);
+	return Result;
+}
+
+/******************************************************************************
+ Pick the histogram precision for a new run and empty the histogram.
+ Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int StartHistogram(GifQuantizerType *Quantizer) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	unsigned int Bits = Quantizer->HistogramBits;
+
+	if (Bits < 1 || Bits > 8) {
+		Bits = BITS_PER_PRIM_COLOR;
+	}
+	Private->Bits = Bits;
+	Private->Stage = STAGE_IDLE;
+	return HistogramReset(&Private->Histogram, Bits);
+}
+
+/******************************************************************************
+ Choose a palette of at most *ColorMapSize entries for the histogram of a
+ picture of Pixels pixels, and update *ColorMapSize.  If some pixels were
+ left out of the histogram as transparent the last entry is kept back for
+ them and its index put in *TransparentIndex.  From then on each histogram
+ cell holds its color's new index.  Returns GIF_ERROR, with the context's
+ Error set, on failure.
+******************************************************************************/
+static int ChoosePalette(GifQuantizerType *Quantizer, unsigned long Pixels,
+                         int *ColorMapSize, GifColorType *OutputColorMap,
+                         int *TransparentIndex) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	HistogramType *Histogram = &Private->Histogram;
+	unsigned int Index, NumOfEntries, NewColorMapSize, i;
+	int PaletteSize = *ColorMapSize;
+	bool Transparent = Histogram->Total < Pixels;
+
+	*TransparentIndex = NO_TRANSPARENT_COLOR;
+	if (Transparent && PaletteSize-- < 2) {
+		Quantizer->Error = E_GIF_ERR_NO_COLOR_MAP;
+		return GIF_ERROR;
+	}
+	if (BuildColorMap(Quantizer, Histogram->Total, PaletteSize,
+	                  OutputColorMap, &NewColorMapSize,
+	                  &NumOfEntries) == GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	if (Transparent) {
+		*TransparentIndex = NewColorMapSize++;
+		for (i = *TransparentIndex; i < (unsigned int)*ColorMapSize;
+		     i++) {
+			OutputColorMap[i].Red = OutputColorMap[i].Green =
+			    OutputColorMap[i].Blue = 0;
+		}
+	}
+	for (Index = 0; Index < NumOfEntries; Index++) {
+		Histogram->Counts[Private->Colors[Index].Cell] =
+		    Private->Colors[Index].NewColorIndex;
+	}
+	*ColorMapSize = NewColorMapSize;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Map an image to a palette just chosen from the histogram, through the
+ histogram or by nearest color as the context asks.  The squared error and
+ the number of opaque pixels are added to *SquaredError and *Pixels.
+ Returns GIF_ERROR, with the context's Error set, on failure.
+******************************************************************************/
+static int MapImage(GifQuantizerType *Quantizer, const ImageType *Input,
+                    const GifColorType *ColorMap, int ColorMapSize,
+                    int TransparentIndex, GifByteType *OutputBuffer,
+                    uint64_t *SquaredError, unsigned long *Pixels) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	HistogramType *Histogram = &Private->Histogram;
+	ImageType Image = *Input;
+	unsigned int Bits = Histogram->Bits, Index, Row, i;
+	uint64_t Error = 0;
+
+	if (Quantizer->Nearest || Quantizer->Dither != GIF_DITHER_NONE) {
+		return RemapRows(Quantizer, &Image, ColorMap, ColorMapSize,
+		                 TransparentIndex, OutputBuffer, SquaredError,
+		                 Pixels, NULL);
+	}
+	if (TransparentIndex < 0) {
+		Image.Alpha = NULL;
+	}
+	for (Row = 0; Row < Image.Height; Row++) {
+		size_t Offset = Row * Image.Stride, k, Step = Image.Step;
+		const GifByteType *Red = Image.Red + Offset,
+		                  *Green = Image.Green + Offset,
+		                  *Blue = Image.Blue + Offset;
+		GifByteType *Output = OutputBuffer + (size_t)Row * Image.Width;
+
+		for (i = 0, k = 0; i < Image.Width; i++, k += Step) {
+			if (Image.Alpha != NULL &&
+			    Image.Alpha[Offset + k] < ALPHA_OPAQUE) {
+				Output[i] = (GifByteType)TransparentIndex;
+				continue;
+			}
+			Index = Histogram->Counts[HistogramCell(
+			    Histogram,
+			    COLOR_KEY(Red[k], Green[k], Blue[k], Bits))];
+			Output[i] = Index;
+			Error += SQR(ColorMap[Index].Red - Red[k]) +
+			         SQR(ColorMap[Index].Green - Green[k]) +
+			         SQR(ColorMap[Index].Blue - Blue[k]);
+		}
+	}
+	*SquaredError += Error;
+	*Pixels += CountOpaque(&Image);
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Count a whole frame afresh into the kept histogram, and keep its pixels
+ to tell what the next frame changes.  Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int RecountFrame(GifQuantizerType *Quantizer, const ImageType *Image) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	size_t Pixels = (size_t)Image->Width * Image->Height, k;
+	unsigned int Row, i;
+	uint32_t *Last;
+
+	/* Until the histogram below is whole it does not match the pixels */
+	Private->LastWidth = Private->LastHeight = 0;
+	Private->OutputKept = false;
+	free((char *)Private->LastFrame);
+	free((char *)Private->LastOutput);
+	free((char *)Private->RowErrors);
+	free((char *)Private->RowChanged);
+	Private->LastFrame =
+	    (uint32_t *)reallocarray(NULL, Pixels, sizeof(uint32_t));
+	Private->LastOutput = (GifByteType *)malloc(Pixels);
+	Private->RowErrors =
+	    (uint64_t *)reallocarray(NULL, Image->Height, sizeof(uint64_t));
+	Private->RowChanged = (GifByteType *)malloc(Image->Height);
+	if (Private->LastFrame == NULL || Private->LastOutput == NULL ||
+	    Private->RowErrors == NULL || Private->RowChanged == NULL) {
+		return GIF_ERROR;
+	}
+	if (StartHistogram(Quantizer) == GIF_ERROR ||
+	    SampleColors(Quantizer, Image) == GIF_ERROR ||
+	    HistogramCopy(&Private->Counted, &Private->Histogram) ==
+	        GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	Last = Private->LastFrame;
+	for (Row = 0; Row < Image->Height; Row++) {
+		k = Row * Image->Stride;
+		for (i = 0; i < Image->Width; i++, k += Image->Step) {
+			*Last++ = Image->Alpha != NULL &&
+			                  Image->Alpha[k] < ALPHA_OPAQUE
+			              ? 0
+			              : FRAME_WORD(Image->Red[k],
+			                           Image->Green[k],
+			                           Image->Blue[k]);
+		}
+	}
+	memset(Private->RowChanged, 1, Image->Height);
+	Private->LastWidth = Image->Width;
+	Private->LastHeight = Image->Height;
+	Private->LastRequested = -1;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Bring the kept histogram up to date with the next frame, counting only
+ the pixels that differ from the last one, and note which rows have such
+ pixels.  Those that move to another cell, or become or stop being
+ transparent, are added to Private->Moved.  Returns GIF_ERROR if out of
+ memory.
+******************************************************************************/
+static int UpdateCounts(QuantizerPrivateType *Private,
+                        const ImageType *Image) {
+	HistogramType *Counted = &Private->Counted;
+	unsigned int Bits = Counted->Bits, Row, i;
+	uint32_t *Last = Private->LastFrame, Pixel, OldKey, NewKey;
+	size_t k;
+
+	for (Row = 0; Row < Image->Height; Row++) {
+		k = Row * Image->Stride;
+		Private->RowChanged[Row] = 0;
+		for (i = 0; i < Image->Width; i++, k += Image->Step, Last++) {
+			Pixel = Image->Alpha != NULL &&
+			                Image->Alpha[k] < ALPHA_OPAQUE
+			            ? 0
+			            : FRAME_WORD(Image->Red[k], Image->Green[k],
+			                         Image->Blue[k]);
+			if (Pixel == *Last) {
+				continue;
+			}
+			Private->RowChanged[Row] = 1;
+			OldKey = FRAME_KEY(*Last, Bits);
+			NewKey = FRAME_KEY(Pixel, Bits);
+			if (*Last != 0 && Pixel != 0 && OldKey == NewKey) {
+				*Last = Pixel;
+				continue;
+			}
+			if (*Last != 0) {
+				Counted->Counts[HistogramCell(Counted,
+				                              OldKey)]--;
+				Counted->Total--;
+			}
+			if (Pixel != 0) {
+				if (HistogramAdd(Counted, NewKey, 1) ==
+				    GIF_ERROR) {
+					return GIF_ERROR;
+				}
+				Counted->Total++;
+			}
+			*Last = Pixel;
+			Private->Moved++;
+		}
+	}
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize an image as the next frame of a video, as ReuseThreshold
+ describes.
+******************************************************************************/
+static int QuantizeNextFrame(GifQuantizerType *Quantizer,
+                             const ImageType *Image, int *ColorMapSize,
+                             GifByteType *OutputBuffer,
+                             GifColorType *OutputColorMap) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	unsigned long Pixels = (unsigned long)Image->Width * Image->Height,
+	              Mapped = 0;
+	unsigned int Bits = Quantizer->HistogramBits, Row, End;
+	int Requested = *ColorMapSize, TransparentIndex, i;
+	uint64_t SquaredError = 0;
+	bool Diffuse;
+
+	if (Bits < 1 || Bits > 8) {
+		Bits = BITS_PER_PRIM_COLOR;
+	}
+	Quantizer->TransparentIndex = NO_TRANSPARENT_COLOR;
+	Quantizer->PaletteReused = false;
+	Private->Stage = STAGE_IDLE;
+
+	/* Count only what changed if the last frame is comparable: */
+	if (Private->LastWidth == Image->Width &&
+	    Private->LastHeight == Image->Height &&
+	    Private->Counted.Bits == Bits && Pixels > 0) {
+		if (UpdateCounts(Private, Image) == GIF_ERROR) {
+			Private->LastWidth = Private->LastHeight = 0;
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+	} else if (RecountFrame(Quantizer, Image) == GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	/* Choose a new palette only if the colors have moved far enough: */
+	if (Requested != Private->LastRequested ||
+	    (Private->Counted.Total < Pixels) !=
+	        (Private->LastTransparentIndex >= 0) ||
+	    Private->Moved > Quantizer->ReuseThreshold * Pixels) {
+		Private->LastRequested = -1;
+		Private->Bits = Bits;
+		if (HistogramCopy(&Private->Histogram, &Private->Counted) ==
+		    GIF_ERROR) {
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		if (ChoosePalette(Quantizer, Pixels, ColorMapSize,
+		                  OutputColorMap,
+		                  &TransparentIndex) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		memcpy(Private->LastColorMap, OutputColorMap,
+		       *ColorMapSize * sizeof(GifColorType));
+		Private->LastColorMapSize = *ColorMapSize;
+		Private->LastTransparentIndex = TransparentIndex;
+		Private->LastRequested = Requested;
+		Private->Moved = 0;
+	} else {
+		memcpy(OutputColorMap, Private->LastColorMap,
+		       Private->LastColorMapSize * sizeof(GifColorType));
+		for (i = Private->LastColorMapSize; i < Requested; i++) {
+			OutputColorMap[i].Red = OutputColorMap[i].Green =
+			    OutputColorMap[i].Blue = 0;
+		}
+		*ColorMapSize = Private->LastColorMapSize;
+		TransparentIndex = Private->LastTransparentIndex;
+		Quantizer->PaletteReused = true;
+	}
+
+	/* Colors never counted may turn up, so map by search.  Rows that
+	 * have not changed map as they did before, unless the palette or
+	 * dither has changed or error diffusion could carry something new
+	 * into them: */
+	Diffuse = Quantizer->Dither == GIF_DITHER_FLOYD_STEINBERG ||
+	          Quantizer->Dither == GIF_DITHER_SIERRA_LITE;
+	if (!Quantizer->PaletteReused || !Private->OutputKept || Diffuse ||
+	    Quantizer->Dither != Private->LastDither) {
+		memset(Private->RowChanged, 1, Image->Height);
+	}
+	Private->OutputKept = false;
+	for (Row = 0; Row < Image->Height; Row = End) {
+		size_t Offset = (size_t)Row * Image->Width;
+		ImageType Band = *Image;
+
+		for (End = Row; End < Image->Height &&
+		                Private->RowChanged[End] ==
+		                    Private->RowChanged[Row];
+		     End++) {
+		}
+		if (!Private->RowChanged[Row]) {
+			memcpy(OutputBuffer + Offset,
+			       Private->LastOutput + Offset,
+			       (End - Row) * (size_t)Image->Width);
+			continue;
+		}
+		Band.Red += Row * Image->Stride;
+		Band.Green += Row * Image->Stride;
+		Band.Blue += Row * Image->Stride;
+		if (Band.Alpha != NULL) {
+			Band.Alpha += Row * Image->Stride;
+		}
+		Band.Height = End - Row;
+		Band.Top = Row;
+		if (RemapRows(Quantizer, &Band, OutputColorMap, *ColorMapSize,
+		              TransparentIndex, OutputBuffer + Offset,
+		              &SquaredError, &Mapped,
+		              Private->RowErrors + Row) == GIF_ERROR) {
+			return GIF_ERROR;
+		}
+		memcpy(Private->LastOutput + Offset, OutputBuffer + Offset,
+		       (End - Row) * (size_t)Image->Width);
+	}
+	Private->OutputKept = true;
+	Private->LastDither = Quantizer->Dither;
+
+	SquaredError = 0;
+	for (Row = 0; Row < Image->Height; Row++) {
+		SquaredError += Private->RowErrors[Row];
+	}
+	SetError(Quantizer, SquaredError,
+	         TransparentIndex >= 0 ? Private->Counted.Total : Pixels);
+	Quantizer->TransparentIndex = TransparentIndex;
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize an image, as GifQuantizerBuffer() describes.
+******************************************************************************/
+static int QuantizeImage(GifQuantizerType *Quantizer, const ImageType *Image,
+                         int *ColorMapSize, GifByteType *OutputBuffer,
+                         GifColorType *OutputColorMap) {
+	int TransparentIndex;
+	uint64_t SquaredError = 0;
+	unsigned long Pixels;
+
+	if (Quantizer->ReuseThreshold > 0) {
+		return QuantizeNextFrame(Quantizer, Image, ColorMapSize,
+		                         OutputBuffer, OutputColorMap);
+	}
+	Quantizer->TransparentIndex = NO_TRANSPARENT_COLOR;
+	Quantizer->PaletteReused = false;
+
+	/* Sample the colors and their distribution: */
+	if (StartHistogram(Quantizer) == GIF_ERROR ||
+	    SampleColors(Quantizer, Image) == GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	/* Choose the palette: */
+	Pixels = (unsigned long)Image->Width * Image->Height;
+	if (ChoosePalette(Quantizer, Pixels, ColorMapSize, OutputColorMap,
+	                  &TransparentIndex) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+
+	/* Finally scan the input buffer again and put the mapped index in the
+	 * output buffer, measuring how far each pixel moved.  */
+	Pixels = 0;
+	if (MapImage(Quantizer, Image, OutputColorMap, *ColorMapSize,
+	             TransparentIndex, OutputBuffer, &SquaredError,
+	             &Pixels) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	SetError(Quantizer, SquaredError, Pixels);
+	Quantizer->TransparentIndex = TransparentIndex;
+
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize high resolution image into lower one. Input image consists of a
+ 2D array for each of the RGB colors with size Width by Height. There is no
+ Color map for the input. Output is a quantized image with 2D array of
+ indexes into the output color map.
+   Note input image can be 24 bits at the most (8 for red/green/blue) and
+ the output has 256 colors at the most (256 entries in the color map.).
+ ColorMapSize specifies size of color map up to 256 and will be updated to
+ real size before returning.
+   Also non of the parameter are allocated by this routine.
+   All working state lives in the Quantizer context, so calls on different
+ contexts may run in parallel.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int GifQuantizerBuffer(GifQuantizerType *Quantizer, unsigned int Width,
+                       unsigned int Height, int *ColorMapSize,
+                       const GifByteType *RedInput,
+                       const GifByteType *GreenInput,
+                       const GifByteType *BlueInput, GifByteType *OutputBuffer,
+                       GifColorType *OutputColorMap) {
+	ImageType Image;
+
+	PlanarImage(&Image, Width, Height, RedInput, GreenInput, BlueInput);
+	return QuantizeImage(Quantizer, &Image, ColorMapSize, OutputBuffer,
+	                     OutputColorMap);
+}
+
+/******************************************************************************
+ The same as GifQuantizerBuffer() for interleaved pixels, Stride bytes from
+ one row to the next, laid out as Format says.  If any pixel's alpha is
+ below one half, the last entry of the palette is kept back for the
+ transparent pixels and its index left in the context's TransparentIndex.
+******************************************************************************/
+int GifQuantizePixels(GifQuantizerType *Quantizer, unsigned int Width,
+                      unsigned int Height, const GifByteType *Pixels,
+                      size_t Stride, int Format, int *ColorMapSize,
+                      GifByteType *OutputBuffer,
+                      GifColorType *OutputColorMap) {
+	ImageType Image;
+
+	if (InterleavedImage(&Image, Width, Height, Pixels, Stride, Format) ==
+	    GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_DATA_TOO_BIG;
+		return GIF_ERROR;
+	}
+	return QuantizeImage(Quantizer, &Image, ColorMapSize, OutputBuffer,
+	                     OutputColorMap);
+}
+
+/******************************************************************************
+ Map an image to the nearest colors of ColorMap, leaving out entry
+ TransparentIndex, which transparent pixels get instead.  If that is not
+ an entry of ColorMap alpha is ignored.  The squared error and the number
+ of opaque pixels are added to *SquaredError and *Pixels, and if RowErrors
+ is not NULL the squared error of each row is left in it.  Returns
+ GIF_ERROR, with the context's Error set, on failure.
+******************************************************************************/
+static int RemapRows(GifQuantizerType *Quantizer, const ImageType *Input,
+                     const GifColorType *ColorMap, int ColorMapSize,
+                     int TransparentIndex, GifByteType *OutputBuffer,
+                     uint64_t *SquaredError, unsigned long *Pixels,
+                     uint64_t *RowErrors) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	unsigned int Bits = Quantizer->LookupBits, i;
+	RemapJobType Job;
+	ImageType Image = *Input;
+	int Blocks, Block;
+
+	if (Bits < 1 || Bits > 8) {
+		Bits = LOOKUP_DEFAULT_BITS;
+	}
+	if (TransparentIndex < 0 || TransparentIndex >= ColorMapSize) {
+		TransparentIndex = NO_TRANSPARENT_COLOR;
+		Image.Alpha = NULL;
+	}
+	if (ColorMapSize < (TransparentIndex >= 0 ? 2 : 1) ||
+	    ColorMapSize > 256) {
+		Quantizer->Error = E_GIF_ERR_NO_COLOR_MAP;
+		return GIF_ERROR;
+	}
+	if (LookupReset(&Private->Lookup, ColorMap, ColorMapSize,
+	                TransparentIndex, Bits) == GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	/* Error diffusion carries from row to row so can only go serially */
+	if (Quantizer->Dither == GIF_DITHER_FLOYD_STEINBERG ||
+	    Quantizer->Dither == GIF_DITHER_SIERRA_LITE) {
+		size_t CarrySize = 2 * ((size_t)Image.Width + 2) * 3;
+
+		if (Private->CarrySize < CarrySize) {
+			int *New = (int *)reallocarray(Private->Carry,
+			                               CarrySize, sizeof(int));
+			if (New == NULL) {
+				Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+				return GIF_ERROR;
+			}
+			Private->Carry = New;
+			Private->CarrySize = CarrySize;
+		}
+		if (DiffuseRows(&Private->Lookup, Quantizer->Dither, &Image,
+		                TransparentIndex, Private->Carry, OutputBuffer,
+		                SquaredError, RowErrors) == GIF_ERROR) {
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		*Pixels += CountOpaque(&Image);
+		return GIF_OK;
+	}
+
+	Blocks = Quantizer->Threads > 0 ? Quantizer->Threads : PARALLEL_BLOCKS;
+	if (Quantizer->Threads == 1 || Image.Height < (unsigned int)Blocks ||
+	    (unsigned long)Image.Width * Image.Height < PARALLEL_MIN_PIXELS) {
+		for (i = 0; i < Image.Height; i++) {
+			uint64_t Error = 0;
 
-static int SubdivColorMap(NewColorMapType *NewColorSubdiv,
-                          unsigned int ColorMapSize,
-                          unsigned int *NewColorMapSize);
-static int SortCmpRtn(const void *Entry1, const void *Entry2);
+			if (LookupRow(&Private->Lookup, Quantizer->Dither,
+			              &Image, i, TransparentIndex,
+			              OutputBuffer + (size_t)i * Image.Width,
+			              &Error) == GIF_ERROR) {
+				Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+				return GIF_ERROR;
+			}
+			*SquaredError += Error;
+			if (RowErrors != NULL) {
+				RowErrors[i] = Error;
+			}
+		}
+		*Pixels += CountOpaque(&Image);
+		return GIF_OK;
+	}
+
+	/* Each block fills in its own copy of the table as it goes */
+	if (Private->BlockLookupsSize < Blocks) {
+		LookupType *New = (LookupType *)reallocarray(
+		    Private->BlockLookups, Blocks, sizeof(LookupType));
+		if (New == NULL) {
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+		memset(New + Private->BlockLookupsSize, 0,
+		       (Blocks - Private->BlockLookupsSize) *
+		           sizeof(LookupType));
+		Private->BlockLookups = New;
+		Private->BlockLookupsSize = Blocks;
+	}
+	Job.Errors = (uint64_t *)calloc(Blocks, sizeof(uint64_t));
+	if (Job.Errors == NULL) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	for (Block = 0; Block < Blocks; Block++) {
+		if (LookupReset(&Private->BlockLookups[Block], ColorMap,
+		                ColorMapSize, TransparentIndex,
+		                Bits) == GIF_ERROR) {
+			free(Job.Errors);
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
+		}
+	}
+	Job.Quantizer = Quantizer;
+	Job.Lookups = Private->BlockLookups;
+	Job.Blocks = Blocks;
+	Job.RowErrors = RowErrors;
+	Job.TransparentIndex = TransparentIndex;
+	Job.Image = &Image;
+	Job.Output = OutputBuffer;
+	if (GifParallelFor(Blocks, Quantizer->Threads, RemapBlock, &Job) ==
+	    GIF_ERROR) {
+		free(Job.Errors);
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	for (Block = 0; Block < Blocks; Block++) {
+		*SquaredError += Job.Errors[Block];
+	}
+	free(Job.Errors);
+	*Pixels += CountOpaque(&Image);
+	return GIF_OK;
+}
 
 /******************************************************************************
- Quantize high resolution image into lower one. Input image consists of a
- 2D array for each of the RGB colors with size Width by Height. There is no
- Color map for the input. Output is a quantized image with 2D array of
- indexes into the output color map.
-   Note input image can be 24 bits at the most (8 for red/green/blue) and
- the output has 256 colors at the most (256 entries in the color map.).
- ColorMapSize specifies size of color map up to 256 and will be updated to
- real size before returning.
-   Also non of the parameter are allocated by this routine.
+ Map a whole image with RemapRows() and record its error in the context.
+******************************************************************************/
+static int RemapImage(GifQuantizerType *Quantizer, const ImageType *Image,
+                      const GifColorType *ColorMap, int ColorMapSize,
+                      int TransparentIndex, GifByteType *OutputBuffer) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	uint64_t SquaredError = 0;
+	unsigned long Pixels = 0;
+
+	Private->Stage = STAGE_IDLE; /* the carry and lookup are not its own */
+	if (RemapRows(Quantizer, Image, ColorMap, ColorMapSize,
+	              TransparentIndex, OutputBuffer, &SquaredError, &Pixels,
+	              NULL) == GIF_ERROR) {
+		return GIF_ERROR;
+	}
+	SetError(Quantizer, SquaredError, Pixels);
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Map a truecolor image, given as three planes of Width by Height bytes, to
+ the nearest colors of an arbitrary ColorMap of ColorMapSize entries.
+ Which entries can be nearest to each region of color space is worked out
+ once per region and kept in the context for as long as the same palette
+ is used, so remapping a sequence of frames to a shared palette gets
+ faster as it goes.  The result is the same as an exhaustive search.
    This function returns GIF_OK if successful, GIF_ERROR otherwise.
 ******************************************************************************/
-int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
-                      int *ColorMapSize, const GifByteType *RedInput,
-                      const GifByteType *GreenInput,
-                      const GifByteType *BlueInput, GifByteType *OutputBuffer,
-                      GifColorType *OutputColorMap) {
+int GifRemapBuffer(GifQuantizerType *Quantizer, unsigned int Width,
+                   unsigned int Height, const GifByteType *RedInput,
+                   const GifByteType *GreenInput,
+                   const GifByteType *BlueInput, const GifColorType *ColorMap,
+                   int ColorMapSize, GifByteType *OutputBuffer) {
+	ImageType Image;
 
-	unsigned int Index, NumOfEntries;
-	int i, j, MaxRGBError[3];
-	unsigned int NewColorMapSize;
-	long Red, Green, Blue;
-	NewColorMapType NewColorSubdiv[256];
-	QuantizedColorType *ColorArrayEntries, *QuantizedColor;
+	PlanarImage(&Image, Width, Height, RedInput, GreenInput, BlueInput);
+	return RemapImage(Quantizer, &Image, ColorMap, ColorMapSize,
+	                  NO_TRANSPARENT_COLOR, OutputBuffer);
+}
+
+/******************************************************************************
+ The same as GifRemapBuffer() for interleaved pixels, Stride bytes from
+ one row to the next, laid out as Format says.  Pixels whose alpha is
+ below one half get TransparentIndex, and no opaque pixel does; if
+ TransparentIndex is not an entry of ColorMap alpha is ignored.
+******************************************************************************/
+int GifRemapPixels(GifQuantizerType *Quantizer, unsigned int Width,
+                   unsigned int Height, const GifByteType *Pixels,
+                   size_t Stride, int Format, const GifColorType *ColorMap,
+                   int ColorMapSize, int TransparentIndex,
+                   GifByteType *OutputBuffer) {
+	ImageType Image;
 
-	ColorArrayEntries = (QuantizedColorType *)malloc(
-	    sizeof(QuantizedColorType) * COLOR_ARRAY_SIZE);
-	if (ColorArrayEntries == NULL) {
+	if (InterleavedImage(&Image, Width, Height, Pixels, Stride, Format) ==
+	    GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_DATA_TOO_BIG;
 		return GIF_ERROR;
 	}
+	return RemapImage(Quantizer, &Image, ColorMap, ColorMapSize,
+	                  TransparentIndex, OutputBuffer);
+}
 
-	for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
-		ColorArrayEntries[i].RGB[0] = i >> (2 * BITS_PER_PRIM_COLOR);
-		ColorArrayEntries[i].RGB[1] =
-		    (i >> BITS_PER_PRIM_COLOR) & MAX_PRIM_COLOR;
-		ColorArrayEntries[i].RGB[2] = i & MAX_PRIM_COLOR;
-		ColorArrayEntries[i].Count = 0;
-	}
+/******************************************************************************
+ Streamed quantization, for pictures too big to hold in memory at once.
+ Feed the whole picture to GifQuantizerSample(), in bands of any number of
+ rows laid out as GifQuantizePixels() describes; GifQuantizerPalette() then
+ chooses the palette, and GifQuantizerMap() maps the picture, fed again
+ from the top.  The result is the same as GifQuantizePixels() on the whole
+ picture.  Every band must be Width pixels wide.  Any other quantization on
+ the context in between starts it over.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int GifQuantizerSample(GifQuantizerType *Quantizer, unsigned int Width,
+                       unsigned int Height, const GifByteType *Pixels,
+                       size_t Stride, int Format) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	ImageType Image;
 
-	/* Sample the colors and their distribution: */
-	for (i = 0; i < (int)(Width * Height); i++) {
-		Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR))
-		         << (2 * BITS_PER_PRIM_COLOR)) +
-		        ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR))
-		         << BITS_PER_PRIM_COLOR) +
-		        (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-		ColorArrayEntries[Index].Count++;
+	if (InterleavedImage(&Image, Width, Height, Pixels, Stride, Format) ==
+	        GIF_ERROR ||
+	    (Private->Stage == STAGE_SAMPLING && Width != Private->Width)) {
+		Quantizer->Error = E_GIF_ERR_DATA_TOO_BIG;
+		return GIF_ERROR;
 	}
-
-	/* Put all the colors in the first entry of the color map, and call the
-	 * recursive subdivision process.  */
-	for (i = 0; i < 256; i++) {
-		NewColorSubdiv[i].QuantizedColors = NULL;
-		NewColorSubdiv[i].Count = NewColorSubdiv[i].NumEntries = 0;
-		for (j = 0; j < 3; j++) {
-			NewColorSubdiv[i].RGBMin[j] = 0;
-			NewColorSubdiv[i].RGBWidth[j] = 255;
+	if (Private->Stage != STAGE_SAMPLING) {
+		if (StartHistogram(Quantizer) == GIF_ERROR) {
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			return GIF_ERROR;
 		}
+		Private->Stage = STAGE_SAMPLING;
+		Private->Width = Width;
+		Private->Offered = 0;
 	}
+	if (SampleColors(Quantizer, &Image) == GIF_ERROR) {
+		Private->Stage = STAGE_IDLE;
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+	Private->Offered += (unsigned long)Width * Height;
+	return GIF_OK;
+}
 
-	/* Find the non empty entries in the color table and chain them: */
-	for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
-		if (ColorArrayEntries[i].Count > 0) {
-			break;
-		}
+/******************************************************************************
+ Choose a palette of at most *ColorMapSize entries for the picture fed to
+ GifQuantizerSample(), as GifQuantizePixels() would, and get ready to map
+ it from the top.  The transparent entry, if any, is left in the
+ context's TransparentIndex.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int GifQuantizerPalette(GifQuantizerType *Quantizer, int *ColorMapSize,
+                        GifColorType *OutputColorMap) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	int TransparentIndex;
+
+	Quantizer->TransparentIndex = NO_TRANSPARENT_COLOR;
+	if (Private->Stage != STAGE_SAMPLING) {
+		Quantizer->Error = E_GIF_ERR_NO_COLOR_MAP;
+		return GIF_ERROR;
 	}
-	QuantizedColor = NewColorSubdiv[0].QuantizedColors =
-	    &ColorArrayEntries[i];
-	NumOfEntries = 1;
-	while (++i < COLOR_ARRAY_SIZE) {
-		if (ColorArrayEntries[i].Count > 0) {
-			QuantizedColor->Pnext = &ColorArrayEntries[i];
-			QuantizedColor = &ColorArrayEntries[i];
-			NumOfEntries++;
-		}
+	Private->Stage = STAGE_IDLE;
+	if (ChoosePalette(Quantizer, Private->Offered, ColorMapSize,
+	                  OutputColorMap, &TransparentIndex) == GIF_ERROR) {
+		return GIF_ERROR;
 	}
-	QuantizedColor->Pnext = NULL;
+	memcpy(Private->ColorMap, OutputColorMap,
+	       *ColorMapSize * sizeof(GifColorType));
+	Private->ColorMapSize = *ColorMapSize;
+	Private->TransparentIndex = TransparentIndex;
+	Private->NextRow = 0;
+	Private->SquaredError = 0;
+	Private->Mapped = 0;
+	Private->Stage = STAGE_MAPPING;
+	Quantizer->TransparentIndex = TransparentIndex;
+	return GIF_OK;
+}
 
-	NewColorSubdiv[0].NumEntries =
-	    NumOfEntries; /* Different sampled colors */
-	NewColorSubdiv[0].Count = ((long)Width) * Height; /* Pixels */
-	NewColorMapSize = 1;
-	if (SubdivColorMap(NewColorSubdiv, *ColorMapSize, &NewColorMapSize) !=
-	    GIF_OK) {
-		free((char *)ColorArrayEntries);
+/******************************************************************************
+ Map the next band of the picture to the palette GifQuantizerPalette()
+ chose.  Error diffusion and dither patterns carry on from the band above,
+ and the context's error members cover the picture so far.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int GifQuantizerMap(GifQuantizerType *Quantizer, unsigned int Width,
+                    unsigned int Height, const GifByteType *Pixels,
+                    size_t Stride, int Format, GifByteType *OutputBuffer) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	ImageType Image;
+
+	if (Private->Stage != STAGE_MAPPING) {
+		Quantizer->Error = E_GIF_ERR_NO_COLOR_MAP;
 		return GIF_ERROR;
 	}
-	if (NewColorMapSize < *ColorMapSize) {
-		/* And clear rest of color map: */
-		for (i = NewColorMapSize; i < *ColorMapSize; i++) {
-			OutputColorMap[i].Red = OutputColorMap[i].Green =
-			    OutputColorMap[i].Blue = 0;
-		}
+	if (InterleavedImage(&Image, Width, Height, Pixels, Stride, Format) ==
+	        GIF_ERROR ||
+	    Width != Private->Width) {
+		Quantizer->Error = E_GIF_ERR_DATA_TOO_BIG;
+		return GIF_ERROR;
+	}
+	Image.Top = Private->NextRow;
+	if (MapImage(Quantizer, &Image, Private->ColorMap,
+	             Private->ColorMapSize, Private->TransparentIndex,
+	             OutputBuffer, &Private->SquaredError,
+	             &Private->Mapped) == GIF_ERROR) {
+		return GIF_ERROR;
 	}
+	Private->NextRow += Height;
+	SetError(Quantizer, Private->SquaredError, Private->Mapped);
+	return GIF_OK;
+}
 
-	/* Average the colors in each entry to be the color to be used in the
-	 * output color map, and plug it into the output color map itself. */
-	for (i = 0; i < NewColorMapSize; i++) {
-		if ((j = NewColorSubdiv[i].NumEntries) > 0) {
-			QuantizedColor = NewColorSubdiv[i].QuantizedColors;
-			Red = Green = Blue = 0;
-			while (QuantizedColor) {
-				QuantizedColor->NewColorIndex = i;
-				Red += QuantizedColor->RGB[0];
-				Green += QuantizedColor->RGB[1];
-				Blue += QuantizedColor->RGB[2];
-				QuantizedColor = QuantizedColor->Pnext;
-			}
-			OutputColorMap[i].Red =
-			    (Red << (8 - BITS_PER_PRIM_COLOR)) / j;
-			OutputColorMap[i].Green =
-			    (Green << (8 - BITS_PER_PRIM_COLOR)) / j;
-			OutputColorMap[i].Blue =
-			    (Blue << (8 - BITS_PER_PRIM_COLOR)) / j;
-		}
+/******************************************************************************
+ Undo the fallbacks of the first Count frames after a failure.
+******************************************************************************/
+static void FreeLocalColorMaps(GifQuantizerFrameType *Frames, int Count) {
+	int i;
+
+	for (i = 0; i < Count; i++) {
+		GifFreeMapObject(Frames[i].LocalColorMap);
+		Frames[i].LocalColorMap = NULL;
 	}
+}
 
-	/* Finally scan the input buffer again and put the mapped index in the
-	 * output buffer.  */
-	MaxRGBError[0] = MaxRGBError[1] = MaxRGBError[2] = 0;
-	for (i = 0; i < (int)(Width * Height); i++) {
-		Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR))
-		         << (2 * BITS_PER_PRIM_COLOR)) +
-		        ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR))
-		         << BITS_PER_PRIM_COLOR) +
-		        (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-		Index = ColorArrayEntries[Index].NewColorIndex;
-		OutputBuffer[i] = Index;
-		if (MaxRGBError[0] <
-		    ABS(OutputColorMap[Index].Red - RedInput[i])) {
-			MaxRGBError[0] =
-			    ABS(OutputColorMap[Index].Red - RedInput[i]);
-		}
-		if (MaxRGBError[1] <
-		    ABS(OutputColorMap[Index].Green - GreenInput[i])) {
-			MaxRGBError[1] =
-			    ABS(OutputColorMap[Index].Green - GreenInput[i]);
-		}
-		if (MaxRGBError[2] <
-		    ABS(OutputColorMap[Index].Blue - BlueInput[i])) {
-			MaxRGBError[2] =
-			    ABS(OutputColorMap[Index].Blue - BlueInput[i]);
+/******************************************************************************
+ Quantize the FrameCount frames of an animation, each Width by Height, to
+ one palette of at most *ColorMapSize entries, which is updated to the
+ size actually used.  The histogram is taken over all the frames (one row
+ in Subsample of each if the context says so), then every frame is mapped
+ to its nearest colors in the shared palette, so a color keeps its index
+ from frame to frame.  If the context's FallbackError is positive, any
+ frame whose mean squared error exceeds it is quantized on its own as
+ well, and given the result as its LocalColorMap if that is better.
+   Returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int GifQuantizeFrames(GifQuantizerType *Quantizer, unsigned int Width,
+                      unsigned int Height, int FrameCount,
+                      GifQuantizerFrameType *Frames, int *ColorMapSize,
+                      GifColorType *OutputColorMap) {
+	QuantizerPrivateType *Private =
+	    (QuantizerPrivateType *)Quantizer->Private;
+	unsigned int NumOfEntries, NewColorMapSize, Bits;
+	unsigned long Sampled, Pixels = (unsigned long)Width * Height;
+	GifByteType *Scratch = NULL;
+	double SquaredError = 0;
+	int i, LocalSize;
+
+	for (i = 0; i < FrameCount; i++) {
+		Frames[i].LocalColorMap = NULL;
+	}
+	Quantizer->TransparentIndex = NO_TRANSPARENT_COLOR;
+	Bits = Quantizer->HistogramBits;
+	if (Bits < 1 || Bits > 8) {
+		Bits = BITS_PER_PRIM_COLOR;
+	}
+	Private->Bits = Bits;
+	Private->Stage = STAGE_IDLE;
+
+	/* One histogram and one palette for the lot: */
+	if (SampleFrames(Quantizer, Width, Height, FrameCount, Frames,
+	                 &Sampled) == GIF_ERROR ||
+	    BuildColorMap(Quantizer, Sampled, *ColorMapSize, OutputColorMap,
+	                  &NewColorMapSize, &NumOfEntries) == GIF_ERROR) {
+		Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	}
+
+	/* Subsampling may have missed some colors, so always map by search */
+	for (i = 0; i < FrameCount; i++) {
+		if (GifRemapBuffer(Quantizer, Width, Height, Frames[i].Red,
+		                   Frames[i].Green, Frames[i].Blue,
+		                   OutputColorMap, NewColorMapSize,
+		                   Frames[i].Output) == GIF_ERROR) {
+			return GIF_ERROR;
 		}
+		Frames[i].MeanSquaredError = Quantizer->MeanSquaredError;
 	}
 
-#ifdef DEBUG
-	fprintf(stderr,
-	        "Quantization L(0) errors: Red = %d, Green = %d, Blue = %d.\n",
-	        MaxRGBError[0], MaxRGBError[1], MaxRGBError[2]);
-#endif /* DEBUG */
+	/* Only now, since each of these replaces the shared palette's tables */
+	for (i = 0; i < FrameCount; i++) {
+		ColorMapObject *LocalColorMap;
+		double SharedError = Frames[i].MeanSquaredError;
 
-	free((char *)ColorArrayEntries);
+		if (Quantizer->FallbackError <= 0 ||
+		    SharedError <= Quantizer->FallbackError) {
+			SquaredError += SharedError;
+			continue;
+		}
+		LocalSize = *ColorMapSize;
+		if ((Scratch == NULL &&
+		     (Scratch = (GifByteType *)malloc(Pixels)) == NULL) ||
+		    (LocalColorMap = GifMakeMapObject(
+		         1 << GifBitSize(LocalSize), NULL)) == NULL) {
+			Quantizer->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+			FreeLocalColorMaps(Frames, i);
+			free(Scratch);
+			return GIF_ERROR;
+		}
+		if (GifQuantizerBuffer(Quantizer, Width, Height, &LocalSize,
+		                       Frames[i].Red, Frames[i].Green,
+		                       Frames[i].Blue, Scratch,
+		                       LocalColorMap->Colors) == GIF_ERROR) {
+			GifFreeMapObject(LocalColorMap);
+			FreeLocalColorMaps(Frames, i);
+			free(Scratch);
+			return GIF_ERROR;
+		}
+		if (Quantizer->MeanSquaredError < SharedError) {
+			memcpy(Frames[i].Output, Scratch, Pixels);
+			Frames[i].LocalColorMap = LocalColorMap;
+			Frames[i].MeanSquaredError =
+			    Quantizer->MeanSquaredError;
+		} else {
+			GifFreeMapObject(LocalColorMap);
+		}
+		SquaredError += Frames[i].MeanSquaredError;
+	}
+	free(Scratch);
 
+	/* The frames are all the same size, so their errors simply average */
+	SetError(Quantizer,
+	         (uint64_t)(SquaredError * 3 * Pixels + 0.5),
+	         Pixels * (FrameCount > 0 ? FrameCount : 1));
 	*ColorMapSize = NewColorMapSize;
-
 	return GIF_OK;
 }
 
+/******************************************************************************
+ Sort Count colors on axis Axis, ties broken by the next two axes in turn.
+ This is three stable counting sorts, least significant axis first, using
+ Scratch as the other buffer; passes where every color has the same level
+ are skipped.  As no two colors are equal the order is fully determined.
+******************************************************************************/
+static void SortColors(QuantizedColorType *Colors,
+                       QuantizedColorType *Scratch, unsigned int Count,
+                       int Axis, unsigned int Bits) {
+	unsigned int Offsets[256], Levels = 1U << Bits, Sum, Level, i;
+	QuantizedColorType *From = Colors, *To = Scratch, *Swap;
+	int Pass, Primary;
+
+	for (Pass = 2; Pass >= 0; Pass--) {
+		Primary = (Axis + Pass) % 3;
+		memset(Offsets, 0, Levels * sizeof(unsigned int));
+		for (i = 0; i < Count; i++) {
+			Offsets[From[i].RGB[Primary]]++;
+		}
+		if (Offsets[From[0].RGB[Primary]] == Count) {
+			continue;
+		}
+		for (Sum = 0, Level = 0; Level < Levels; Level++) {
+			i = Offsets[Level];
+			Offsets[Level] = Sum;
+			Sum += i;
+		}
+		for (i = 0; i < Count; i++) {
+			To[Offsets[From[i].RGB[Primary]]++] = From[i];
+		}
+		Swap = From;
+		From = To;
+		To = Swap;
+	}
+	if (From != Colors) {
+		memcpy(Colors, From, Count * sizeof(QuantizedColorType));
+	}
+}
+
 /******************************************************************************
  Routine to subdivide the RGB space recursively using median cut in each
  axes alternatingly until ColorMapSize different cubes exists.
  The biggest cube in one dimension is subdivide unless it has only one entry.
+ Each cube's colors are a contiguous run of Private->Colors, so a split
+ is a sort of that run and no allocation is needed.
  Returns GIF_ERROR if failed, otherwise GIF_OK.
 *******************************************************************************/
-static int SubdivColorMap(NewColorMapType *NewColorSubdiv,
+static int SubdivColorMap(QuantizerPrivateType *Private,
                           unsigned int ColorMapSize,
                           unsigned int *NewColorMapSize) {
 
 	unsigned int i, j, Index = 0;
-	QuantizedColorType *QuantizedColor, **SortArray;
+	int SortRGBAxis = 0;
+	NewColorMapType *NewColorSubdiv = Private->NewColorSubdiv;
+	QuantizedColorType *QuantizedColor;
 
 	while (ColorMapSize > *NewColorMapSize) {
 		/* Find candidate for subdivision: */
@@ -242,73 +2336,40 @@ static int SubdivColorMap(NewColorMapType *NewColorSubdiv,
 		/* Split the entry Index into two along the axis SortRGBAxis: */
 
 		/* Sort all elements in that entry along the given axis and
-		 * split at the median.  */
-		SortArray = (QuantizedColorType **)malloc(
-		    sizeof(QuantizedColorType *) *
-		    NewColorSubdiv[Index].NumEntries);
-		if (SortArray == NULL) {
-			return GIF_ERROR;
-		}
-		for (j = 0,
-		    QuantizedColor = NewColorSubdiv[Index].QuantizedColors;
-		     j < NewColorSubdiv[Index].NumEntries &&
-		     QuantizedColor != NULL;
-		     j++, QuantizedColor = QuantizedColor->Pnext) {
-			SortArray[j] = QuantizedColor;
-		}
-
-		/*
-		 * Because qsort isn't stable, this can produce differing
-		 * results for the order of tuples depending on platform
-		 * details of how qsort() is implemented.
-		 *
-		 * We mitigate this problem by sorting on all three axes rather
-		 * than only the one specied by SortRGBAxis; that way the
-		 * instability can only become an issue if there are multiple
-		 * color indices referring to identical RGB tuples.  Older
-		 * versions of this sorted on only the one axis.
-		 */
-		qsort(SortArray, NewColorSubdiv[Index].NumEntries,
-		      sizeof(QuantizedColorType *), SortCmpRtn);
-
-		/* Relink the sorted list into one: */
-		for (j = 0; j < NewColorSubdiv[Index].NumEntries - 1; j++) {
-			SortArray[j]->Pnext = SortArray[j + 1];
-		}
-		SortArray[NewColorSubdiv[Index].NumEntries - 1]->Pnext = NULL;
-		NewColorSubdiv[Index].QuantizedColors = QuantizedColor =
-		    SortArray[0];
-		free((char *)SortArray);
+		 * split at the median.  We sort on all three axes rather than
+		 * only the one specified by SortRGBAxis, so that the result
+		 * doesn't depend on how ties happen to be ordered.  */
+		QuantizedColor = Private->Colors + NewColorSubdiv[Index].First;
+		SortColors(QuantizedColor, Private->Scratch,
+		           NewColorSubdiv[Index].NumEntries, SortRGBAxis,
+		           Private->Bits);
 
 		/* Now simply add the Counts until we have half of the Count: */
-		Sum = NewColorSubdiv[Index].Count / 2 - QuantizedColor->Count;
+		Sum = NewColorSubdiv[Index].Count / 2 -
+		      (long)QuantizedColor[0].Count;
 		NumEntries = 1;
-		Count = QuantizedColor->Count;
-		while (QuantizedColor->Pnext != NULL &&
-		       (Sum -= QuantizedColor->Pnext->Count) >= 0 &&
-		       QuantizedColor->Pnext->Pnext != NULL) {
-			QuantizedColor = QuantizedColor->Pnext;
+		Count = QuantizedColor[0].Count;
+		while (NumEntries < NewColorSubdiv[Index].NumEntries &&
+		       (Sum -= (long)QuantizedColor[NumEntries].Count) >= 0 &&
+		       NumEntries + 1 < NewColorSubdiv[Index].NumEntries) {
+			Count += QuantizedColor[NumEntries].Count;
 			NumEntries++;
-			Count += QuantizedColor->Count;
 		}
 		/* Save the values of the last color of the first half, and
 		 * first of the second half so we can update the Bounding Boxes
 		 * later. Also as the colors are quantized and the BBoxes are
 		 * full 0..255, they need to be rescaled.
 		 */
-		MaxColor =
-		    QuantizedColor->RGB[SortRGBAxis]; /* Max. of first half */
-		/* coverity[var_deref_op] */
+		MaxColor = QuantizedColor[NumEntries - 1]
+		               .RGB[SortRGBAxis]; /* Max. of first half */
 		MinColor =
-		    // cppcheck-suppress nullPointerRedundantCheck
-		    QuantizedColor->Pnext->RGB[SortRGBAxis]; /* of second */
-		MaxColor <<= (8 - BITS_PER_PRIM_COLOR);
-		MinColor <<= (8 - BITS_PER_PRIM_COLOR);
+		    QuantizedColor[NumEntries].RGB[SortRGBAxis]; /* of second */
+		MaxColor <<= (8 - Private->Bits);
+		MinColor <<= (8 - Private->Bits);
 
 		/* Partition right here: */
-		NewColorSubdiv[*NewColorMapSize].QuantizedColors =
-		    QuantizedColor->Pnext;
-		QuantizedColor->Pnext = NULL;
+		NewColorSubdiv[*NewColorMapSize].First =
+		    NewColorSubdiv[Index].First + NumEntries;
 		NewColorSubdiv[*NewColorMapSize].Count = Count;
 		NewColorSubdiv[Index].Count -= Count;
 		NewColorSubdiv[*NewColorMapSize].NumEntries =
@@ -335,23 +2396,379 @@ static int SubdivColorMap(NewColorMapType *NewColorSubdiv,
 	return GIF_OK;
 }
 
+/******************************************************************************
+ Weighted mean of a run of colors, rounded to the nearest 8-bit level.
+******************************************************************************/
+static void MeanColor(const QuantizedColorType *Colors,
+                      unsigned int NumEntries, unsigned int Bits,
+                      GifColorType *Color) {
+	uint64_t Weight = 0, Sum[3] = {0, 0, 0};
+	unsigned int i, j;
+
+	for (i = 0; i < NumEntries; i++) {
+		Weight += Colors[i].Count;
+		for (j = 0; j < 3; j++) {
+			Sum[j] += (uint64_t)Colors[i].Count *
+			          LEVEL(Colors[i].RGB[j], Bits);
+		}
+	}
+	if (Weight == 0) {
+		return;
+	}
+	Color->Red = (Sum[0] + Weight / 2) / Weight;
+	Color->Green = (Sum[1] + Weight / 2) / Weight;
+	Color->Blue = (Sum[2] + Weight / 2) / Weight;
+}
+
+/******************************************************************************
+ Squared error of a run of colors about their weighted mean, along each
+ axis in Spread and in total as the return value.
+******************************************************************************/
+static double BoxSpread(const QuantizedColorType *Colors,
+                        unsigned int NumEntries, unsigned int Bits,
+                        double Spread[3]) {
+	double Weight = 0, Sum[3] = {0, 0, 0}, Squares[3] = {0, 0, 0};
+	unsigned int i, j;
+
+	for (i = 0; i < NumEntries; i++) {
+		Weight += Colors[i].Count;
+		for (j = 0; j < 3; j++) {
+			double Level = LEVEL(Colors[i].RGB[j], Bits);
+
+			Sum[j] += Colors[i].Count * Level;
+			Squares[j] += Colors[i].Count * Level * Level;
+		}
+	}
+	for (j = 0; j < 3; j++) {
+		Spread[j] = Weight > 0 ? Squares[j] - Sum[j] * Sum[j] / Weight : 0;
+	}
+	return Spread[0] + Spread[1] + Spread[2];
+}
+
+/******************************************************************************
+ Variance-based median cut.  The box with the largest squared error is
+ split along the axis where it is most spread, at the point where the two
+ halves' squared errors add up least.
+******************************************************************************/
+static void VarianceSubdivColorMap(QuantizerPrivateType *Private,
+                                   unsigned int ColorMapSize,
+                                   unsigned int *NewColorMapSize) {
+	NewColorMapType *NewColorSubdiv = Private->NewColorSubdiv;
+	unsigned int Bits = Private->Bits, i, j, Index, Cut, NumEntries;
+	QuantizedColorType *Colors;
+	double Spread[3];
+
+	NewColorSubdiv[0].Error = BoxSpread(
+	    Private->Colors, NewColorSubdiv[0].NumEntries, Bits, Spread);
+
+	while (ColorMapSize > *NewColorMapSize) {
+		double Weight = 0, Sum[3] = {0, 0, 0}, Squares = 0;
+		double LeftWeight = 0, Left[3] = {0, 0, 0}, LeftSquares = 0;
+		double Best = HUGE_VAL;
+		unsigned long Count = 0;
+		int Axis = 0;
+
+		/* Find candidate for subdivision: */
+		Index = *NewColorMapSize;
+		for (i = 0; i < *NewColorMapSize; i++) {
+			if (NewColorSubdiv[i].NumEntries > 1 &&
+			    (Index == *NewColorMapSize ||
+			     NewColorSubdiv[i].Error >
+			         NewColorSubdiv[Index].Error)) {
+				Index = i;
+			}
+		}
+		if (Index == *NewColorMapSize) {
+			return;
+		}
+
+		Colors = Private->Colors + NewColorSubdiv[Index].First;
+		NumEntries = NewColorSubdiv[Index].NumEntries;
+		(void)BoxSpread(Colors, NumEntries, Bits, Spread);
+		for (j = 1; j < 3; j++) {
+			if (Spread[j] > Spread[Axis]) {
+				Axis = j;
+			}
+		}
+		SortColors(Colors, Private->Scratch, NumEntries, Axis, Bits);
+
+		for (i = 0; i < NumEntries; i++) {
+			Weight += Colors[i].Count;
+			for (j = 0; j < 3; j++) {
+				double Level = LEVEL(Colors[i].RGB[j], Bits);
+
+				Sum[j] += Colors[i].Count * Level;
+				Squares += Colors[i].Count * Level * Level;
+			}
+		}
+		/* Squared error of each half is its sum of squares less
+		 * |sum|^2 / weight, so one running pass finds the best cut. */
+		for (Cut = 1, i = 1; i < NumEntries; i++) {
+			double Error, RightWeight;
+
+			LeftWeight += Colors[i - 1].Count;
+			for (j = 0; j < 3; j++) {
+				double Level =
+				    LEVEL(Colors[i - 1].RGB[j], Bits);
+
+				Left[j] += Colors[i - 1].Count * Level;
+				LeftSquares += Colors[i - 1].Count * Level * Level;
+			}
+			RightWeight = Weight - LeftWeight;
+			Error = Squares -
+			        (SQR(Left[0]) + SQR(Left[1]) + SQR(Left[2])) /
+			            LeftWeight -
+			        (SQR(Sum[0] - Left[0]) + SQR(Sum[1] - Left[1]) +
+			         SQR(Sum[2] - Left[2])) /
+			            RightWeight;
+			if (Error < Best) {
+				Best = Error;
+				Cut = i;
+			}
+		}
+		for (i = 0; i < Cut; i++) {
+			Count += Colors[i].Count;
+		}
+
+		/* Partition right here: */
+		NewColorSubdiv[*NewColorMapSize].First =
+		    NewColorSubdiv[Index].First + Cut;
+		NewColorSubdiv[*NewColorMapSize].NumEntries = NumEntries - Cut;
+		NewColorSubdiv[*NewColorMapSize].Count =
+		    NewColorSubdiv[Index].Count - Count;
+		NewColorSubdiv[*NewColorMapSize].Error =
+		    BoxSpread(Colors + Cut, NumEntries - Cut, Bits, Spread);
+		NewColorSubdiv[Index].NumEntries = Cut;
+		NewColorSubdiv[Index].Count = Count;
+		NewColorSubdiv[Index].Error =
+		    BoxSpread(Colors, Cut, Bits, Spread);
+
+		(*NewColorMapSize)++;
+	}
+}
+
 /****************************************************************************
- Routine called by qsort to compare two entries.
+ Routines called by qsort to order octree nodes, least used first or in
+ octree order.  Ties are broken by position so the result is the same on
+ every platform.
  *****************************************************************************/
+static int NodeCountCmp(const void *Entry1, const void *Entry2) {
+	const OctreeNodeType *Node1 = (const OctreeNodeType *)Entry1;
+	const OctreeNodeType *Node2 = (const OctreeNodeType *)Entry2;
+
+	if (Node1->Count != Node2->Count) {
+		return Node1->Count < Node2->Count ? -1 : 1;
+	}
+	return Node1->First < Node2->First ? -1 : 1;
+}
+
+static int NodeFirstCmp(const void *Entry1, const void *Entry2) {
+	const OctreeNodeType *Node1 = (const OctreeNodeType *)Entry1;
+	const OctreeNodeType *Node2 = (const OctreeNodeType *)Entry2;
+
+	return Node1->First < Node2->First ? -1 : Node1->First > Node2->First;
+}
+
+/******************************************************************************
+ Octree palette.  Colors are put in octree order - their primaries' bits
+ interleaved, most significant first - so that every octree node is a run
+ of Colors.  Then, deepest level first and least used node first, nodes
+ have their children merged into one leaf until no more than ColorMapSize
+ leaves are left.  Each leaf's weighted mean is a palette color.
+ Returns GIF_ERROR if out of memory.
+******************************************************************************/
+static int OctreeColorMap(QuantizerPrivateType *Private,
+                          unsigned int NumOfEntries, unsigned int ColorMapSize,
+                          unsigned int *NewColorMapSize,
+                          GifColorType *OutputColorMap) {
+	QuantizedColorType *Colors = Private->Colors, *From, *To, *Swap;
+	unsigned int Bits = Private->Bits, Leaves = NumOfEntries, NumNodes = 0;
+	unsigned int Offsets[256], Sum, Digit, Shift = 0, i, j, Next;
+	OctreeNodeType *Nodes = NULL;
+	int Depth, b;
+
+	*NewColorMapSize = 0;
+	if (NumOfEntries == 0) {
+		return GIF_OK;
+	}
+	for (i = 0; i < NumOfEntries; i++) {
+		uint32_t Key = 0;
+
+		for (b = Bits - 1; b >= 0; b--) {
+			Key = (Key << 3) | (((Colors[i].RGB[0] >> b) & 1) << 2) |
+			      (((Colors[i].RGB[1] >> b) & 1) << 1) |
+			      ((Colors[i].RGB[2] >> b) & 1);
+		}
+		Colors[i].Key = Key;
+	}
+	/* Radix sort on the key, a byte at a time */
+	From = Colors;
+	To = Private->Scratch;
+	for (Digit = 0; Digit < 3 * Bits; Digit += 8) {
+		memset(Offsets, 0, sizeof(Offsets));
+		for (i = 0; i < NumOfEntries; i++) {
+			Offsets[(From[i].Key >> Digit) & 0xff]++;
+		}
+		for (Sum = 0, i = 0; i < 256; i++) {
+			j = Offsets[i];
+			Offsets[i] = Sum;
+			Sum += j;
+		}
+		for (i = 0; i < NumOfEntries; i++) {
+			To[Offsets[(From[i].Key >> Digit) & 0xff]++] = From[i];
+		}
+		Swap = From;
+		From = To;
+		To = Swap;
+	}
+	if (From != Colors) {
+		memcpy(Colors, From, NumOfEntries * sizeof(QuantizedColorType));
+	}
+
+	if (Leaves > ColorMapSize) {
+		Nodes = (OctreeNodeType *)malloc(NumOfEntries *
+		                                 sizeof(OctreeNodeType));
+		if (Nodes == NULL) {
+			return GIF_ERROR;
+		}
+	}
+	for (Depth = Bits - 1; Leaves > ColorMapSize; Depth--) {
+		/* The nodes at this depth; all those below are leaves */
+		Shift = 3 * (Bits - Depth);
+		for (NumNodes = 0, i = 0; i < NumOfEntries; i = Next) {
+			OctreeNodeType *Node = &Nodes[NumNodes++];
+
+			Node->First = i;
+			Node->Children = 0;
+			Node->Count = 0;
+			Node->Merged = false;
+			for (Next = i; Next < NumOfEntries &&
+			               Colors[Next].Key >> Shift ==
+			                   Colors[i].Key >> Shift;
+			     Next++) {
+				if (Next == i ||
+				    Colors[Next].Key >> (Shift - 3) !=
+				        Colors[Next - 1].Key >> (Shift - 3)) {
+					Node->Children++;
+				}
+				Node->Count += Colors[Next].Count;
+			}
+			Node->NumEntries = Next - i;
+		}
+		qsort(Nodes, NumNodes, sizeof(OctreeNodeType), NodeCountCmp);
+		for (i = 0; i < NumNodes && Leaves > ColorMapSize; i++) {
+			Nodes[i].Merged = true;
+			Leaves -= Nodes[i].Children - 1;
+		}
+		qsort(Nodes, NumNodes, sizeof(OctreeNodeType), NodeFirstCmp);
+	}
 
-static int SortCmpRtn(const void *Entry1, const void *Entry2) {
-	QuantizedColorType *entry1 = (*((QuantizedColorType **)Entry1));
-	QuantizedColorType *entry2 = (*((QuantizedColorType **)Entry2));
+	/* One palette entry per leaf: */
+	for (i = 0, j = 0; i < NumOfEntries; i = Next) {
+		if (Nodes == NULL) {
+			Next = i + 1;
+		} else if (Nodes[j].Merged) {
+			Next = i + Nodes[j].NumEntries;
+		} else {
+			for (Next = i + 1; Next < NumOfEntries &&
+			                   Colors[Next].Key >> (Shift - 3) ==
+			                       Colors[i].Key >> (Shift - 3);
+			     Next++) {
+				;
+			}
+		}
+		if (Nodes != NULL && Next == Nodes[j].First + Nodes[j].NumEntries) {
+			j++;
+		}
+		for (b = i; b < Next; b++) {
+			Colors[b].NewColorIndex = *NewColorMapSize;
+		}
+		MeanColor(Colors + i, Next - i, Bits,
+		          &OutputColorMap[*NewColorMapSize]);
+		(*NewColorMapSize)++;
+	}
+
+	free((char *)Nodes);
+	return GIF_OK;
+}
+
+/******************************************************************************
+ Index of the color in ColorMap nearest to (Red, Green, Blue).
+******************************************************************************/
+static int NearestColor(const GifColorType *ColorMap, unsigned int Size,
+                        int Red, int Green, int Blue) {
+	int Best = INT_MAX, Nearest = 0, Distance;
+	unsigned int i;
+
+	for (i = 0; i < Size; i++) {
+		Distance = SQR(ColorMap[i].Red - Red);
+		if (Distance >= Best) {
+			continue;
+		}
+		Distance += SQR(ColorMap[i].Green - Green);
+		if (Distance >= Best) {
+			continue;
+		}
+		Distance += SQR(ColorMap[i].Blue - Blue);
+		if (Distance < Best) {
+			Best = Distance;
+			Nearest = i;
+		}
+	}
+	return Nearest;
+}
+
+/******************************************************************************
+ k-means refinement: move each palette color to the weighted mean of the
+ colors nearest to it, and repeat, up to Iterations times or until nothing
+ moves.  Every color is left pointing at its nearest palette entry.
+******************************************************************************/
+static void RefineColorMap(QuantizerPrivateType *Private,
+                           unsigned int NumOfEntries,
+                           unsigned int ColorMapSize,
+                           GifColorType *OutputColorMap, int Iterations) {
+	QuantizedColorType *Colors = Private->Colors;
+	unsigned int Bits = Private->Bits, i, j;
+	uint64_t Weight[256], Sum[256][3];
+	int Pass, Nearest;
+	bool Moved;
 
-	/* sort on all axes of the color space! */
-	int hash1 = entry1->RGB[SortRGBAxis] * 256 * 256 +
-	            entry1->RGB[(SortRGBAxis + 1) % 3] * 256 +
-	            entry1->RGB[(SortRGBAxis + 2) % 3];
-	int hash2 = entry2->RGB[SortRGBAxis] * 256 * 256 +
-	            entry2->RGB[(SortRGBAxis + 1) % 3] * 256 +
-	            entry2->RGB[(SortRGBAxis + 2) % 3];
+	for (Pass = 0;; Pass++) {
+		Moved = false;
+		memset(Weight, 0, sizeof(Weight));
+		memset(Sum, 0, sizeof(Sum));
+		for (i = 0; i < NumOfEntries; i++) {
+			int Level[3];
 
-	return hash1 - hash2;
+			for (j = 0; j < 3; j++) {
+				Level[j] = LEVEL(Colors[i].RGB[j], Bits);
+			}
+			Nearest = NearestColor(OutputColorMap, ColorMapSize,
+			                       Level[0], Level[1], Level[2]);
+			if (Nearest != Colors[i].NewColorIndex) {
+				Colors[i].NewColorIndex = Nearest;
+				Moved = true;
+			}
+			Weight[Nearest] += Colors[i].Count;
+			for (j = 0; j < 3; j++) {
+				Sum[Nearest][j] +=
+				    (uint64_t)Colors[i].Count * Level[j];
+			}
+		}
+		if (Pass == Iterations || (Pass > 0 && !Moved)) {
+			break;
+		}
+		for (i = 0; i < ColorMapSize; i++) {
+			if (Weight[i] > 0) {
+				OutputColorMap[i].Red =
+				    (Sum[i][0] + Weight[i] / 2) / Weight[i];
+				OutputColorMap[i].Green =
+				    (Sum[i][1] + Weight[i] / 2) / Weight[i];
+				OutputColorMap[i].Blue =
+				    (Sum[i][2] + Weight[i] / 2) / Weight[i];
+			}
+		}
+	}
 }
 
 /* end */